@@ -0,0 +1,724 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitcask.h"
+#include "crc.h"
+#include "crc64speed.h"
+#include "ht.h"
+#include "s8.h"
+#include "shard.h"
+#include "utils.h"
+
+#define BENCH_BYTES ((isize)1 << 28)
+#define BENCH_ARENA_SIZE ((isize)1 << 34)
+
+#define RESTART_KEYS 2000000
+#define RESTART_VAL_LEN 100
+
+#define COMMIT_PUTS 20000
+
+#define BATCH_PUTS 1000000
+#define BATCH_LEN 1000
+#define COMMIT_MAX_THREADS 64
+
+#define IO_KEYS 200000
+#define IO_GETS 200000
+#define IO_MAX_DEPTH 64
+
+#define READERS_KEYS 200000
+#define READERS_GETS 500000
+#define READERS_MAX_THREADS 16
+#define READERS_SCRATCH_SIZE ((isize)1 << 20)
+
+#define SHARDS_PUTS 1000000
+#define SHARDS_THREADS 8
+#define SHARDS_MAX_COUNT 16
+
+#define MERGE_KEYS 100000
+#define MERGE_PUTS 2000000
+#define MERGE_RATE_LIMIT ((isize)1 << 26)
+#define MERGE_THREADS_KEYS 1000000
+#define MERGE_THREADS_PUTS 2000000
+#define MERGE_MAX_THREADS 8
+
+#define CRC_MAX_LEN ((isize)1 << 20)
+
+private double now(void);
+private u64 fnv1a(s8 key);
+private void benchHash(void);
+private Arena newArena(void);
+private int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
+private void benchRestart(void);
+private void *commitWorker(void *arg);
+private void benchCommit(void);
+private void benchBatch(void);
+private void benchIo(void);
+private void *readerWorker(void *arg);
+private void *writerWorker(void *arg);
+private void benchReaders(void);
+private void *shardWorker(void *arg);
+private void benchShards(void);
+private int compareDoubles(const void *a, const void *b);
+private void benchMerge(void);
+private void benchMergeThreads(void);
+private void benchCrc(void);
+
+private double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The keydir hash before it was replaced by wyhash, kept as the baseline.
+private u64 fnv1a(s8 key) {
+  u64 hash = 0XCBF29CE484222325;
+
+  for (isize i = 0; i < key.len; i++) {
+    hash ^= key.data[i];
+    hash *= 0x00000100000001B3;
+  }
+
+  return hash;
+}
+
+private void benchHash(void) {
+  static char buffer[4096 + 64];
+  for (isize i = 0; i < countof(buffer); i++) buffer[i] = (char)(i * 131 + 7);
+
+  isize key_lens[] = {4, 8, 12, 16, 24, 32, 48, 64, 128, 256, 1024, 4096};
+  volatile u64 sink = 0;
+
+  printf("%-10s %14s %14s %10s\n", "key_len", "fnv1a ns/key", "wyhash ns/key", "speedup");
+  for (isize i = 0; i < countof(key_lens); i++) {
+    isize iterations = BENCH_BYTES / (key_lens[i] + 16);
+    double elapsed[2];
+
+    for (i8 h = 0; h < 2; h++) {
+      u64 acc = 0;
+      double start = now();
+      for (isize j = 0; j < iterations; j++) {
+        // Shift the key a little on every iteration so the hash cannot be hoisted out of the loop.
+        s8 key = {.data = buffer + (j & 63), .len = key_lens[i]};
+        acc += h == 0 ? fnv1a(key) : ht_hash(key);
+      }
+      elapsed[h] = now() - start;
+      sink += acc;
+    }
+
+    printf("%-10td %14.2f %14.2f %9.2fx\n", key_lens[i], elapsed[0] * 1e9 / iterations,
+           elapsed[1] * 1e9 / iterations, elapsed[0] / elapsed[1]);
+  }
+}
+
+private Arena newArena(void) {
+  char *heap = mmap(NULL, BENCH_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (heap == MAP_FAILED) return (Arena){0};
+  return (Arena){.beg = heap, .end = heap + BENCH_ARENA_SIZE};
+}
+
+private int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  (void)st, (void)flag, (void)ftw;
+  return remove(path);
+}
+
+// Time bc_open of a store with RESTART_KEYS keys spread over several data files, with an
+// increasing number of recovery threads.
+private void benchRestart(void) {
+  char dir_path[] = "/tmp/bitcask-bench-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  Options options = {.read_write = true, .max_file_size = (isize)1 << 25};
+  Arena arena = newArena();
+  BcHandleResult bc_res = bc_open(arena, dir, options);
+  if (!bc_res.is_ok) return;
+
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  for (u32 i = 0; i < RESTART_KEYS; i++) {
+    char key_data[32];
+    s8 key = {.data = key_data, .len = snprintf(key_data, 32, "restart-key-%u", i)};
+    bc_put(&bc_res.bc, key, val);
+  }
+  bc_close(&bc_res.bc);
+  munmap(arena.beg, BENCH_ARENA_SIZE);
+
+  char snapshot_path[64];
+  snprintf(snapshot_path, sizeof(snapshot_path), "%s/keydir.snapshot", dir_path);
+
+  // Every count is timed twice: replaying the hint files alone, then loading the snapshot written
+  // by the bc_close of the first open.
+  printf("%-10s %12s %12s\n", "threads", "hints ms", "snapshot ms");
+  isize cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (isize threads = 1;; threads *= 2) {
+    if (threads > cpus) threads = cpus;
+    options.recovery_threads = threads;
+
+    double elapsed[2] = {0};
+    for (i8 run = 0; run < 2; run++) {
+      if (run == 0) unlink(snapshot_path);
+
+      arena = newArena();
+      double start = now();
+      bc_res = bc_open(arena, dir, options);
+      elapsed[run] = now() - start;
+
+      if (bc_res.is_ok) bc_close(&bc_res.bc);
+      munmap(arena.beg, BENCH_ARENA_SIZE);
+    }
+
+    printf("%-10td %12.1f %12.1f\n", threads, elapsed[0] * 1e3, elapsed[1] * 1e3);
+    if (threads == cpus) break;
+  }
+
+  nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+typedef struct {
+  BcHandle *bc;
+  isize puts;
+  u32 id;
+} CommitWorker;
+
+private void *commitWorker(void *arg) {
+  CommitWorker *worker = arg;
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  for (isize i = 0; i < worker->puts; i++) {
+    char key_data[32];
+    s8 key = {.data = key_data, .len = snprintf(key_data, 32, "commit-%u-%td", worker->id, i)};
+    bc_put(worker->bc, key, val);
+  }
+
+  return NULL;
+}
+
+// Durable puts per second with one fdatasync per put, then with group commit and an increasing
+// number of writer threads. The store is created in the working directory, since syncs on a tmpfs
+// /tmp cost nothing.
+private void benchCommit(void) {
+  char dir_path[] = "bitcask-commit-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  printf("%-14s %8s %12s %8s %12s %12s\n", "mode", "threads", "puts/s", "syncs", "avg us",
+         "max us");
+  for (isize threads = 0; threads <= COMMIT_MAX_THREADS; threads = threads == 0 ? 1 : 4 * threads) {
+    Options options = {
+        .read_write = true,
+        .max_file_size = (isize)1 << 25,
+        .sync_on_put = threads == 0,
+        .group_commit = threads > 0,
+    };
+
+    Arena arena = newArena();
+    BcHandleResult bc_res = bc_open(arena, dir, options);
+    if (!bc_res.is_ok) return;
+
+    // sync_on_put is only measured with a single writer, puts are not thread safe without group
+    // commit.
+    isize threads_num = threads == 0 ? 1 : threads;
+    CommitWorker workers[COMMIT_MAX_THREADS];
+    pthread_t handles[COMMIT_MAX_THREADS];
+
+    double start = now();
+    for (isize i = 0; i < threads_num; i++) {
+      workers[i] = (CommitWorker){.bc = &bc_res.bc, .puts = COMMIT_PUTS / threads_num, .id = i};
+      pthread_create(handles + i, NULL, commitWorker, workers + i);
+    }
+    for (isize i = 0; i < threads_num; i++) pthread_join(handles[i], NULL);
+    double elapsed = now() - start;
+
+    CommitStats stats = bc_commit_stats(&bc_res.bc);
+    isize puts = threads_num * (COMMIT_PUTS / threads_num);
+    printf("%-14s %8td %12.0f %8td %12.1f %12.1f\n",
+           threads == 0 ? "sync_on_put" : "group_commit", threads_num, puts / elapsed,
+           threads == 0 ? puts : stats.syncs,
+           stats.puts > 0 ? stats.latency_total_ns / 1e3 / stats.puts : elapsed * 1e6 / puts,
+           stats.latency_max_ns / 1e3);
+
+    bc_close(&bc_res.bc);
+    munmap(arena.beg, BENCH_ARENA_SIZE);
+    nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+}
+
+// Ingest rate of BATCH_PUTS puts issued one by one, then in batches of BATCH_LEN.
+private void benchBatch(void) {
+  char dir_path[] = "/tmp/bitcask-bench-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  printf("%-10s %12s\n", "mode", "puts/s");
+  for (i8 is_batched = 0; is_batched < 2; is_batched++) {
+    Options options = {.read_write = true, .max_file_size = (isize)1 << 25};
+    Arena arena = newArena();
+    BcHandleResult bc_res = bc_open(arena, dir, options);
+    if (!bc_res.is_ok) return;
+
+    Arena batch_arena = newArena();
+    BcBatch batch = bc_batch_create(&batch_arena);
+
+    double start = now();
+    for (u32 i = 0; i < BATCH_PUTS; i++) {
+      char key_data[32];
+      s8 key = {.data = key_data, .len = snprintf(key_data, 32, "batch-key-%u", i)};
+      if (!is_batched) {
+        bc_put(&bc_res.bc, key, val);
+        continue;
+      }
+
+      bc_batch_put(&batch, key, val);
+      if (batch.count == BATCH_LEN) {
+        bc_write_batch(&bc_res.bc, &batch);
+        batch.len = 0;
+        batch.count = 0;
+      }
+    }
+    bc_sync(&bc_res.bc);
+    double elapsed = now() - start;
+
+    printf("%-10s %12.0f\n", is_batched ? "batch" : "put", BATCH_PUTS / elapsed);
+
+    bc_close(&bc_res.bc);
+    munmap(arena.beg, BENCH_ARENA_SIZE);
+    munmap(batch_arena.beg, BENCH_ARENA_SIZE);
+    nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+}
+
+// Random gets per second with bc_get, then through bc_submit keeping an increasing number of
+// them in flight. Like the commit benchmark the store is kept out of /tmp. Only a build with
+// IO_URING=-DBC_IO_URING has a ring, otherwise every depth runs the blocking path.
+private void benchIo(void) {
+  char dir_path[] = "bitcask-io-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  Options options = {.read_write = true, .max_file_size = (isize)1 << 25, .io_uring = true};
+  Arena arena = newArena();
+  BcHandleResult bc_res = bc_open(arena, dir, options);
+  if (!bc_res.is_ok) return;
+
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  for (u32 i = 0; i < IO_KEYS; i++) {
+    char key_data[32];
+    s8 key = {.data = key_data, .len = snprintf(key_data, 32, "io-key-%u", i)};
+    bc_put(&bc_res.bc, key, val);
+  }
+  bc_sync(&bc_res.bc);
+
+  BcHandle *bc = &bc_res.bc;
+  static char key_data[IO_MAX_DEPTH][32];
+  BcIo ios[IO_MAX_DEPTH];
+  BcIo *done[IO_MAX_DEPTH];
+  Arena scratch = newArena();
+
+  printf("ring %s\n", bc->io->has_ring ? "yes" : "no");
+  printf("%-10s %12s\n", "depth", "gets/s");
+  for (isize depth = 0; depth <= IO_MAX_DEPTH; depth = depth == 0 ? 1 : 8 * depth) {
+    u64 state = 0x9E3779B97F4A7C15;
+    Arena temp = scratch;
+
+    double start = now();
+    if (depth == 0) {
+      for (isize i = 0; i < IO_GETS; i++) {
+        state = state * 6364136223846793005 + 1442695040888963407;
+        u32 num = (state >> 33) % IO_KEYS;
+        s8 key = {.data = key_data[0], .len = snprintf(key_data[0], 32, "io-key-%u", num)};
+        bc_get(bc, key, &temp);
+      }
+    } else {
+      // Every completed get is replaced right away, so that depth of them stay in flight.
+      isize issued = 0;
+      isize in_flight = 0;
+      isize free_len = depth;
+      for (isize i = 0; i < depth; i++) done[i] = ios + i;
+
+      while (issued < IO_GETS || in_flight > 0) {
+        for (; free_len > 0 && issued < IO_GETS; free_len--, issued++, in_flight++) {
+          BcIo *io = done[free_len - 1];
+          char *data = key_data[io - ios];
+          state = state * 6364136223846793005 + 1442695040888963407;
+          u32 num = (state >> 33) % IO_KEYS;
+
+          *io = (BcIo){.op = BC_IO_GET, .key = {data, snprintf(data, 32, "io-key-%u", num)}};
+          bc_submit(bc, io, &temp);
+        }
+
+        free_len = bc_complete(bc, done, depth, 1);
+        in_flight -= free_len;
+      }
+    }
+    double elapsed = now() - start;
+
+    char label[16] = "bc_get";
+    if (depth > 0) snprintf(label, sizeof(label), "%td", depth);
+    printf("%-10s %12.0f\n", label, IO_GETS / elapsed);
+  }
+
+  bc_close(bc);
+  munmap(arena.beg, BENCH_ARENA_SIZE);
+  munmap(scratch.beg, BENCH_ARENA_SIZE);
+  nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+typedef struct {
+  BcHandle *bc;
+  Arena scratch;
+  _Atomic bool *is_done;
+  isize gets;
+  u32 id;
+} ReaderWorker;
+
+private void *readerWorker(void *arg) {
+  ReaderWorker *worker = arg;
+  u64 state = 0x9E3779B97F4A7C15 + worker->id;
+
+  for (isize i = 0; i < worker->gets; i++) {
+    state = state * 6364136223846793005 + 1442695040888963407;
+    char key_data[32];
+    u32 num = (state >> 33) % READERS_KEYS;
+    s8 key = {.data = key_data, .len = snprintf(key_data, 32, "reader-key-%u", num)};
+
+    Arena temp = worker->scratch;
+    bc_get(worker->bc, key, &temp);
+  }
+
+  return NULL;
+}
+
+// Overwrites the stored keys until the readers are done.
+private void *writerWorker(void *arg) {
+  ReaderWorker *worker = arg;
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'w', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  for (u32 i = 0; !*worker->is_done; i = (i + 1) % READERS_KEYS) {
+    char key_data[32];
+    s8 key = {.data = key_data, .len = snprintf(key_data, 32, "reader-key-%u", i)};
+    bc_put(worker->bc, key, val);
+  }
+
+  return NULL;
+}
+
+// Random gets per second with Options.concurrent_reads and an increasing number of reader threads,
+// first alone and then next to a thread that keeps overwriting the keys.
+private void benchReaders(void) {
+  char dir_path[] = "/tmp/bitcask-bench-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  Options options = {
+      .read_write = true, .max_file_size = (isize)1 << 25, .concurrent_reads = true};
+  Arena arena = newArena();
+  BcHandleResult bc_res = bc_open(arena, dir, options);
+  if (!bc_res.is_ok) return;
+
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  for (u32 i = 0; i < READERS_KEYS; i++) {
+    char key_data[32];
+    s8 key = {.data = key_data, .len = snprintf(key_data, 32, "reader-key-%u", i)};
+    bc_put(&bc_res.bc, key, val);
+  }
+  bc_sync(&bc_res.bc);
+
+  Arena scratch = newArena();
+  printf("%-8s %8s %12s\n", "writer", "threads", "gets/s");
+  for (i8 has_writer = 0; has_writer < 2; has_writer++) {
+    for (isize threads = 1; threads <= READERS_MAX_THREADS; threads *= 2) {
+      _Atomic bool is_done = false;
+      ReaderWorker workers[READERS_MAX_THREADS + 1];
+      pthread_t handles[READERS_MAX_THREADS + 1];
+
+      workers[threads] = (ReaderWorker){.bc = &bc_res.bc, .is_done = &is_done};
+      if (has_writer) pthread_create(handles + threads, NULL, writerWorker, workers + threads);
+
+      double start = now();
+      for (isize i = 0; i < threads; i++) {
+        char *beg = scratch.beg + i * READERS_SCRATCH_SIZE;
+        workers[i] = (ReaderWorker){
+            .bc = &bc_res.bc,
+            .scratch = {.beg = beg, .end = beg + READERS_SCRATCH_SIZE},
+            .gets = READERS_GETS / threads,
+            .id = i,
+        };
+        pthread_create(handles + i, NULL, readerWorker, workers + i);
+      }
+      for (isize i = 0; i < threads; i++) pthread_join(handles[i], NULL);
+      double elapsed = now() - start;
+
+      is_done = true;
+      if (has_writer) pthread_join(handles[threads], NULL);
+
+      isize gets = threads * (READERS_GETS / threads);
+      printf("%-8s %8td %12.0f\n", has_writer ? "yes" : "no", threads, gets / elapsed);
+    }
+  }
+
+  bc_close(&bc_res.bc);
+  munmap(arena.beg, BENCH_ARENA_SIZE);
+  munmap(scratch.beg, BENCH_ARENA_SIZE);
+  nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+typedef struct {
+  BcSharded *sh;
+  isize puts;
+  u32 id;
+} ShardWorker;
+
+private void *shardWorker(void *arg) {
+  ShardWorker *worker = arg;
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  for (isize i = 0; i < worker->puts; i++) {
+    char key_data[32];
+    s8 key = {.data = key_data, .len = snprintf(key_data, 32, "shard-%u-%td", worker->id, i)};
+    bc_sharded_put(worker->sh, key, val);
+  }
+
+  return NULL;
+}
+
+// Puts per second of SHARDS_THREADS writer threads into a sharded store with an increasing number
+// of shards. A single shard is one handle behind one lock.
+private void benchShards(void) {
+  char dir_path[] = "/tmp/bitcask-bench-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  printf("%-8s %8s %12s\n", "shards", "threads", "puts/s");
+  for (isize shards = 1; shards <= SHARDS_MAX_COUNT; shards *= 2) {
+    Options options = {.read_write = true, .max_file_size = (isize)1 << 25};
+    Arena arena = newArena();
+    BcShardedResult sh_res = bc_sharded_open(arena, dir, shards, options);
+    if (!sh_res.is_ok) return;
+
+    ShardWorker workers[SHARDS_THREADS];
+    pthread_t handles[SHARDS_THREADS];
+
+    double start = now();
+    for (isize i = 0; i < SHARDS_THREADS; i++) {
+      workers[i] = (ShardWorker){.sh = &sh_res.sh, .puts = SHARDS_PUTS / SHARDS_THREADS, .id = i};
+      pthread_create(handles + i, NULL, shardWorker, workers + i);
+    }
+    for (isize i = 0; i < SHARDS_THREADS; i++) pthread_join(handles[i], NULL);
+    bc_sharded_sync(&sh_res.sh);
+    double elapsed = now() - start;
+
+    isize puts = SHARDS_THREADS * (SHARDS_PUTS / SHARDS_THREADS);
+    printf("%-8td %8d %12.0f\n", shards, SHARDS_THREADS, puts / elapsed);
+
+    bc_sharded_close(&sh_res.sh);
+    munmap(arena.beg, BENCH_ARENA_SIZE);
+    nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+}
+
+private int compareDoubles(const void *a, const void *b) {
+  double x = *(double *)a;
+  double y = *(double *)b;
+  return (x > y) - (x < y);
+}
+
+// Put latency while MERGE_PUTS puts overwrite MERGE_KEYS keys, without a background merge, with
+// one and with one limited to MERGE_RATE_LIMIT bytes per second. The store is kept out of /tmp,
+// like in the commit benchmark, so that the merge competes for a real disk.
+private void benchMerge(void) {
+  char dir_path[] = "bitcask-merge-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  Arena latency_arena = newArena();
+  double *latencies = new (&latency_arena, double, MERGE_PUTS, NOZERO);
+  if (latencies == NULL) return;
+
+  printf("%-10s %12s %10s %10s %10s\n", "merge", "puts/s", "p99 us", "max us", "files");
+  for (i8 mode = 0; mode < 3; mode++) {
+    Options options = {
+        .read_write = true,
+        .max_file_size = (isize)1 << 22,
+        .background_merge = mode > 0,
+        .merge_rate_limit = mode == 2 ? MERGE_RATE_LIMIT : 0,
+    };
+    Arena arena = newArena();
+    BcHandleResult bc_res = bc_open(arena, dir, options);
+    if (!bc_res.is_ok) return;
+
+    double start = now();
+    for (u32 i = 0; i < MERGE_PUTS; i++) {
+      char key_data[32];
+      s8 key = {.data = key_data, .len = snprintf(key_data, 32, "merge-key-%u", i % MERGE_KEYS)};
+
+      double put_start = now();
+      bc_put(&bc_res.bc, key, val);
+      latencies[i] = now() - put_start;
+    }
+    double elapsed = now() - start;
+
+    isize files = bc_res.bc.num_files;
+    if (bc_res.bc.merge != NULL) files -= bc_res.bc.merge->sources_next;
+    bc_close(&bc_res.bc);
+
+    qsort(latencies, MERGE_PUTS, sizeof(double), compareDoubles);
+    char *label = mode == 0 ? "off" : mode == 1 ? "on" : "limited";
+    printf("%-10s %12.0f %10.1f %10.1f %10td\n", label, MERGE_PUTS / elapsed,
+           latencies[MERGE_PUTS * 99 / 100] * 1e6, latencies[MERGE_PUTS - 1] * 1e6, files);
+
+    munmap(arena.beg, BENCH_ARENA_SIZE);
+    nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  munmap(latency_arena.beg, BENCH_ARENA_SIZE);
+}
+
+// Time of a bc_merge of a store where MERGE_THREADS_PUTS puts overwrote MERGE_THREADS_KEYS keys in
+// scattered order, so that every file is partly dead, with one to MERGE_MAX_THREADS threads.
+private void benchMergeThreads(void) {
+  char dir_path[] = "bitcask-merge-threads-XXXXXX";
+  if (mkdtemp(dir_path) == NULL || rmdir(dir_path) == -1) return;
+  s8 dir = {.data = dir_path, .len = lengthof(dir_path)};
+
+  char val_data[RESTART_VAL_LEN];
+  memset(val_data, 'v', RESTART_VAL_LEN);
+  s8 val = {.data = val_data, .len = RESTART_VAL_LEN};
+
+  printf("%-10s %12s %12s\n", "threads", "seconds", "MiB/s");
+  for (isize threads = 1; threads <= MERGE_MAX_THREADS; threads *= 2) {
+    Options options = {
+        .read_write = true,
+        .max_file_size = (isize)1 << 24,
+        .merge_threads = threads,
+    };
+    Arena arena = newArena();
+    BcHandleResult bc_res = bc_open(arena, dir, options);
+    if (!bc_res.is_ok) return;
+
+    for (u32 i = 0; i < MERGE_THREADS_PUTS; i++) {
+      char key_data[32];
+      u32 key_num = (u32)(i * 2654435761u) % MERGE_THREADS_KEYS;
+      s8 key = {.data = key_data, .len = snprintf(key_data, 32, "merge-key-%u", key_num)};
+      bc_put(&bc_res.bc, key, val);
+    }
+    bc_sync(&bc_res.bc);
+
+    isize bytes = 0;
+    BcFileStats stats[1024];
+    isize len = bc_file_stats(&bc_res.bc, stats, countof(stats));
+    for (isize i = 0; i < len && i < countof(stats); i++) {
+      bytes += stats[i].stats.live_bytes + stats[i].stats.dead_bytes;
+    }
+
+    double start = now();
+    bc_merge(&bc_res.bc);
+    double elapsed = now() - start;
+
+    bc_close(&bc_res.bc);
+    printf("%-10td %12.3f %12.1f\n", threads, elapsed, bytes / elapsed / (1 << 20));
+
+    munmap(arena.beg, BENCH_ARENA_SIZE);
+    nftw(dir_path, removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+}
+
+// Checksum throughput of the slicing tables crc_64 falls back to, of crc_64 itself and of the
+// crc_32c of Options.crc32c_records, over buffers from a small record to a whole merge read.
+private void benchCrc(void) {
+  static char buffer[CRC_MAX_LEN + 64];
+  for (isize i = 0; i < countof(buffer); i++) buffer[i] = (char)(i * 131 + 7);
+
+  crc_init();
+  printf("%s\n", crc_implementation());
+
+  isize lens[] = {16, 64, 256, 1024, 4096, 16384, 65536, CRC_MAX_LEN};
+  volatile u64 sink = 0;
+
+  printf("%-10s %12s %12s %12s %10s\n", "len", "table GB/s", "crc64 GB/s", "crc32c GB/s",
+         "speedup");
+  for (isize i = 0; i < countof(lens); i++) {
+    isize iterations = 4 * BENCH_BYTES / lens[i];
+    double elapsed[3];
+
+    for (i8 c = 0; c < 3; c++) {
+      u64 acc = 0;
+      double start = now();
+      for (isize j = 0; j < iterations; j++) {
+        char *data = buffer + (j & 63);
+        if (c == 0) acc += crc64speed(acc, data, lens[i]);
+        if (c == 1) acc += crc_64(acc, data, lens[i]);
+        if (c == 2) acc += crc_32c(acc, data, lens[i]);
+      }
+      elapsed[c] = now() - start;
+      sink += acc;
+    }
+
+    double bytes = (double)iterations * lens[i];
+    printf("%-10td %12.2f %12.2f %12.2f %9.2fx\n", lens[i], bytes / elapsed[0] / 1e9,
+           bytes / elapsed[1] / 1e9, bytes / elapsed[2] / 1e9, elapsed[0] / elapsed[1]);
+  }
+}
+
+int main(int argc, char **argv) {
+  bool all = argc < 2;
+
+  if (all || strcmp(argv[1], "hash") == 0) benchHash();
+  if (all || strcmp(argv[1], "restart") == 0) benchRestart();
+  if (all || strcmp(argv[1], "commit") == 0) benchCommit();
+  if (all || strcmp(argv[1], "batch") == 0) benchBatch();
+  if (all || strcmp(argv[1], "io") == 0) benchIo();
+  if (all || strcmp(argv[1], "readers") == 0) benchReaders();
+  if (all || strcmp(argv[1], "shards") == 0) benchShards();
+  if (all || strcmp(argv[1], "merge") == 0) benchMerge();
+  if (all || strcmp(argv[1], "merge-threads") == 0) benchMergeThreads();
+  if (all || strcmp(argv[1], "crc") == 0) benchCrc();
+
+  return 0;
+}
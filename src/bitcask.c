@@ -14,40 +14,38 @@ Public License for more details.
 You should have received a copy of the GNU General Public License along with bitcask. If not, see
 <https://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE
+
 #include "bitcask.h"
 
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "alloc.h"
-#include "crc64speed.h"
+#include "crc.h"
 #include "ht.h"
+#include "internal.h"
 #include "utils.h"
 
-#define HEADER_SIZE sizeof(i64) + 2 * sizeof(isize)
-#define VAL_POS_SIZE sizeof(isize)
-
-#define KEY_LEN_OFFSET sizeof(i64)
-#define VAL_LEN_OFFSET KEY_LEN_OFFSET + sizeof(isize)
-#define KEY_OFFSET VAL_LEN_OFFSET + sizeof(isize)
 #define VAL_OFFSET(key_len) KEY_OFFSET + key_len
 #define CRC_OFFSET(key_len, val_len) VAL_OFFSET(key_len) + val_len
 
-typedef struct {
-  i64 timestamp;
-  isize key_len;
-  isize val_len;
-} Header;
-
 typedef struct {
   Header header;
   char *key;
@@ -56,26 +54,189 @@ typedef struct {
 
   char *buffer;
   isize buffer_len;
+  bool is_crc32c;
 } BcEntry;
 
+typedef struct {
+  s8 key;
+  u64 hash;
+  KeyDirEntry kd_entry;
+} ScanEntry;
+
+// One file replayed by growKeyDir. merged_num is the number of a merged file, whose hint lives in
+// the hint directory, or 0 for a data file, whose hint sits next to it. The file itself is only
+// scanned when its hint is missing or does not match it. Records before replay_pos are already in
+// the keydir loaded from a snapshot. valid_len is where the last complete record or batch ends.
+typedef struct {
+  u32 file_id;
+  isize merged_num;
+  isize replay_pos;
+  isize valid_len;
+  bool is_hint_used;
+
+  char *map;
+  isize map_len;
+  ScanEntry *entries;
+  isize entries_cap;
+  isize len;
+
+  bool is_ok;
+  bool is_done;
+} ScanJob;
+
+typedef struct {
+  u64 magic;
+  isize count;
+  isize keys_len;
+  isize data_len;
+} HintFileHeader;
+
+// A keydir snapshot covers every record before pos in data file num and every file written before
+// that one.
+typedef struct {
+  isize num;
+  isize pos;
+} Watermark;
+
+// A snapshot is this header, the files it refers to, the ctrl bytes of the keydir, one entry per
+// full slot in slot order, the key area and a crc64 of all of it.
+typedef struct {
+  u64 magic;
+  isize group_width;
+  isize capacity;
+  isize count;
+  isize files_len;
+  isize keys_len;
+  Watermark watermark;
+} SnapshotHeader;
+
+// size is checked against the file on disk, so a snapshot is not used once a file it refers to
+// was removed, replaced or lost records it points to.
+typedef struct {
+  isize num;
+  isize size;
+  isize dead_keys;
+  bool is_merged;
+} SnapshotFile;
+
+// file is an index into the snapshot's list of files.
+typedef struct {
+  u64 hash;
+  i64 timestamp;
+  isize val_pos;
+  isize val_len;
+  isize key_off;
+  isize key_len;
+  isize file;
+} SnapshotEntry;
+
+typedef struct {
+  ScanJob *jobs;
+  isize len;
+  atomic_ptrdiff_t next;
+
+  BcFile *files;
+  char *hint_dir_path;
+
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} ScanQueue;
+
+// A key of bc_multi_get found in the keydir, index is its position in the caller's arrays.
+typedef struct {
+  isize index;
+  isize record_len;
+  KeyDirEntry kd_entry;
+} MultiGetHit;
+
 private isize getRamSize(void);
-private char *getFileName(u32 num);
+private char *readSpan(BcHandle *bc, u32 file_id, isize pos, isize len, Arena *scratch);
+private int compareHits(const void *a, const void *b);
+private void getFileName(char *file_name, u32 num);
 private bool getNewFileHandle(BcHandle *bc);
+private bool putEntry(BcHandle *bc, s8 key, s8 val, bool is_delete);
+private bool appendBatch(BcHandle *bc, BcBatch *batch);
+private bool writeUnbuffered(WriteBuffer *wb, BcEntry bc_entry);
+private bool indexRecord(BcHandle *bc, s8 key, KeyDirEntry kd_entry, isize record_len);
+private bool streamAppend(WriteBuffer *wb, char *data, isize len);
+private bool streamWrite(BcPutStream *stream, char *data, isize len);
+private bool streamBegin(BcHandle *bc, BcGetStream *stream, s8 key);
+private bool streamRead(BcGetStream *stream, char *buffer, isize pos, isize len);
+private void streamCrc(BcGetStream *stream, char *data, isize len);
+private bool streamIsValid(BcGetStream *stream);
+private bool batchReserve(BcBatch *batch, isize len);
+private bool isBatchComplete(char *buffer, isize len);
+private bool commitStart(BcHandle *bc);
+private void commitStop(GroupCommit *commit);
+private void commitDone(GroupCommit *commit, i64 seq, bool is_ok);
+private bool commitFlush(GroupCommit *commit);
+private void *commitWorker(void *arg);
 private i64 getTimestamp(void);
-private Header decodeHeader(char *buffer);
 private void encodeEntry(BcEntry bc_entry);
-private isize countFiles(char *dir_path);
-private bool mergeEntries(BcHandle *bc, char *data_file_path);
-private bool getFilePath(char *file_path, char *dir_path, s8 extension, isize num_files);
-private bool growKeyDir(BcHandle *bc, isize data_files_num, isize hint_files_num);
+private u64 getRecordCrc(char *record, isize len, bool is_crc32c);
+private isize countFiles(char *dir_path, s8 extension);
+private void countUpsert(BcHandle *bc, s8 key, KeyDirEntry kd_entry, HtUpsertResult res);
+private void countLive(BcHandle *bc);
+private void countDead(BcHandle *bc);
+private bool shouldVerify(BcHandle *bc, u32 file_id);
+private bool growKeyDir(BcHandle *bc, isize merged_first, isize merged_last, Watermark watermark);
+private void *scanWorker(void *arg);
+private bool scanFile(ScanQueue *queue, ScanJob *job);
+private bool applyScanJob(BcHandle *bc, ScanJob *job);
+private void releaseScanJob(ScanJob *job);
+private bool loadHint(ScanJob *job, char *hint_path, isize data_len);
+private bool loadSnapshot(BcHandle *bc, Watermark *watermark);
+private bool applySnapshot(BcHandle *bc, char *map, isize map_len, Watermark *watermark);
+private SnapshotFile getSnapshotFile(BcHandle *bc, u32 file_id);
+private bool writevAt(int fd, struct iovec *iov, int count, isize offset);
+private bool writeAt(int fd, char *buffer, isize len, isize offset);
+private bool openWriteBuffer(BcHandle *bc);
+private bool flushWriteBuffer(WriteBuffer *wb);
+private void writeBufferBegin(WriteBuffer *wb);
+private void writeBufferEnd(WriteBuffer *wb);
+private bool readActive(WriteBuffer *wb, char *buffer, isize pos, isize len);
+private s8 getValue(BcHandle *bc, s8 key, Arena *scratch);
+private isize multiGet(BcHandle *bc, s8 *keys, s8 *vals, isize count, Arena *scratch);
+private char *readShared(BcHandle *bc, u32 file_id, isize pos, isize len, Arena *scratch);
+private bool submitGet(BcHandle *bc, BcIo *io, Arena *scratch);
+private bool submitSync(BcHandle *bc, BcIo *io);
+private bool ioReserve(WriteBuffer *wb, u32 count);
+private bool ioWait(WriteBuffer *wb, u32 wait_nr);
+private bool ioDrain(WriteBuffer *wb);
+private void ioComplete(WriteBuffer *wb, UringCqe cqe);
+private void ioDone(IoQueue *queue, BcIo *io);
+private BcFile *sharedFile(BcHandle *bc, u32 file_id);
+private bool mapFile(BcHandle *bc, u32 file_id);
 
 #define DATA_FILES s8("data_files")
 #define MERGED_FILES  s8("merged_files")
 #define HINT_FILES s8("hint_files")
-
-#define BIN_EXT s8("bin")
-#define MERGED_EXT s8("merge")
-#define HINT_EXT s8("hint")
+#define SNAPSHOT_FILE s8("keydir.snapshot")
+
+#define FILE_TABLE_INIT_CAP 16
+#define KEY_DIR_INIT_CAP 1024
+#define FD_CACHE_DEFAULT_SIZE 64
+#define SCRATCH_DEFAULT_SIZE ((isize)1 << 24)
+#define COMMIT_DEFAULT_DELAY_US 1000
+#define COMMIT_DEFAULT_BATCH_SIZE 64
+#define WRITE_BUFFER_DEFAULT_SIZE ((isize)1 << 20)
+#define WRITE_BUFFER_ALIGN 4096
+#define MULTI_GET_MAX_GAP 4096
+#define MULTI_GET_MAX_SPAN ((isize)1 << 20)
+#define IO_DEFAULT_DEPTH 64
+#define IO_MAX_DEPTH 4096
+#define MERGE_DEFAULT_KEEP_FILES 2
+#define MERGE_DEFAULT_STEP_SIZE ((isize)1 << 22)
+#define VERIFY_DEFAULT_SAMPLE_RATE 64
+#define SCRUB_DEFAULT_RATE_LIMIT ((isize)1 << 24)
+#define CRC32C_TAG 0x43323343  // "C32C"
+#define STREAM_CHUNK_SIZE 4096
+#define BATCH_INIT_CAP ((isize)1 << 16)
+
+#define HINT_MAGIC 0x31544E4948434221  // "!BCHINT1"
+#define HINT_INIT_CAP ((isize)1 << 16)
+
+#define SNAPSHOT_MAGIC 0x3250414E53434221  // "!BCSNAP2"
 
 BcHandleResult bc_open(Arena arena, s8 dir_path, Options options) {
   BcHandleResult bc_res = {.bc = {0}, .is_ok = false};
@@ -88,7 +249,7 @@ BcHandleResult bc_open(Arena arena, s8 dir_path, Options options) {
     DIR *dirp = opendir(dir_path.data);
     return_value_if(dirp == NULL, bc_res, ERR_ACCESS);
 
-    i8 fd = dirfd(dirp);
+    int fd = dirfd(dirp);
     return_value_if(fd == -1, bc_res, ERR_ACCESS);
 
     out = mkdirat(fd, DATA_FILES.data, 0700);
@@ -109,464 +270,2657 @@ BcHandleResult bc_open(Arena arena, s8 dir_path, Options options) {
 
   memcpy(bc->parent_dir_path, dir_path.data, dir_path.len);
 
-  crc64speed_init();
+  crc_init();
   bc->arena = arena;
+  bc->arena_base = arena.beg;
   bc->options = options;
-  bc->num_files = countFiles(bc->data_dir_path);
+  if (bc->options.fd_cache_size <= 0) bc->options.fd_cache_size = FD_CACHE_DEFAULT_SIZE;
+  if (bc->options.scratch_size <= 0) bc->options.scratch_size = SCRATCH_DEFAULT_SIZE;
+  if (bc->options.recovery_threads <= 0) {
+    bc->options.recovery_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (bc->options.commit_delay_us <= 0) bc->options.commit_delay_us = COMMIT_DEFAULT_DELAY_US;
+  if (bc->options.commit_batch_size <= 0) bc->options.commit_batch_size = COMMIT_DEFAULT_BATCH_SIZE;
+  if (bc->options.write_buffer_size <= 0) bc->options.write_buffer_size = WRITE_BUFFER_DEFAULT_SIZE;
+  if (bc->options.io_depth <= 0) bc->options.io_depth = IO_DEFAULT_DEPTH;
+  if (bc->options.io_depth > IO_MAX_DEPTH) bc->options.io_depth = IO_MAX_DEPTH;
+  if (bc->options.merge_keep_files <= 0) bc->options.merge_keep_files = MERGE_DEFAULT_KEEP_FILES;
+  if (bc->options.merge_step_size <= 0) bc->options.merge_step_size = MERGE_DEFAULT_STEP_SIZE;
+  if (bc->options.verify_sample_rate <= 0) {
+    bc->options.verify_sample_rate = VERIFY_DEFAULT_SAMPLE_RATE;
+  }
+  if (bc->options.scrub_rate_limit <= 0) bc->options.scrub_rate_limit = SCRUB_DEFAULT_RATE_LIMIT;
+
+  // Concurrent readers cannot share a descriptor cache, so files stay open instead, as many as half
+  // the descriptor limit allows. Readers open the others themselves for every read.
+  if (bc->options.concurrent_reads) {
+    struct rlimit limit;
+    bool is_limited = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY;
+    bc->options.fd_cache_size = is_limited ? (isize)limit.rlim_cur / 2 : INT32_MAX;
+  }
 
+  bc->scratch.beg = new (&bc->arena, char, bc->options.scratch_size, NOZERO);
+  return_value_if(bc->scratch.beg == NULL, bc_res, ERR_OUT_OF_MEMORY);
+  bc->scratch.end = bc->scratch.beg + bc->options.scratch_size;
 
-  bool out = getFilePath(bc->active_file_path, bc->data_dir_path, BIN_EXT, bc->num_files);
+  bc->file_table.lru_head = NO_FILE;
+  bc->file_table.lru_tail = NO_FILE;
+  // The background merge removes data files oldest first, so the rest are numbered first to last.
+  isize first_num;
+  bool is_found = findFiles(bc->data_dir_path, BIN_EXT, &first_num, &bc->num_files);
+  return_value_if(!is_found, bc_res, ERR_ACCESS);
 
-  return_value_if(bc->num_files == -1, bc_res, ERR_ACCESS);
+  // An empty store still has one (active) data file, otherwise the first rotation would reopen it.
+  if (bc->num_files == 0) bc->num_files = 1;
+
+  bool out = getFilePath(bc->active_file_path, bc->data_dir_path, BIN_EXT, bc->num_files);
   return_value_if(!out, bc_res, ERR_ACCESS);
 
-  bc->active_fp = fopen(bc->active_file_path, "ab+");
-  return_value_if(bc->active_fp == NULL, bc_res, ERR_ACCESS);
+  out = openWriteBuffer(bc);
+  return_value_if(!out, bc_res, ERR_ACCESS);
 
-  isize cap = (isize)1 << 21;
-  HashTableResult ht_res = ht_create(&bc->arena, cap);
-  bc->key_dir = ht_res.ht;
-  return_value_if(!ht_res.is_ok, bc_res, ERR_OBJECT_INITIALIZATION_FAILED);
+  i64 file_id = addFile(bc, bc->active_file_path);
+  return_value_if(file_id == -1, bc_res, ERR_OBJECT_INITIALIZATION_FAILED);
+  bc->active_file_id = file_id;
 
   i8 res = stat(bc->active_file_path, &st);
   return_value_if(res == -1, bc_res, ERR_ACCESS);
   bc->cursor = st.st_size;
 
-  isize hint_files_num = countFiles(bc->hint_dir_path);
-  return_value_if(hint_files_num == -1, bc_res, ERR_ACCESS);
+  // With a usable snapshot only the records appended after its watermark are replayed, otherwise
+  // every merged and data file is.
+  Watermark watermark = {.num = first_num, .pos = 0};
+  isize merged_first = 1;
+  isize merged_last = 0;
+  if (!loadSnapshot(bc, &watermark)) {
+    HashTableResult ht_res = ht_create(&bc->arena, KEY_DIR_INIT_CAP);
+    bc->key_dir = ht_res.ht;
+    return_value_if(!ht_res.is_ok, bc_res, ERR_OBJECT_INITIALIZATION_FAILED);
+
+    // bc_merge removes merged files oldest first as well.
+    is_found = findFiles(bc->merged_dir_path, MERGED_EXT, &merged_first, &merged_last);
+    return_value_if(!is_found, bc_res, ERR_ACCESS);
+  }
 
-  out = growKeyDir(bc, bc->num_files, hint_files_num);
+  out = growKeyDir(bc, merged_first, merged_last, watermark);
   return_value_if(!out, bc_res, ERR_OBJECT_INITIALIZATION_FAILED);
 
+  // Replaying the active file may have cut a torn tail off it.
+  bc->write_buffer->offset = bc->cursor;
+
+  FileTable *ft = &bc->file_table;
+  for (u32 i = 0; bc->options.concurrent_reads && i < ft->len; i++) {
+    if (ft->open_fds >= bc->options.fd_cache_size) break;
+    if (i != bc->active_file_id && getFileFd(bc, i) == -1) return bc_res;
+  }
+
   if (options.read_write) {
-    i8 res = flock(bc->active_fp->_fileno, LOCK_SH);
+    i8 res = flock(bc->write_buffer->fd, LOCK_SH);
     return_value_if(res == -1, bc_res, ERR_ACCESS);
   }
 
+  if (options.read_write && options.group_commit) {
+    out = commitStart(bc);
+    return_value_if(!out, bc_res, ERR_OBJECT_INITIALIZATION_FAILED);
+  }
+
+  if (options.read_write && options.background_merge) {
+    out = mergeStart(bc, first_num);
+    return_value_if(!out, bc_res, ERR_OBJECT_INITIALIZATION_FAILED);
+  }
+
+  if (options.verify_reads != BC_VERIFY_ALWAYS) {
+    out = scrubStart(bc);
+    return_value_if(!out, bc_res, ERR_OBJECT_INITIALIZATION_FAILED);
+  }
+
   bc_res.is_ok = true;
   return bc_res;
 }
 
-void bc_close(BcHandle *bc) { fclose(bc->active_fp); }
+void bc_close(BcHandle *bc) {
+  // The scrubber's last tombstones are appended through the group commit, before it stops.
+  if (bc->scrub != NULL) scrubStop(bc);
+  if (bc->commit != NULL) commitStop(bc->commit);
+  if (bc->merge != NULL) mergeStop(bc);
+
+  // Requests still in flight read into or write from memory that is about to go away.
+  if (bc->io->has_ring) {
+    ioDrain(bc->write_buffer);
+    uring_destroy(&bc->io->ring);
+    bc->io->has_ring = false;
+  }
 
-s8 bc_get(BcHandle *bc, s8 key) {
-  s8 null_s8 = {.data = NULL, .len = -1};
+  // Failing to write the snapshot only makes the next bc_open replay every file.
+  if (bc->options.read_write) bc_checkpoint(bc);
 
-  KeyDirEntry *kd_entry = ht_get(&bc->key_dir, key);
-  return_value_if(kd_entry == NULL, null_s8, ERR_KEY_MISSING);
+  while (bc->file_table.lru_head != NO_FILE) closeFileFd(bc, bc->file_table.lru_head);
+  unmapFiles(bc);
+  hintFree(&bc->hint);
+  if (bc->options.read_write) flushWriteBuffer(bc->write_buffer);
+  close(bc->write_buffer->fd);
+}
 
-  FILE *fp;
-  i8 out = strcmp(kd_entry->file_id, bc->active_file_path);
-  if (out == 0) {
-    fp = bc->active_fp;
-  } else {
-    fp = fopen(kd_entry->file_id, "r");
-    return_value_if(fp == NULL, null_s8, ERR_ACCESS);
-  }
-  i8 res = fseek(fp, kd_entry->val_pos, SEEK_SET);
+// With a background merge, concurrent readers hold a read epoch from the lookup until the record
+// is read, so that the file it points at is not closed under them.
+s8 bc_get(BcHandle *bc, s8 key, Arena *scratch) {
+  if (!bc->options.concurrent_reads || bc->merge == NULL) return getValue(bc, key, scratch);
 
-  return_value_if(res == -1, null_s8, ERR_ACCESS);
-  return_value_if(key.len >= PTRDIFF_MAX - HEADER_SIZE - kd_entry->val_len, null_s8,
-                  ERR_ARITHEMATIC_OVERFLOW);
+  u64 epoch = readEnter(bc);
+  s8 val = getValue(bc, key, scratch);
+  readExit(bc, epoch);
 
-  BcEntry bc_entry = {0};
-  bc_entry.buffer_len = HEADER_SIZE + sizeof(u64) + key.len + kd_entry->val_len;
-  bc_entry.buffer = new (&bc->arena, char, bc_entry.buffer_len);
-  bc_entry.val = new (&bc->arena, char, kd_entry->val_len);
+  return val;
+}
 
-  return_value_if(bc_entry.buffer == NULL, null_s8, ERR_OUT_OF_MEMORY);
-  return_value_if(bc_entry.val == NULL, null_s8, ERR_OUT_OF_MEMORY);
+private s8 getValue(BcHandle *bc, s8 key, Arena *scratch) {
+  s8 null_s8 = {.data = NULL, .len = -1};
 
-  isize bytes_read = fread(bc_entry.buffer, sizeof(char), bc_entry.buffer_len, fp);
-  u64 crc = crc64speed(0, bc_entry.buffer, bc_entry.buffer_len);
+  bool is_shared = bc->options.concurrent_reads;
+  KeyDirEntry shared_entry;
+  KeyDirEntry *kd_entry = NULL;
+  if (!is_shared) {
+    kd_entry = ht_get(&bc->key_dir, key);
+  } else if (ht_get_shared(&bc->key_dir, key, &shared_entry)) {
+    kd_entry = &shared_entry;
+  }
+  return_value_if(kd_entry == NULL, null_s8, ERR_KEY_MISSING);
 
-  return_value_if(crc != 0, null_s8, ERR_CRC_FAILED);
-  return_value_if(bytes_read < bc_entry.buffer_len, null_s8, ERR_ACCESS);
+  return_value_if(key.len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - kd_entry->val_len, null_s8,
+                  ERR_ARITHEMATIC_OVERFLOW);
 
-  memcpy(bc_entry.val, bc_entry.buffer + VAL_OFFSET(key.len), kd_entry->val_len);
+  isize record_len = HEADER_SIZE + sizeof(u64) + key.len + kd_entry->val_len;
+  char *record = is_shared
+                     ? readShared(bc, kd_entry->file_id, kd_entry->val_pos, record_len, scratch)
+                     : readSpan(bc, kd_entry->file_id, kd_entry->val_pos, record_len, scratch);
+  if (record == NULL) return null_s8;
 
-  if (out != 0) fclose(fp);
+  bool is_valid = !shouldVerify(bc, kd_entry->file_id) || isRecordValid(record, record_len);
+  return_value_if(!is_valid, null_s8, ERR_CRC_FAILED);
 
-  s8 val = {.data = bc_entry.val, .len = kd_entry->val_len};
+  s8 val = {.data = record + VAL_OFFSET(key.len), .len = kd_entry->val_len};
 
   return_value_if(s8cmp(s8("🪦"), val), null_s8, ERR_KEY_MISSING);
 
   return val;
 }
 
-bool bc_put(BcHandle *bc, s8 key, s8 val) {
-  return_value_if(!bc->options.read_write, false, ERR_READ_ONLY);
-
-  if (bc->cursor >= bc->options.max_file_size) {
-    bool out = getNewFileHandle(bc);
-    return_value_if(!out, false, ERR_ACCESS);
+// Every key is looked up before anything is read. The hits are then sorted by file and position,
+// and runs of records at most MULTI_GET_MAX_GAP bytes apart are fetched by one read of up to
+// MULTI_GET_MAX_SPAN bytes; the gaps between them are read and thrown away.
+isize bc_multi_get(BcHandle *bc, s8 *keys, s8 *vals, isize count, Arena *scratch) {
+  if (!bc->options.concurrent_reads || bc->merge == NULL) {
+    return multiGet(bc, keys, vals, count, scratch);
   }
 
-  Header header = {
-    .timestamp = getTimestamp(),
-    .key_len = key.len,
-    .val_len = val.len,
-  };
+  u64 epoch = readEnter(bc);
+  isize found = multiGet(bc, keys, vals, count, scratch);
+  readExit(bc, epoch);
 
-  BcEntry bc_entry = {
-      .header = header,
-      .key = key.data,
-      .val = val.data,
-      .crc = 0,
-  };
+  return found;
+}
 
-  return_value_if(key.len >= PTRDIFF_MAX - HEADER_SIZE - val.len, false, ERR_ARITHEMATIC_OVERFLOW);
+private isize multiGet(BcHandle *bc, s8 *keys, s8 *vals, isize count, Arena *scratch) {
+  MultiGetHit *hits = new (scratch, MultiGetHit, count, NOZERO);
+  return_value_if(hits == NULL, 0, ERR_OUT_OF_MEMORY);
+
+  bool is_shared = bc->options.concurrent_reads;
+  isize hits_len = 0;
+  for (isize i = 0; i < count; i++) {
+    vals[i] = (s8){.data = NULL, .len = -1};
+
+    KeyDirEntry shared_entry;
+    KeyDirEntry *kd_entry = NULL;
+    if (!is_shared) {
+      kd_entry = ht_get(&bc->key_dir, keys[i]);
+    } else if (ht_get_shared(&bc->key_dir, keys[i], &shared_entry)) {
+      kd_entry = &shared_entry;
+    }
+    if (kd_entry == NULL) continue;
+    if (keys[i].len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - kd_entry->val_len) continue;
+
+    hits[hits_len++] = (MultiGetHit){
+        .index = i,
+        .record_len = HEADER_SIZE + sizeof(u64) + keys[i].len + kd_entry->val_len,
+        .kd_entry = *kd_entry,
+    };
+  }
 
-  bc_entry.buffer_len = HEADER_SIZE + sizeof(u64) + key.len + val.len;
-  bc_entry.buffer = new (&bc->arena, char, bc_entry.buffer_len);
+  qsort(hits, hits_len, sizeof(MultiGetHit), compareHits);
+
+  isize found = 0;
+  for (isize i = 0; i < hits_len;) {
+    KeyDirEntry *first = &hits[i].kd_entry;
+    isize end = first->val_pos + hits[i].record_len;
+
+    isize j = i + 1;
+    for (; j < hits_len; j++) {
+      KeyDirEntry *next = &hits[j].kd_entry;
+      isize next_end = next->val_pos + hits[j].record_len;
+      if (next->file_id != first->file_id || next->val_pos - end > MULTI_GET_MAX_GAP ||
+          next_end - first->val_pos > MULTI_GET_MAX_SPAN) {
+        break;
+      }
+      if (next_end > end) end = next_end;
+    }
 
-  return_value_if(bc_entry.buffer == NULL, false, ERR_OUT_OF_MEMORY);
+    isize span_len = end - first->val_pos;
+    char *span = is_shared ? readShared(bc, first->file_id, first->val_pos, span_len, scratch)
+                           : readSpan(bc, first->file_id, first->val_pos, span_len, scratch);
+    for (isize k = i; k < j && span != NULL; k++) {
+      MultiGetHit *hit = hits + k;
+      char *record = span + (hit->kd_entry.val_pos - first->val_pos);
+      bool is_valid = !shouldVerify(bc, hit->kd_entry.file_id) ||
+                      isRecordValid(record, hit->record_len);
+      if (!is_valid) continue;
+
+      s8 val = {.data = record + VAL_OFFSET(keys[hit->index].len), .len = hit->kd_entry.val_len};
+      if (s8cmp(s8("🪦"), val)) continue;
+
+      vals[hit->index] = val;
+      found++;
+    }
 
+    i = j;
+  }
 
-  KeyDirEntry kd_entry = {
-      .timestamp = bc_entry.header.timestamp,
-      .val_len = bc_entry.header.val_len,
-      .val_pos = bc->cursor,
-  };
-  kd_entry.file_id = new(&bc->arena, char, PATH_MAX);
-  memcpy(kd_entry.file_id, bc->active_file_path, PATH_MAX);
+  return found;
+}
 
-  encodeEntry(bc_entry);
+bool bc_put(BcHandle *bc, s8 key, s8 val) { return putEntry(bc, key, val, false); }
 
-  fwrite(bc_entry.buffer, sizeof(char), bc_entry.buffer_len, bc->active_fp);
+bool bc_delete(BcHandle *bc, s8 key) { return putEntry(bc, key, s8("🪦"), true); }
 
-  bool res = ht_insert(&bc->key_dir, key, kd_entry);
-  return_value_if(!res, false, ERR_KEY_INSERT_FAILED);
+// Appends a record, or with is_delete a tombstone for a key that must exist. The key is looked up
+// with write_lock held, since other puts change the keydir and ht_get rehashes it along the way.
+private bool putEntry(BcHandle *bc, s8 key, s8 val, bool is_delete) {
+  return_value_if(!bc->options.read_write, false, ERR_READ_ONLY);
+  if (bc->scrub != NULL) scrubPoll(bc);
 
-  return_value_if(bc->cursor >= PTRDIFF_MAX - bc_entry.buffer_len, false, ERR_ARITHEMATIC_OVERFLOW);
-  bc->cursor += bc_entry.buffer_len;
+  GroupCommit *commit = bc->commit;
+  if (commit == NULL) {
+    bool is_missing = is_delete && ht_get(&bc->key_dir, key) == NULL;
+    return_value_if(is_missing, false, ERR_KEY_MISSING);
 
-  if (bc->options.sync_on_put) {
-    i8 out = fflush(bc->active_fp);
-    return_value_if(out != 0, false, ERR_ACCESS);
+    bool out = appendEntry(bc, key, val);
+    if (out && bc->options.sync_on_put) out = syncActiveFile(bc);
+    return_value_if(!out && is_delete, false, ERR_KEY_DELETE_FAILED);
+    return out;
   }
 
-  return true;
-}
+  i64 start_ns = getMonotonicNs();
 
-bool bc_delete(BcHandle *bc, s8 key) {
-  KeyDirEntry *kd_entry = ht_get(&bc->key_dir, key);
+  pthread_mutex_lock(&commit->write_lock);
+  bool is_missing = is_delete && ht_get(&bc->key_dir, key) == NULL;
+  bool out = !is_missing && appendEntry(bc, key, val);
+  i64 seq = out ? commitAppended(commit) : 0;
+  pthread_mutex_unlock(&commit->write_lock);
 
-  return_value_if(kd_entry == NULL, false, ERR_KEY_MISSING);
+  return_value_if(is_missing, false, ERR_KEY_MISSING);
+  return_value_if(!out && is_delete, false, ERR_KEY_DELETE_FAILED);
+  if (!out) return false;
+  return commitWait(commit, seq, start_ns);
+}
 
-  i8 out = bc_put(bc, key, s8("🪦"));
-  return_value_if(!out, false, ERR_KEY_DELETE_FAILED);
+BcBatch bc_batch_create(Arena *arena) { return (BcBatch){.arena = arena}; }
 
-  return true;
-}
+bool bc_batch_put(BcBatch *batch, s8 key, s8 val) {
+  return_value_if(key.len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - val.len, false,
+                  ERR_ARITHEMATIC_OVERFLOW);
+  isize record_len = HEADER_SIZE + sizeof(u64) + key.len + val.len;
 
-bool bc_merge(BcHandle *bc) {
-  return_value_if(bc->num_files < 2, false, ERR_MERGE);
+  bool out = batchReserve(batch, record_len);
+  return_value_if(!out, false, ERR_OUT_OF_MEMORY);
 
-  for (isize i = 1; i < bc->num_files; i++) {
-    char data_file[PATH_MAX] = {0};
-    getFilePath(data_file, bc->data_dir_path, BIN_EXT, i);
-    mergeEntries(bc, data_file);
-  }
+  BcEntry bc_entry = {
+      .header = {.timestamp = getTimestamp(), .key_len = key.len, .val_len = val.len},
+      .key = key.data,
+      .val = val.data,
+      .buffer = batch->buffer + batch->len,
+      .buffer_len = record_len,
+  };
+  encodeEntry(bc_entry);
 
-  char new_name[PATH_MAX];
-  getFilePath(new_name, bc->data_dir_path, BIN_EXT, 0);
-  i8 out = rename(bc->active_file_path, new_name);
-  return_value_if(out == -1, false, ERR_ACCESS);
+  batch->len += record_len;
+  batch->count++;
 
   return true;
 }
 
-bool bc_sync(BcHandle *bc) {
-  i8 out = fflush(bc->active_fp);
-  return_value_if(out == EOF, false, ERR_ACCESS);
-  return true;
-}
+bool bc_batch_delete(BcBatch *batch, s8 key) { return bc_batch_put(batch, key, s8("🪦")); }
 
-private isize countFiles(char *dir_path) {
-  DIR *dirp = opendir(dir_path);
-  return_value_if(dirp == NULL, -1, ERR_ACCESS);
+bool bc_write_batch(BcHandle *bc, BcBatch *batch) {
+  return_value_if(!bc->options.read_write, false, ERR_READ_ONLY);
+  return_value_if(batch->is_failed, false, ERR_OUT_OF_MEMORY);
+  if (batch->count == 0) return true;
+  if (bc->scrub != NULL) scrubPoll(bc);
 
-  errno = 0;
-  struct dirent *entry;
-  isize num_files = 0;
-  while ((entry = readdir(dirp)) != NULL) {
-    if (entry->d_type == DT_REG) {
-      num_files++;
-    }
-  }
+  GroupCommit *commit = bc->commit;
+  if (commit == NULL) return appendBatch(bc, batch);
 
-  return_value_if(errno != 0, -1, ERR_ACCESS);
+  i64 start_ns = getMonotonicNs();
 
-  closedir(dirp);
+  pthread_mutex_lock(&commit->write_lock);
+  bool out = appendBatch(bc, batch);
+  i64 seq = out ? commitAppended(commit) : 0;
+  pthread_mutex_unlock(&commit->write_lock);
 
-  return num_files;
+  if (!out) return false;
+  return commitWait(commit, seq, start_ns);
 }
 
-private Header decodeHeader(char *buffer) {
-  Header header = {0};
-  memcpy(&header.timestamp, buffer, sizeof(i64));
-  memcpy(&header.key_len, buffer + KEY_LEN_OFFSET, sizeof(isize));
-  memcpy(&header.val_len, buffer + VAL_LEN_OFFSET, sizeof(isize));
-  return header;
-}
+// The write buffer is emptied first, so that the record starts where the file ends and bc_put_end
+// only has to cut the file back to that point to drop it. write_lock is held until bc_put_end.
+bool bc_put_begin(BcHandle *bc, BcPutStream *stream, s8 key, isize val_len) {
+  return_value_if(!bc->options.read_write, false, ERR_READ_ONLY);
+  return_value_if(val_len < 0 || key.len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - val_len,
+                  false, ERR_ARITHEMATIC_OVERFLOW);
 
-private void encodeEntry(BcEntry bc_entry) {
-  memcpy(bc_entry.buffer, &bc_entry.header.timestamp, sizeof(i64));
-  memcpy(bc_entry.buffer + KEY_LEN_OFFSET, &bc_entry.header.key_len, sizeof(isize));
-  memcpy(bc_entry.buffer + VAL_LEN_OFFSET, &bc_entry.header.val_len, sizeof(isize));
-  memcpy(bc_entry.buffer + KEY_OFFSET, bc_entry.key, bc_entry.header.key_len);
-  memcpy(bc_entry.buffer + VAL_OFFSET(bc_entry.header.key_len), bc_entry.val,
-         bc_entry.header.val_len);
+  *stream = (BcPutStream){.bc = bc, .key = key, .is_crc32c = bc->options.crc32c_records};
+  if (bc->scrub != NULL) scrubPoll(bc);
 
-  bc_entry.crc = crc64speed(0, bc_entry.buffer, bc_entry.buffer_len - sizeof(u64));
-  memcpy(bc_entry.buffer + CRC_OFFSET(bc_entry.header.key_len, bc_entry.header.val_len),
-         &bc_entry.crc, sizeof(u64));
-}
+  GroupCommit *commit = bc->commit;
+  if (commit != NULL) {
+    stream->start_ns = getMonotonicNs();
+    pthread_mutex_lock(&commit->write_lock);
+  }
 
-private bool getFilePath(char *file_path, char *dir_path, s8 extension, isize num_files) {
-  isize dir_path_len = strnlen(dir_path, PATH_MAX);
-  u8 file_len = 14 + extension.len;
+  if (bc->merge != NULL) mergePoll(bc);
 
-  return_value_if(dir_path_len >= PTRDIFF_MAX - file_len, false, ERR_ARITHEMATIC_OVERFLOW);
-  isize file_path_len = dir_path_len + file_len;
+  bool out = bc->cursor < bc->options.max_file_size || getNewFileHandle(bc);
+  out = out && flushWriteBuffer(bc->write_buffer);
+  if (!out && commit != NULL) pthread_mutex_unlock(&commit->write_lock);
+  return_value_if(!out, false, ERR_ACCESS);
 
-  if (num_files == 0) num_files = 1;
-  snprintf(file_path, file_path_len, "%s/%s.%s", dir_path, getFileName(num_files), extension.data);
+  stream->kd_entry = (KeyDirEntry){
+      .timestamp = getTimestamp(),
+      .val_len = val_len,
+      .val_pos = bc->cursor,
+      .file_id = bc->active_file_id,
+  };
+
+  char header[HEADER_SIZE];
+  memcpy(header, &stream->kd_entry.timestamp, sizeof(i64));
+  memcpy(header + KEY_LEN_OFFSET, &key.len, sizeof(isize));
+  memcpy(header + VAL_LEN_OFFSET, &val_len, sizeof(isize));
+
+  stream->is_failed = !streamWrite(stream, header, HEADER_SIZE) ||
+                      !streamWrite(stream, key.data, key.len);
+  stream->written = 0;
+
+  // bc_put_end drops what made it to the file and releases write_lock.
+  if (stream->is_failed) return bc_put_end(stream);
 
   return true;
 }
 
-private char *getFileName(u32 num) {
-  static char hex_num[16];
-  snprintf(hex_num, 16, "%0*X", 8, num);
-  return hex_num;
-}
+bool bc_put_write(BcPutStream *stream, s8 chunk) {
+  if (stream->is_failed) return false;
 
-private bool getNewFileHandle(BcHandle *bc) {
-  fclose(bc->active_fp);
+  stream->is_failed = chunk.len > stream->kd_entry.val_len - stream->written;
+  return_value_if(stream->is_failed, false, ERR_INVALID_SIZE);
 
-  bool out = getFilePath(bc->active_file_path, bc->data_dir_path, BIN_EXT, bc->num_files + 1);
-  bc->active_fp = fopen(bc->active_file_path, "ab+");
+  stream->is_failed = !streamWrite(stream, chunk.data, chunk.len);
+  return !stream->is_failed;
+}
 
-  return_value_if(!out || bc->active_fp == NULL, false, ERR_ACCESS);
-  return_value_if(bc->num_files > PTRDIFF_MAX - 1, false, ERR_ARITHEMATIC_OVERFLOW);
-  bc->num_files++;
-  bc->cursor = 0;
+bool bc_put_end(BcPutStream *stream) {
+  BcHandle *bc = stream->bc;
+  GroupCommit *commit = bc->commit;
+  WriteBuffer *wb = bc->write_buffer;
 
-  if (bc->options.read_write) {
-    i8 out = flock(bc->active_fp->_fileno, LOCK_SH);
-    return_value_if(out == -1, false, ERR_ACCESS);
+  bool out = !stream->is_failed && stream->written == stream->kd_entry.val_len;
+  if (out) {
+    u64 crc = stream->is_crc32c ? (u64)CRC32C_TAG << 32 | (u32)stream->crc : stream->crc;
+    out = streamAppend(wb, (char *)&crc, sizeof(u64));
   }
 
-  return true;
-}
+  isize record_len = HEADER_SIZE + sizeof(u64) + stream->key.len + stream->kd_entry.val_len;
+  out = out && indexRecord(bc, stream->key, stream->kd_entry, record_len);
 
-private isize getRamSize(void) {
-    isize pages = sysconf(_SC_PHYS_PAGES);
-    isize page_size = sysconf(_SC_PAGE_SIZE);
+  // What was written of the record is dropped, from the buffer and the file.
+  if (!out) {
+    writeBufferBegin(wb);
+    wb->len = 0;
+    wb->offset = bc->cursor;
+    writeBufferEnd(wb);
+    ftruncate(wb->fd, bc->cursor);
+  }
 
-    return_value_if(pages == -1 || page_size == -1, -1, ERR_SYSCONF);
-    return_value_if(pages >= PTRDIFF_MAX / page_size, -1, ERR_ARITHEMATIC_OVERFLOW);
+  if (commit == NULL) {
+    if (out && bc->options.sync_on_put) out = syncActiveFile(bc);
+    return out;
+  }
 
-    isize ram_size = pages * page_size;
+  i64 seq = out ? commitAppended(commit) : 0;
+  pthread_mutex_unlock(&commit->write_lock);
 
-    return ram_size;
+  if (!out) return false;
+  return commitWait(commit, seq, stream->start_ns);
 }
 
-private i64 getTimestamp(void) {
-  struct timeval tv;
-  i8 out = gettimeofday(&tv, NULL);
-  return_value_if(out == -1, -1, "gettimeofday failed.\n");
-  return tv.tv_sec;
+// The header, key and trailer are read on their own at the start, the trailer telling which CRC
+// the record carries.
+bool bc_get_begin(BcHandle *bc, BcGetStream *stream, s8 key) {
+  if (!bc->options.concurrent_reads || bc->merge == NULL) return streamBegin(bc, stream, key);
+
+  u64 epoch = readEnter(bc);
+  bool out = streamBegin(bc, stream, key);
+  readExit(bc, epoch);
+
+  return out;
 }
 
-private bool growKeyDir(BcHandle *bc, isize data_files_num, isize hint_files_num) {
-  char header_buffer[HEADER_SIZE];
+private bool streamBegin(BcHandle *bc, BcGetStream *stream, s8 key) {
+  bool is_shared = bc->options.concurrent_reads;
+  KeyDirEntry kd_entry;
+  KeyDirEntry *found = NULL;
+  if (!is_shared) {
+    found = ht_get(&bc->key_dir, key);
+  } else if (ht_get_shared(&bc->key_dir, key, &kd_entry)) {
+    found = &kd_entry;
+  }
+  return_value_if(found == NULL, false, ERR_KEY_MISSING);
+  kd_entry = *found;
 
-  for (isize i = 1; i <= data_files_num; i++) {
-    char file_path[PATH_MAX] = {0};
-    bool out = getFilePath(file_path, bc->data_dir_path,BIN_EXT, i);
-    FILE *fp = fopen(file_path, "r");
+  return_value_if(key.len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - kd_entry.val_len, false,
+                  ERR_ARITHEMATIC_OVERFLOW);
 
-    isize val_len = 0;
-    isize crc_len = 0;
+  *stream = (BcGetStream){
+      .bc = bc,
+      .file_id = kd_entry.file_id,
+      .is_verified = shouldVerify(bc, kd_entry.file_id),
+  };
 
-    return_value_if(!out, false, ERR_OBJECT_INITIALIZATION_FAILED);
-    return_value_if(fp == NULL, false, ERR_ACCESS);
+  stream->fd = open(sharedFile(bc, kd_entry.file_id)->path, O_RDONLY | O_CLOEXEC);
+  return_value_if(stream->fd == -1, false, ERR_ACCESS);
+
+  isize val_pos = kd_entry.val_pos + HEADER_SIZE + key.len;
+  s8 tombstone = s8("🪦");
+  char val[sizeof("🪦")];
+  bool is_tombstone = kd_entry.val_len == tombstone.len &&
+                      streamRead(stream, val, val_pos, tombstone.len) &&
+                      s8cmp(tombstone, (s8){.data = val, .len = tombstone.len});
+
+  bool out = !is_tombstone &&
+             streamRead(stream, (char *)&stream->trailer, val_pos + kd_entry.val_len, sizeof(u64));
+
+  // The header and key are only checked along with the value, they are read for the CRC alone.
+  char chunk[STREAM_CHUNK_SIZE];
+  for (isize pos = kd_entry.val_pos; out && stream->is_verified && pos < val_pos;) {
+    isize len = val_pos - pos < STREAM_CHUNK_SIZE ? val_pos - pos : STREAM_CHUNK_SIZE;
+    out = streamRead(stream, chunk, pos, len);
+    if (out) streamCrc(stream, chunk, len);
+    pos += len;
+  }
 
-    while (true) {
-      i8 out = fseek(fp, val_len + crc_len, SEEK_CUR);
-      isize val_pos = ftell(fp);
+  bool is_valid = !out || !stream->is_verified || kd_entry.val_len > 0 || streamIsValid(stream);
 
-      return_value_if(out == -1 || val_pos == -1, false, ERR_ACCESS);
+  if (!out || is_tombstone || !is_valid) close(stream->fd);
+  return_value_if(is_tombstone, false, ERR_KEY_MISSING);
+  return_value_if(!out, false, ERR_ACCESS);
+  return_value_if(!is_valid, false, ERR_CRC_FAILED);
 
-      isize header_bytes_read = fread(header_buffer, sizeof(char), HEADER_SIZE, fp);
-      if (header_bytes_read < HEADER_SIZE) break;
+  stream->pos = val_pos;
+  stream->left = kd_entry.val_len;
+  return true;
+}
 
-      Header header = decodeHeader(header_buffer);
+isize bc_get_read(BcGetStream *stream, char *buffer, isize len) {
+  if (stream->left == 0) return 0;
+  if (len > stream->left) len = stream->left;
 
-      char *key_data = new (&bc->arena, char, header.key_len);
-      return_value_if(key_data == NULL, false, ERR_OUT_OF_MEMORY);
+  bool out = streamRead(stream, buffer, stream->pos, len);
+  return_value_if(!out, -1, ERR_ACCESS);
 
-      isize bytes_read = fread(key_data, sizeof(char), header.key_len, fp);
-      if (bytes_read < header.key_len) break;
+  stream->pos += len;
+  stream->left -= len;
+  if (!stream->is_verified) return len;
 
-      s8 key = {.data = key_data, .len = header.key_len};
+  streamCrc(stream, buffer, len);
+  return_value_if(stream->left == 0 && !streamIsValid(stream), -1, ERR_CRC_FAILED);
 
-      KeyDirEntry kd_entry = {
-          .timestamp = header.timestamp,
-          .val_len = header.val_len,
-          .val_pos = val_pos,
-      };
-      kd_entry.file_id = new(&bc->arena, char, PATH_MAX);
-      memcpy(kd_entry.file_id, file_path, PATH_MAX);
+  return len;
+}
 
-      bool res = ht_insert(&bc->key_dir, key, kd_entry);
-      val_len = header.val_len;
-      crc_len = sizeof(u64);
+void bc_get_end(BcGetStream *stream) { close(stream->fd); }
 
-      return_value_if(!res, false, ERR_KEY_INSERT_FAILED);
-    }
+// A failed allocation marks the batch, so that bc_write_batch refuses it rather than writing only
+// part of what was collected.
+private bool batchReserve(BcBatch *batch, isize len) {
+  if (batch->is_failed) return false;
+  if (batch->cap - batch->len >= len) return true;
 
-    fclose(fp);
+  isize cap = batch->cap == 0 ? BATCH_INIT_CAP : batch->cap;
+  while (cap - batch->len < len) {
+    if (cap > PTRDIFF_MAX / 2) {
+      batch->is_failed = true;
+      return false;
+    }
+    cap *= 2;
   }
 
-  for (isize i = 1; i <= hint_files_num; i++) {
-    char hint_file_path[PATH_MAX] = {0};
-    bool out = getFilePath(hint_file_path, bc->hint_dir_path, HINT_EXT, i);
-    FILE *fp = fopen(hint_file_path, "r");
+  // The buffer usually is the last allocation of the arena, it then simply grows in place.
+  Arena *arena = batch->arena;
+  if (batch->buffer != NULL && batch->buffer + batch->cap == arena->beg &&
+      arena->end - arena->beg >= cap - batch->cap) {
+    arena->beg += cap - batch->cap;
+    batch->cap = cap;
+    return true;
+  }
 
-    return_value_if(!out, false, ERR_OBJECT_INITIALIZATION_FAILED);
-    return_value_if(fp == NULL, false, ERR_ACCESS);
+  char *buffer = new (arena, char, cap, NOZERO);
+  if (buffer == NULL) {
+    batch->is_failed = true;
+    return false;
+  }
 
-    char merged_file_path[PATH_MAX] = {0};
-    out = getFilePath(merged_file_path, bc->merged_dir_path, MERGED_EXT, i);
-    return_value_if(!out, false, ERR_OBJECT_INITIALIZATION_FAILED);
+  if (batch->len > 0) memcpy(buffer, batch->buffer, batch->len);
+  batch->buffer = buffer;
+  batch->cap = cap;
 
-    while (true) {
-      isize header_bytes_read = fread(header_buffer, sizeof(char), HEADER_SIZE, fp);
-      if (header_bytes_read < HEADER_SIZE) break;
+  return true;
+}
 
-      Header header = decodeHeader(header_buffer);
+// The batch header and the records go out in one pwritev. The keydir is only updated once all of
+// it is in the file, and synced when sync_on_put is set; a short write is cut off again so that the
+// next append does not follow a partial batch.
+private bool appendBatch(BcHandle *bc, BcBatch *batch) {
+  if (bc->merge != NULL) mergePoll(bc);
 
-      isize val_pos = 0;
-      isize val_pos_bytes_read = fread(&val_pos, sizeof(char), VAL_POS_SIZE, fp);
-      if (val_pos_bytes_read < VAL_POS_SIZE) break;
+  if (bc->cursor >= bc->options.max_file_size) {
+    bool out = getNewFileHandle(bc);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
 
-      char *key_data = new (&bc->arena, char, header.key_len);
-      return_value_if(key_data == NULL, false, ERR_OUT_OF_MEMORY);
+  return_value_if(bc->cursor >= PTRDIFF_MAX - (isize)sizeof(BatchHeader) - batch->len, false,
+                  ERR_ARITHEMATIC_OVERFLOW);
 
-      isize bytes_read = fread(key_data, sizeof(char), header.key_len, fp);
-      if (bytes_read < header.key_len) break;
+  BatchHeader batch_header = {
+      .count = batch->count,
+      .key_len = BATCH_MARKER,
+      .body_len = batch->len,
+      .body_crc = crc_64(0, batch->buffer, batch->len),
+  };
+  batch_header.crc = crc_64(0, &batch_header, offsetof(BatchHeader, crc));
 
-      s8 key = {.data = (char *)key_data, .len = header.key_len};
+  struct iovec iov[] = {
+      {.iov_base = &batch_header, .iov_len = sizeof(BatchHeader)},
+      {.iov_base = batch->buffer, .iov_len = batch->len},
+  };
+  isize total = sizeof(BatchHeader) + batch->len;
 
-      KeyDirEntry kd_entry = {
-          .timestamp = header.timestamp,
-          .val_len = header.val_len,
-          .val_pos = val_pos,
-      };
+  // Buffered records have to reach the file before the batch does.
+  WriteBuffer *wb = bc->write_buffer;
+  bool out = flushWriteBuffer(wb);
+  return_value_if(!out, false, ERR_ACCESS);
 
-      kd_entry.file_id = new(&bc->arena, char, PATH_MAX);
-      memcpy(kd_entry.file_id, merged_file_path, PATH_MAX);
+  isize bytes_written = pwritev(wb->fd, iov, countof(iov), bc->cursor);
+  bool is_written = bytes_written == total;
+  if (!is_written && bytes_written > 0) ftruncate(wb->fd, bc->cursor);
+  return_value_if(!is_written, false, ERR_ACCESS);
 
-      bool res = ht_insert(&bc->key_dir, key, kd_entry);
-      return_value_if(!res, false, ERR_KEY_INSERT_FAILED);
-    }
+  if (bc->commit == NULL && bc->options.sync_on_put) {
+    i8 res = fdatasync(wb->fd);
+    return_value_if(res == -1, false, ERR_ACCESS);
+  }
 
-    fclose(fp);
+  // Readers take the batch's records from the file once they find them in the keydir.
+  writeBufferBegin(wb);
+  wb->offset = bc->cursor + total;
+  writeBufferEnd(wb);
+
+  isize val_pos = bc->cursor + sizeof(BatchHeader);
+  for (isize pos = 0; pos < batch->len;) {
+    Header header = decodeHeader(batch->buffer + pos);
+    s8 key = {.data = batch->buffer + pos + KEY_OFFSET, .len = header.key_len};
+
+    KeyDirEntry kd_entry = {
+        .timestamp = header.timestamp,
+        .val_len = header.val_len,
+        .val_pos = val_pos + pos,
+        .file_id = bc->active_file_id,
+    };
+
+    u64 key_hash = ht_hash(key);
+    HtUpsertResult res = ht_upsert_hashed(&bc->key_dir, key, key_hash, kd_entry, &bc->arena);
+    return_value_if(!res.is_ok, false, ERR_KEY_INSERT_FAILED);
+    countUpsert(bc, key, kd_entry, res);
+
+    hintAdd(&bc->hint, key, key_hash, kd_entry);
+    pos += HEADER_SIZE + sizeof(u64) + header.key_len + header.val_len;
   }
 
+  bc->file_table.files[bc->active_file_id].stats.dead_bytes += sizeof(BatchHeader);
+  bc->cursor += total;
   return true;
 }
 
-private bool mergeEntries(BcHandle *bc, char *data_file_path) {
-  isize merged_files_count = countFiles(bc->merged_dir_path);
-  return_value_if(merged_files_count == -1, false, ERR_ACCESS);
+// Whether buffer starts with a batch header followed by the whole, intact, batch.
+private bool isBatchComplete(char *buffer, isize len) {
+  if (len < (isize)sizeof(BatchHeader)) return false;
 
-  char merged_file_path[PATH_MAX];
-  char hint_file_path[PATH_MAX];
+  BatchHeader batch_header;
+  memcpy(&batch_header, buffer, sizeof(BatchHeader));
 
-  bool out = getFilePath(merged_file_path, bc->merged_dir_path, MERGED_EXT, merged_files_count);
-  out = getFilePath(hint_file_path, bc->hint_dir_path, HINT_EXT, merged_files_count);
+  return crc_64(0, &batch_header, offsetof(BatchHeader, crc)) == batch_header.crc &&
+         batch_header.body_len >= 0 &&
+         batch_header.body_len <= len - (isize)sizeof(BatchHeader) &&
+         crc_64(0, buffer + sizeof(BatchHeader), batch_header.body_len) ==
+             batch_header.body_crc;
+}
 
-  return_value_if(!out, false, ERR_ACCESS);
+bool appendEntry(BcHandle *bc, s8 key, s8 val) {
+  if (bc->merge != NULL) mergePoll(bc);
 
-  FILE *data_fp = fopen(data_file_path, "rb");
-  FILE *merged_fp = fopen(merged_file_path, "ab");
-  FILE *hint_fp = fopen(hint_file_path, "ab");
+  if (bc->cursor >= bc->options.max_file_size) {
+    bool out = getNewFileHandle(bc);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
 
-  return_value_if(data_fp == NULL || merged_fp == NULL || hint_fp == NULL, false, ERR_ACCESS);
+  Header header = {
+    .timestamp = getTimestamp(),
+    .key_len = key.len,
+    .val_len = val.len,
+  };
 
-  struct stat st;
-  int res = stat(merged_file_path, &st);
-  return_value_if(res == -1, false, ERR_ACCESS);
+  BcEntry bc_entry = {
+      .header = header,
+      .key = key.data,
+      .val = val.data,
+      .crc = 0,
+      .is_crc32c = bc->options.crc32c_records,
+  };
 
-  char header_buffer[HEADER_SIZE] = {0};
+  return_value_if(key.len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - val.len, false,
+                  ERR_ARITHEMATIC_OVERFLOW);
 
-  isize cursor = st.st_size;
-  while (true) {
-    isize val_pos = ftell(merged_fp);
+  bc_entry.buffer_len = HEADER_SIZE + sizeof(u64) + key.len + val.len;
 
-    isize header_bytes_read = fread(header_buffer, sizeof(char), HEADER_SIZE, data_fp);
-    if (header_bytes_read < HEADER_SIZE) break;
+  WriteBuffer *wb = bc->write_buffer;
+  if (wb->cap - wb->len < bc_entry.buffer_len) {
+    bool out = flushWriteBuffer(wb);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
 
-    Header header = decodeHeader(header_buffer);
+  KeyDirEntry kd_entry = {
+      .timestamp = bc_entry.header.timestamp,
+      .val_len = bc_entry.header.val_len,
+      .val_pos = bc->cursor,
+      .file_id = bc->active_file_id,
+  };
 
-    char *key = new (&bc->arena, char, header.key_len);
-    char *val = new (&bc->arena, char, header.val_len);
-    return_value_if(key == NULL || val == NULL, false, ERR_OUT_OF_MEMORY);
+  // The record is encoded straight into the write buffer, unless it does not fit even an empty one.
+  if (bc_entry.buffer_len <= wb->cap) {
+    bc_entry.buffer = wb->data + wb->len;
+    encodeEntry(bc_entry);
+    wb->len += bc_entry.buffer_len;
+  } else {
+    bool out = writeUnbuffered(wb, bc_entry);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
 
-    s8 s8val = {.data = val, .len = header.val_len};
+  return indexRecord(bc, key, kd_entry, bc_entry.buffer_len);
+}
 
-    isize key_bytes_read = fread(key, sizeof(char), header.key_len, data_fp);
-    if (key_bytes_read < header.key_len) break;
+// Writes a record too large for the write buffer from the caller's key and value, so that only its
+// header and CRC are encoded here.
+private bool writeUnbuffered(WriteBuffer *wb, BcEntry bc_entry) {
+  Header header = bc_entry.header;
+  char header_buffer[HEADER_SIZE];
+  memcpy(header_buffer, &header.timestamp, sizeof(i64));
+  memcpy(header_buffer + KEY_LEN_OFFSET, &header.key_len, sizeof(isize));
+  memcpy(header_buffer + VAL_LEN_OFFSET, &header.val_len, sizeof(isize));
 
-    isize val_bytes_read = fread(val, sizeof(char), header.val_len, data_fp);
-    if (val_bytes_read < header.val_len) break;
+  u64 crc;
+  if (bc_entry.is_crc32c) {
+    u32 crc32c = crc_32c(0, header_buffer, HEADER_SIZE);
+    crc32c = crc_32c(crc32c, bc_entry.key, header.key_len);
+    crc = (u64)CRC32C_TAG << 32 | crc_32c(crc32c, bc_entry.val, header.val_len);
+  } else {
+    crc = crc_64(0, header_buffer, HEADER_SIZE);
+    crc = crc_64(crc, bc_entry.key, header.key_len);
+    crc = crc_64(crc, bc_entry.val, header.val_len);
+  }
 
-    u64 crc = 0;
-    isize crc_bytes_read = fread(&crc, sizeof(char), sizeof(u64), data_fp);
-    if (crc_bytes_read < sizeof(u64)) break;
+  struct iovec iov[] = {
+      {.iov_base = header_buffer, .iov_len = HEADER_SIZE},
+      {.iov_base = bc_entry.key, .iov_len = header.key_len},
+      {.iov_base = bc_entry.val, .iov_len = header.val_len},
+      {.iov_base = &crc, .iov_len = sizeof(u64)},
+  };
+  bool out = writevAt(wb->fd, iov, countof(iov), wb->offset);
+  return_value_if(!out, false, ERR_ACCESS);
 
-    if (!s8cmp(s8val, s8("🪦"))) {
-      fwrite(header_buffer, sizeof(char), HEADER_SIZE, merged_fp);
-      fwrite(key, sizeof(char), header.key_len, merged_fp);
-      fwrite(val, sizeof(char), header.val_len, merged_fp);
-      fwrite(&crc, sizeof(char), sizeof(u64), merged_fp);
+  writeBufferBegin(wb);
+  wb->offset += bc_entry.buffer_len;
+  writeBufferEnd(wb);
 
-      fwrite(header_buffer, sizeof(char), HEADER_SIZE, hint_fp);
-      fwrite(&val_pos, sizeof(char), sizeof(isize), hint_fp);
-      fwrite(key, sizeof(char), header.key_len, hint_fp);
-    }
+  return true;
+}
 
-    return_value_if(header.key_len >= PTRDIFF_MAX - HEADER_SIZE - header.val_len - sizeof(u64),
-                    false, ERR_ARITHEMATIC_OVERFLOW);
-    return_value_if(
-        cursor >= PTRDIFF_MAX - HEADER_SIZE - header.val_len - header.key_len - sizeof(u64), false,
-		    ERR_ARITHEMATIC_OVERFLOW);
+// Points the keydir at a record just appended at the cursor, and moves the cursor past it.
+private bool indexRecord(BcHandle *bc, s8 key, KeyDirEntry kd_entry, isize record_len) {
+  u64 key_hash = ht_hash(key);
+  HtUpsertResult res = ht_upsert_hashed(&bc->key_dir, key, key_hash, kd_entry, &bc->arena);
+  return_value_if(!res.is_ok, false, ERR_KEY_INSERT_FAILED);
+  countUpsert(bc, key, kd_entry, res);
 
-    cursor += HEADER_SIZE + header.key_len + header.val_len + sizeof(u64);
+  hintAdd(&bc->hint, key, key_hash, kd_entry);
 
-    if (cursor >= bc->options.max_file_size) {
-      fclose(merged_fp);
-      fclose(hint_fp);
+  return_value_if(bc->cursor >= PTRDIFF_MAX - record_len, false, ERR_ARITHEMATIC_OVERFLOW);
+  bc->cursor += record_len;
 
-      getFilePath(merged_file_path, bc->merged_dir_path, MERGED_EXT, merged_files_count + 1);
-      getFilePath(hint_file_path, bc->hint_dir_path, HINT_EXT, merged_files_count + 1);
+  return true;
+}
 
-      merged_fp = fopen(merged_file_path, "ab");
-      hint_fp = fopen(hint_file_path, "ab");
+// Adds len bytes to the end of the active file: copied into the write buffer when they fit an
+// empty one, otherwise written out right away. Readers never look past the cursor, which is only
+// moved by bc_put_end, so the buffered bytes are not guarded by seq.
+private bool streamAppend(WriteBuffer *wb, char *data, isize len) {
+  if (wb->cap - wb->len < len) {
+    bool out = flushWriteBuffer(wb);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
 
-      return_value_if(merged_fp == NULL || hint_fp == NULL, false, ERR_ACCESS);
-    }
+  if (len <= wb->cap) {
+    memcpy(wb->data + wb->len, data, len);
+    wb->len += len;
+    return true;
   }
 
-  unlink(data_file_path);
-  fclose(data_fp);
-  fclose(merged_fp);
-  fclose(hint_fp);
+  bool out = writeAt(wb->fd, data, len, wb->offset);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  writeBufferBegin(wb);
+  wb->offset += len;
+  writeBufferEnd(wb);
+
+  return true;
+}
+
+private bool streamWrite(BcPutStream *stream, char *data, isize len) {
+  bool out = streamAppend(stream->bc->write_buffer, data, len);
+  if (!out) return false;
+
+  if (stream->is_crc32c) {
+    stream->crc = crc_32c(stream->crc, data, len);
+  } else {
+    stream->crc = crc_64(stream->crc, data, len);
+  }
+  stream->written += len;
+
+  return true;
+}
+
+// Reads the active file like readShared does, watching the write buffer's seq, and every other
+// file through the stream's own descriptor.
+private bool streamRead(BcGetStream *stream, char *buffer, isize pos, isize len) {
+  BcHandle *bc = stream->bc;
+  WriteBuffer *wb = bc->write_buffer;
+
+  while (true) {
+    u64 seq = atomic_load_explicit((_Atomic u64 *)&wb->seq, memory_order_acquire);
+    if (seq & 1) continue;
+
+    bool is_active = stream->file_id == bc->active_file_id;
+    bool is_read = false;
+    if (is_active) {
+      WriteBuffer view = *wb;
+      is_read = readActive(&view, buffer, pos, len);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit((_Atomic u64 *)&wb->seq, memory_order_relaxed) != seq) continue;
+
+    if (!is_active) break;
+    return is_read;
+  }
+
+  return readAt(stream->fd, buffer, len, pos) == len;
+}
+
+// crc32c is only needed for a trailer with the tag, which a CRC-64 may carry by chance as well.
+private void streamCrc(BcGetStream *stream, char *data, isize len) {
+  stream->crc = crc_64(stream->crc, data, len);
+  if (stream->trailer >> 32 == CRC32C_TAG) stream->crc32c = crc_32c(stream->crc32c, data, len);
+}
+
+// The same checks as isRecordValid, run on the CRCs computed along the way.
+private bool streamIsValid(BcGetStream *stream) {
+  u64 trailer = stream->trailer;
+  if (trailer >> 32 == CRC32C_TAG && stream->crc32c == (u32)trailer) return true;
+
+  return crc_64(stream->crc, &trailer, sizeof(u64)) == 0;
+}
+
+bool syncActiveFile(BcHandle *bc) {
+  bool is_flushed = flushWriteBuffer(bc->write_buffer);
+  return_value_if(!is_flushed, false, ERR_ACCESS);
+
+  i8 out = fdatasync(bc->write_buffer->fd);
+  return_value_if(out == -1, false, ERR_ACCESS);
+
+  return true;
+}
+
+// The active file is opened without O_APPEND, every write to it goes to an explicit offset.
+private bool openWriteBuffer(BcHandle *bc) {
+  WriteBuffer *wb = bc->write_buffer;
+  if (wb == NULL) {
+    wb = new (&bc->arena, WriteBuffer);
+    return_value_if(wb == NULL, false, ERR_OUT_OF_MEMORY);
+
+    // A read only handle never appends, so it only needs the descriptor.
+    if (bc->options.read_write) {
+      wb->cap = bc->options.write_buffer_size;
+      wb->data = alloc(&bc->arena, 1, WRITE_BUFFER_ALIGN, wb->cap, NOZERO);
+      return_value_if(wb->data == NULL, false, ERR_OUT_OF_MEMORY);
+    }
+
+    wb->io = new (&bc->arena, IoQueue);
+    return_value_if(wb->io == NULL, false, ERR_OUT_OF_MEMORY);
+
+    // Without a ring bc_submit falls back to the blocking calls.
+    wb->io->depth = bc->options.io_depth;
+    if (bc->options.io_uring) wb->io->has_ring = uring_create(&wb->io->ring, wb->io->depth);
+
+    bc->write_buffer = wb;
+    bc->io = wb->io;
+  }
+
+  int flags = (bc->options.read_write ? O_RDWR : O_RDONLY) | O_CREAT | O_CLOEXEC;
+  wb->fd = open(bc->active_file_path, flags, 0644);
+  return_value_if(wb->fd == -1, false, ERR_ACCESS);
+
+  wb->len = 0;
+  wb->offset = 0;
+  return true;
+}
+
+// Writes the buffered records out at their place in the active file.
+private bool flushWriteBuffer(WriteBuffer *wb) {
+  // Whatever bc_submit handed to the ring is written, and the buffer emptied up to it, first.
+  if (wb->io->in_flight > 0) {
+    bool out = ioDrain(wb);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
+
+  if (wb->len == 0) return true;
+
+  bool out = writeAt(wb->fd, wb->data, wb->len, wb->offset);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  writeBufferBegin(wb);
+  wb->offset += wb->len;
+  wb->len = 0;
+  writeBufferEnd(wb);
+
+  return true;
+}
+
+// Like HashTable.seq, seq is odd while the buffered bytes are moved or the active file replaced,
+// which tells readers of Options.concurrent_reads that what they copied meanwhile is stale.
+private void writeBufferBegin(WriteBuffer *wb) {
+  u64 seq = atomic_load_explicit((_Atomic u64 *)&wb->seq, memory_order_relaxed);
+  atomic_store_explicit((_Atomic u64 *)&wb->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+private void writeBufferEnd(WriteBuffer *wb) {
+  u64 seq = atomic_load_explicit((_Atomic u64 *)&wb->seq, memory_order_relaxed);
+  atomic_store_explicit((_Atomic u64 *)&wb->seq, seq + 1, memory_order_release);
+}
+
+i64 getMonotonicNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+private bool commitStart(BcHandle *bc) {
+  GroupCommit *commit = new (&bc->arena, GroupCommit);
+  return_value_if(commit == NULL, false, ERR_OUT_OF_MEMORY);
+
+  // Group deadlines are taken from CLOCK_MONOTONIC, so the wait for them must use it too.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+  pthread_mutex_init(&commit->write_lock, NULL);
+  pthread_mutex_init(&commit->lock, NULL);
+  pthread_cond_init(&commit->pending, &attr);
+  pthread_cond_init(&commit->durable, NULL);
+  pthread_condattr_destroy(&attr);
+
+  commit->write_buffer = bc->write_buffer;
+  commit->delay_ns = bc->options.commit_delay_us * 1000;
+  commit->batch_size = bc->options.commit_batch_size;
+
+  i8 res = pthread_create(&commit->thread, NULL, commitWorker, commit);
+  return_value_if(res != 0, false, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  bc->commit = commit;
+  return true;
+}
+
+// Lets the thread make the last group durable and waits for it to exit.
+private void commitStop(GroupCommit *commit) {
+  pthread_mutex_lock(&commit->lock);
+  commit->is_stopping = true;
+  pthread_cond_signal(&commit->pending);
+  pthread_mutex_unlock(&commit->lock);
+
+  pthread_join(commit->thread, NULL);
+
+  pthread_mutex_destroy(&commit->write_lock);
+  pthread_mutex_destroy(&commit->lock);
+  pthread_cond_destroy(&commit->pending);
+  pthread_cond_destroy(&commit->durable);
+}
+
+// Called with write_lock held once a put is appended, returns its sequence number.
+i64 commitAppended(GroupCommit *commit) {
+  pthread_mutex_lock(&commit->lock);
+
+  if (commit->written_seq == commit->durable_seq) commit->group_start_ns = getMonotonicNs();
+  i64 seq = ++commit->written_seq;
+  if (seq - commit->durable_seq == 1 || seq - commit->durable_seq >= commit->batch_size) {
+    pthread_cond_signal(&commit->pending);
+  }
+
+  pthread_mutex_unlock(&commit->lock);
+  return seq;
+}
+
+bool commitWait(GroupCommit *commit, i64 seq, i64 start_ns) {
+  pthread_mutex_lock(&commit->lock);
+
+  while (commit->durable_seq < seq && !commit->is_failed) {
+    pthread_cond_wait(&commit->durable, &commit->lock);
+  }
+
+  bool is_durable = commit->durable_seq >= seq;
+  if (is_durable) {
+    i64 latency_ns = getMonotonicNs() - start_ns;
+    CommitStats *stats = &commit->stats;
+
+    isize bucket = 0;
+    for (i64 us = latency_ns / 1000; us > 0 && bucket < COMMIT_HIST_LEN - 1; us >>= 1) bucket++;
+
+    stats->puts++;
+    stats->latency_total_ns += latency_ns;
+    if (latency_ns > stats->latency_max_ns) stats->latency_max_ns = latency_ns;
+    stats->latency_hist[bucket]++;
+  }
+
+  pthread_mutex_unlock(&commit->lock);
+
+  return_value_if(!is_durable, false, ERR_ACCESS);
+  return true;
+}
+
+// Called with lock held after a sync that covered every put up to seq. A failed sync leaves it
+// unknown which writes reached the disk, so every put waiting or to come fails.
+private void commitDone(GroupCommit *commit, i64 seq, bool is_ok) {
+  if (is_ok) {
+    commit->durable_seq = seq;
+    commit->stats.syncs++;
+  } else {
+    commit->is_failed = true;
+  }
+
+  pthread_cond_broadcast(&commit->durable);
+}
+
+// Syncs the active file right away, with write_lock held so that no put is appended meanwhile.
+// Used before the active file is sealed and by bc_sync.
+private bool commitFlush(GroupCommit *commit) {
+  pthread_mutex_lock(&commit->lock);
+
+  while (commit->is_syncing) pthread_cond_wait(&commit->durable, &commit->lock);
+
+  WriteBuffer *wb = commit->write_buffer;
+  bool is_ok = !commit->is_failed && flushWriteBuffer(wb) && fdatasync(wb->fd) == 0;
+  if (commit->durable_seq < commit->written_seq || !is_ok) {
+    commitDone(commit, commit->written_seq, is_ok);
+  }
+
+  pthread_mutex_unlock(&commit->lock);
+
+  return_value_if(!is_ok, false, ERR_ACCESS);
+  return true;
+}
+
+// A group starts with the first put appended after the previous sync. It is synced once
+// batch_size puts are waiting or delay_ns after it started, whichever comes first. Puts appended
+// while a sync is running form the next group. The write buffer is only written out under
+// write_lock, which is taken with lock released since puts take the two in that order.
+private void *commitWorker(void *arg) {
+  GroupCommit *commit = arg;
+
+  pthread_mutex_lock(&commit->lock);
+  while (true) {
+    while (commit->written_seq == commit->durable_seq && !commit->is_stopping) {
+      pthread_cond_wait(&commit->pending, &commit->lock);
+    }
+    if (commit->written_seq == commit->durable_seq || commit->is_failed) break;
+
+    i64 deadline_ns = commit->group_start_ns + commit->delay_ns;
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000,
+        .tv_nsec = deadline_ns % 1000000000,
+    };
+
+    while (commit->written_seq - commit->durable_seq < commit->batch_size &&
+           !commit->is_stopping) {
+      i32 res = pthread_cond_timedwait(&commit->pending, &commit->lock, &deadline);
+      if (res == ETIMEDOUT) break;
+    }
+
+    pthread_mutex_unlock(&commit->lock);
+
+    pthread_mutex_lock(&commit->write_lock);
+    WriteBuffer *wb = commit->write_buffer;
+    bool is_ok = flushWriteBuffer(wb);
+    int fd = wb->fd;
+
+    pthread_mutex_lock(&commit->lock);
+    i64 seq = commit->written_seq;
+    commit->is_syncing = true;
+    pthread_mutex_unlock(&commit->lock);
+    pthread_mutex_unlock(&commit->write_lock);
+
+    i64 sync_start_ns = getMonotonicNs();
+    is_ok = is_ok && fdatasync(fd) == 0;
+
+    pthread_mutex_lock(&commit->lock);
+    commit->is_syncing = false;
+    commitDone(commit, seq, is_ok);
+
+    // The puts appended during the sync have waited at most since it started.
+    if (commit->written_seq > commit->durable_seq) commit->group_start_ns = sync_start_ns;
+  }
+  pthread_mutex_unlock(&commit->lock);
+
+  return NULL;
+}
+
+bool bc_submit(BcHandle *bc, BcIo *io, Arena *scratch) {
+  return_value_if(bc->commit != NULL, false, ERR_SUBMIT_GROUP_COMMIT);
+
+  io->is_ok = false;
+  io->next = NULL;
+
+  switch (io->op) {
+    case BC_IO_GET:
+      return submitGet(bc, io, scratch);
+    case BC_IO_PUT:
+      io->is_ok = bc_put(bc, io->key, io->val);
+      break;
+    case BC_IO_DELETE:
+      io->is_ok = bc_delete(bc, io->key);
+      break;
+    case BC_IO_SYNC:
+      if (bc->io->has_ring && bc->write_buffer->cap <= INT32_MAX) return submitSync(bc, io);
+      io->is_ok = syncActiveFile(bc);
+      break;
+  }
+
+  ioDone(bc->io, io);
+  return true;
+}
+
+isize bc_complete(BcHandle *bc, BcIo **ios, isize max, isize min) {
+  IoQueue *queue = bc->io;
+  if (min > max) min = max;
+
+  if (queue->has_ring) {
+    bool is_ok = ioWait(bc->write_buffer, 0);
+    while (is_ok && queue->done_len < min && queue->in_flight > 0) {
+      is_ok = ioWait(bc->write_buffer, 1);
+    }
+  }
+
+  isize count = 0;
+  for (; count < max && queue->done_head != NULL; count++) {
+    ios[count] = queue->done_head;
+    queue->done_head = queue->done_head->next;
+  }
+  if (queue->done_head == NULL) queue->done_tail = NULL;
+  queue->done_len -= count;
+
+  return count;
+}
+
+// Only reads that would block go through the ring. Missing keys and values that are still
+// buffered or mapped are served by bc_get right away.
+private bool submitGet(BcHandle *bc, BcIo *io, Arena *scratch) {
+  IoQueue *queue = bc->io;
+  WriteBuffer *wb = bc->write_buffer;
+
+  KeyDirEntry *kd_entry = queue->has_ring ? ht_get(&bc->key_dir, io->key) : NULL;
+  bool is_active = kd_entry != NULL && kd_entry->file_id == bc->active_file_id;
+  bool is_blocking = kd_entry != NULL && !(is_active && kd_entry->val_pos >= wb->offset) &&
+                     !(!is_active && bc->options.mmap_segments) &&
+                     io->key.len < INT32_MAX / 2 && kd_entry->val_len < INT32_MAX / 2;
+
+  // A file without a cached descriptor, which concurrent readers must not have closed, is read by
+  // bc_get as well.
+  int fd = -1;
+  if (is_blocking) fd = is_active ? wb->fd : getFileFd(bc, kd_entry->file_id);
+  if (fd == -1 && bc->options.concurrent_reads) is_blocking = false;
+
+  if (!is_blocking) {
+    io->val = bc_get(bc, io->key, scratch);
+    io->is_ok = io->val.len != -1;
+    ioDone(queue, io);
+    return true;
+  }
+
+  io->val = (s8){.data = NULL, .len = -1};
+  io->buffer_len = HEADER_SIZE + sizeof(u64) + io->key.len + kd_entry->val_len;
+  io->buffer = new (scratch, char, io->buffer_len, NOZERO);
+
+  if (io->buffer == NULL || fd == -1 || !ioReserve(wb, 1)) {
+    ioDone(queue, io);
+    return true;
+  }
+
+  io->is_verified = shouldVerify(bc, kd_entry->file_id);
+  uring_read(&queue->ring, fd, io->buffer, io->buffer_len, kd_entry->val_pos, (uptr)io);
+  queue->in_flight++;
+
+  return true;
+}
+
+// The buffered records not handed to the ring yet are written by one request, and the fdatasync
+// linked to it. Earlier writes of the buffer may still be in flight, in which case the new ones
+// wait for everything queued before them.
+private bool submitSync(BcHandle *bc, BcIo *io) {
+  IoQueue *queue = bc->io;
+  WriteBuffer *wb = bc->write_buffer;
+
+  if (!ioReserve(wb, 2)) {
+    ioDone(queue, io);
+    return true;
+  }
+
+  u8 flags = queue->writes > 0 ? URING_DRAIN : 0;
+  isize len = wb->len - wb->submitted;
+  if (len > 0) {
+    // A write is told apart from a request by its odd user_data, which also holds its extent.
+    u64 user_data = (u64)wb->submitted << 32 | (u64)len << 1 | 1;
+    uring_write(&queue->ring, wb->fd, wb->data + wb->submitted, len, wb->offset + wb->submitted,
+                user_data, flags | URING_LINK);
+
+    flags = 0;
+    wb->submitted = wb->len;
+    queue->writes++;
+    queue->in_flight++;
+  }
+
+  uring_fdatasync(&queue->ring, wb->fd, (uptr)io, flags);
+  queue->in_flight++;
+
+  return true;
+}
+
+// Completions are only taken while waiting for them, so the requests in flight are capped to what
+// the completion queue holds.
+private bool ioReserve(WriteBuffer *wb, u32 count) {
+  IoQueue *queue = wb->io;
+
+  while (queue->in_flight + count > queue->depth) {
+    bool out = ioWait(wb, 1);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
+
+  return uring_reserve(&queue->ring, count);
+}
+
+// Submits the queued requests, waits for wait_nr completions and handles every one available.
+private bool ioWait(WriteBuffer *wb, u32 wait_nr) {
+  IoQueue *queue = wb->io;
+
+  bool out = uring_submit(&queue->ring, wait_nr);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  UringCqe cqe;
+  while (uring_pop(&queue->ring, &cqe)) ioComplete(wb, cqe);
+
+  return true;
+}
+
+private bool ioDrain(WriteBuffer *wb) {
+  while (wb->io->in_flight > 0) {
+    bool out = ioWait(wb, 1);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
+
+  return true;
+}
+
+private void ioComplete(WriteBuffer *wb, UringCqe cqe) {
+  IoQueue *queue = wb->io;
+  queue->in_flight--;
+
+  if (cqe.user_data & 1) {
+    isize start = cqe.user_data >> 32;
+    isize len = (cqe.user_data >> 1) & INT32_MAX;
+    isize written = cqe.res > 0 ? cqe.res : 0;
+
+    // A failed or short write cancels the fdatasync linked to it. The rest is written here, and
+    // the sync redone when its cancellation comes in.
+    if (written < len && !writeAt(wb->fd, wb->data + start + written, len - written,
+                                  wb->offset + start + written)) {
+      queue->is_failed = true;
+    }
+
+    // The buffer is emptied up to what was submitted once none of it is being written.
+    if (--queue->writes == 0) {
+      writeBufferBegin(wb);
+      memmove(wb->data, wb->data + wb->submitted, wb->len - wb->submitted);
+      wb->offset += wb->submitted;
+      wb->len -= wb->submitted;
+      wb->submitted = 0;
+      writeBufferEnd(wb);
+    }
+    return;
+  }
+
+  BcIo *io = (BcIo *)(uptr)cqe.user_data;
+  if (io->op == BC_IO_SYNC) {
+    bool is_synced = cqe.res == 0 || (cqe.res == -ECANCELED && fdatasync(wb->fd) == 0);
+    io->is_ok = is_synced && !queue->is_failed;
+  } else {
+    s8 val = {
+        .data = io->buffer + VAL_OFFSET(io->key.len),
+        .len = io->buffer_len - HEADER_SIZE - sizeof(u64) - io->key.len,
+    };
+    io->is_ok = cqe.res == io->buffer_len &&
+                (!io->is_verified || isRecordValid(io->buffer, io->buffer_len)) &&
+                !s8cmp(s8("🪦"), val);
+    if (io->is_ok) io->val = val;
+  }
+
+  ioDone(queue, io);
+}
+
+private void ioDone(IoQueue *queue, BcIo *io) {
+  if (queue->done_tail != NULL) {
+    queue->done_tail->next = io;
+  } else {
+    queue->done_head = io;
+  }
+  queue->done_tail = io;
+  queue->done_len++;
+}
+
+bool bc_sync(BcHandle *bc) {
+  GroupCommit *commit = bc->commit;
+  if (commit == NULL) return syncActiveFile(bc);
+
+  pthread_mutex_lock(&commit->write_lock);
+  bool out = commitFlush(commit);
+  pthread_mutex_unlock(&commit->write_lock);
+
+  return out;
+}
+
+CommitStats bc_commit_stats(BcHandle *bc) {
+  CommitStats stats = {0};
+  if (bc->commit == NULL) return stats;
+
+  pthread_mutex_lock(&bc->commit->lock);
+  stats = bc->commit->stats;
+  pthread_mutex_unlock(&bc->commit->lock);
+
+  return stats;
+}
+
+bool bc_checkpoint(BcHandle *bc) {
+  return_value_if(!bc->options.read_write, false, ERR_READ_ONLY);
+
+  // bc_open checks the size of the active file against the watermark, so it must include every
+  // record the keydir points to.
+  bool is_flushed = flushWriteBuffer(bc->write_buffer);
+  return_value_if(!is_flushed, false, ERR_ACCESS);
+
+  HashTable *ht = &bc->key_dir;
+  ht_rehash_all(ht);
+
+  FileTable *ft = &bc->file_table;
+  Arena scratch = bc->scratch;
+  isize *file_index = new (&scratch, isize, ft->len, NOZERO);
+  return_value_if(file_index == NULL, false, ERR_OUT_OF_MEMORY);
+
+  // Files without live records are kept too, along with their counters, so that merges still
+  // find them.
+  for (u32 i = 0; i < ft->len; i++) file_index[i] = ft->files[i].is_removed ? -1 : 0;
+
+  isize count = 0;
+  isize keys_len = 0;
+  for (isize i = 0; i < ht->cur.capacity; i++) {
+    if (ht->cur.ctrl[i] & HT_EMPTY) continue;
+
+    KvPair *kv_pair = ht->cur.kv_pairs + i;
+    keys_len += kv_pair->key.len;
+    count++;
+  }
+
+  isize files_len = 0;
+  for (u32 i = 0; i < ft->len; i++) {
+    if (file_index[i] != -1) file_index[i] = files_len++;
+  }
+
+  SnapshotHeader header = {
+      .magic = SNAPSHOT_MAGIC,
+      .group_width = ht_group_width(),
+      .capacity = ht->cur.capacity,
+      .count = count,
+      .files_len = files_len,
+      .keys_len = keys_len,
+      .watermark = {.num = bc->num_files, .pos = bc->cursor},
+  };
+
+  isize snapshot_len = sizeof(SnapshotHeader) + files_len * sizeof(SnapshotFile) +
+                       ht->cur.capacity + count * sizeof(SnapshotEntry) + keys_len + sizeof(u64);
+  char *buffer = mmap(NULL, snapshot_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return_value_if(buffer == MAP_FAILED, false, ERR_OUT_OF_MEMORY);
+
+  char *pos = buffer;
+  memcpy(pos, &header, sizeof(SnapshotHeader));
+  pos += sizeof(SnapshotHeader);
+
+  bool is_ok = true;
+  for (u32 i = 0; i < ft->len && is_ok; i++) {
+    if (file_index[i] == -1) continue;
+
+    SnapshotFile file = getSnapshotFile(bc, i);
+    is_ok = file.size != -1;
+    memcpy(pos, &file, sizeof(SnapshotFile));
+    pos += sizeof(SnapshotFile);
+  }
+
+  memcpy(pos, ht->cur.ctrl, ht->cur.capacity);
+  pos += ht->cur.capacity;
+
+  char *keys = pos + count * sizeof(SnapshotEntry);
+  isize key_off = 0;
+  for (isize i = 0; i < ht->cur.capacity && is_ok; i++) {
+    if (ht->cur.ctrl[i] & HT_EMPTY) continue;
+
+    KvPair *kv_pair = ht->cur.kv_pairs + i;
+    SnapshotEntry entry = {
+        .hash = kv_pair->hash,
+        .timestamp = kv_pair->val.timestamp,
+        .val_pos = kv_pair->val.val_pos,
+        .val_len = kv_pair->val.val_len,
+        .key_off = key_off,
+        .key_len = kv_pair->key.len,
+        .file = file_index[kv_pair->val.file_id],
+    };
+    memcpy(pos, &entry, sizeof(SnapshotEntry));
+    pos += sizeof(SnapshotEntry);
+
+    memcpy(keys + key_off, kv_pair->key.data, kv_pair->key.len);
+    key_off += kv_pair->key.len;
+  }
+
+  u64 crc = crc_64(0, buffer, snapshot_len - sizeof(u64));
+  memcpy(buffer + snapshot_len - sizeof(u64), &crc, sizeof(u64));
+
+  char snapshot_path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  is_ok = is_ok && getSnapshotPath(bc, snapshot_path) &&
+          snprintf(tmp_path, PATH_MAX, "%s.tmp", snapshot_path) < PATH_MAX;
+
+  int fd = -1;
+  if (is_ok) fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+  is_ok = fd != -1 && writeAll(fd, buffer, snapshot_len);
+  if (fd != -1) close(fd);
+  munmap(buffer, snapshot_len);
+
+  is_ok = is_ok && rename(tmp_path, snapshot_path) == 0;
+  if (!is_ok) unlink(tmp_path);
+  return_value_if(!is_ok, false, ERR_ACCESS);
+
+  return true;
+}
+
+// Nothing is ever freed from the handle arena, so the bytes used so far are its high-water mark.
+isize bc_arena_high_water(BcHandle *bc) { return bc->arena.beg - bc->arena_base; }
+
+ScrubStats bc_scrub_stats(BcHandle *bc) {
+  Scrubber *scrub = bc->scrub;
+  if (scrub == NULL) return (ScrubStats){0};
+
+  pthread_mutex_lock(&scrub->lock);
+  ScrubStats stats = scrub->stats;
+  pthread_mutex_unlock(&scrub->lock);
+
+  return stats;
+}
+
+isize bc_file_stats(BcHandle *bc, BcFileStats *stats, isize max) {
+  FileTable *ft = &bc->file_table;
+
+  isize len = 0;
+  for (u32 i = 0; i < ft->len; i++) {
+    BcFile *file = ft->files + i;
+    if (file->is_removed) continue;
+
+    if (len < max) stats[len] = (BcFileStats){.path = file->path, .stats = file->stats};
+    len++;
+  }
+
+  return len;
+}
+
+// Counts the regular files in dir_path whose name ends in extension.
+private isize countFiles(char *dir_path, s8 extension) {
+  DIR *dirp = opendir(dir_path);
+  return_value_if(dirp == NULL, -1, ERR_ACCESS);
+
+  errno = 0;
+  struct dirent *entry;
+  isize num_files = 0;
+  while ((entry = readdir(dirp)) != NULL) {
+    if (entry->d_type != DT_REG) continue;
+
+    char *file_extension = strrchr(entry->d_name, '.');
+    if (file_extension != NULL && strcmp(file_extension + 1, extension.data) == 0) {
+      num_files++;
+    }
+  }
+
+  return_value_if(errno != 0, -1, ERR_ACCESS);
+
+  closedir(dirp);
+
+  return num_files;
+}
+
+// Sets first and last to the lowest and highest number among the files with the given extension,
+// or to 1 and 0 when there are none.
+bool findFiles(char *dir_path, s8 extension, isize *first, isize *last) {
+  DIR *dirp = opendir(dir_path);
+  return_value_if(dirp == NULL, false, ERR_ACCESS);
+
+  *first = 1;
+  *last = 0;
+
+  errno = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dirp)) != NULL) {
+    if (entry->d_type != DT_REG) continue;
+
+    char *file_extension = strrchr(entry->d_name, '.');
+    if (file_extension == NULL || strcmp(file_extension + 1, extension.data) != 0) continue;
+
+    isize num = strtoll(entry->d_name, NULL, 16);
+    if (*last == 0 || num < *first) *first = num;
+    if (num > *last) *last = num;
+  }
+
+  return_value_if(errno != 0, false, ERR_ACCESS);
+
+  closedir(dirp);
+
+  return true;
+}
+
+Header decodeHeader(char *buffer) {
+  Header header = {0};
+  memcpy(&header.timestamp, buffer, sizeof(i64));
+  memcpy(&header.key_len, buffer + KEY_LEN_OFFSET, sizeof(isize));
+  memcpy(&header.val_len, buffer + VAL_LEN_OFFSET, sizeof(isize));
+  return header;
+}
+
+private void encodeEntry(BcEntry bc_entry) {
+  memcpy(bc_entry.buffer, &bc_entry.header.timestamp, sizeof(i64));
+  memcpy(bc_entry.buffer + KEY_LEN_OFFSET, &bc_entry.header.key_len, sizeof(isize));
+  memcpy(bc_entry.buffer + VAL_LEN_OFFSET, &bc_entry.header.val_len, sizeof(isize));
+  memcpy(bc_entry.buffer + KEY_OFFSET, bc_entry.key, bc_entry.header.key_len);
+  memcpy(bc_entry.buffer + VAL_OFFSET(bc_entry.header.key_len), bc_entry.val,
+         bc_entry.header.val_len);
+
+  isize crc_len = bc_entry.buffer_len - sizeof(u64);
+  bc_entry.crc = getRecordCrc(bc_entry.buffer, crc_len, bc_entry.is_crc32c);
+  memcpy(bc_entry.buffer + CRC_OFFSET(bc_entry.header.key_len, bc_entry.header.val_len),
+         &bc_entry.crc, sizeof(u64));
+}
+
+// A record ends in the CRC-64 of the bytes before it, or with Options.crc32c_records in their
+// CRC32C with CRC32C_TAG in the upper half. Readers tell the two apart by the tag, so one file may
+// hold both.
+private u64 getRecordCrc(char *record, isize len, bool is_crc32c) {
+  if (is_crc32c) return (u64)CRC32C_TAG << 32 | crc_32c(0, record, len);
+
+  return crc_64(0, record, len);
+}
+
+// A CRC-64 whose upper half happens to be the tag is still checked as one, after the CRC32C fails.
+bool isRecordValid(char *record, isize record_len) {
+  u64 crc;
+  memcpy(&crc, record + record_len - sizeof(u64), sizeof(u64));
+
+  isize len = record_len - sizeof(u64);
+  if (crc >> 32 == CRC32C_TAG && crc_32c(0, record, len) == (u32)crc) return true;
+
+  return crc_64(0, record, record_len) == 0;
+}
+
+bool getFilePath(char *file_path, char *dir_path, s8 extension, isize num_files) {
+  isize dir_path_len = strnlen(dir_path, PATH_MAX);
+  u8 file_len = 14 + extension.len;
+
+  return_value_if(dir_path_len >= PTRDIFF_MAX - file_len, false, ERR_ARITHEMATIC_OVERFLOW);
+  isize file_path_len = dir_path_len + file_len;
+
+  if (num_files == 0) num_files = 1;
+
+  char file_name[16];
+  getFileName(file_name, num_files);
+  snprintf(file_path, file_path_len, "%s/%s.%s", dir_path, file_name, extension.data);
+
+  return true;
+}
+
+private void getFileName(char *file_name, u32 num) { snprintf(file_name, 16, "%0*X", 8, num); }
+
+private bool getNewFileHandle(BcHandle *bc) {
+  // Puts waiting for their group were appended to the file being sealed, so it is synced now.
+  if (bc->commit != NULL) {
+    bool out = commitFlush(bc->commit);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
+
+  WriteBuffer *wb = bc->write_buffer;
+  bool is_flushed = flushWriteBuffer(wb);
+  return_value_if(!is_flushed, false, ERR_ACCESS);
+  MergeSource sealed = {.file_id = bc->active_file_id, .num = bc->num_files};
+
+  // The sealed file never changes again, so its hint is written now. Failing to write it only
+  // makes the next bc_open scan the file.
+  char hint_path[PATH_MAX];
+  getHintPath(hint_path, bc->active_file_path);
+  hintWrite(&bc->hint, hint_path, bc->cursor);
+
+  if (bc->options.mmap_segments) {
+    bool out = mapFile(bc, bc->active_file_id);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
+
+  // Concurrent readers find the sealed file open once they see that it is no longer active, unless
+  // the descriptor cache is full.
+  FileTable *ft = &bc->file_table;
+  if (bc->options.concurrent_reads && ft->open_fds < bc->options.fd_cache_size) {
+    int fd = getFileFd(bc, bc->active_file_id);
+    return_value_if(fd == -1, false, ERR_ACCESS);
+  }
+
+  bool out = getFilePath(bc->active_file_path, bc->data_dir_path, BIN_EXT, bc->num_files + 1);
+  return_value_if(!out, false, ERR_ACCESS);
+  return_value_if(bc->num_files > PTRDIFF_MAX - 1, false, ERR_ARITHEMATIC_OVERFLOW);
+
+  writeBufferBegin(wb);
+  close(wb->fd);
+  out = openWriteBuffer(bc);
+
+  i64 file_id = out ? addFile(bc, bc->active_file_path) : -1;
+  if (file_id != -1) {
+    bc->active_file_id = file_id;
+    bc->num_files++;
+    bc->cursor = 0;
+  }
+  writeBufferEnd(wb);
+
+  return_value_if(!out, false, ERR_ACCESS);
+  return_value_if(file_id == -1, false, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  if (bc->options.read_write) {
+    i8 out = flock(bc->write_buffer->fd, LOCK_SH);
+    return_value_if(out == -1, false, ERR_ACCESS);
+  }
+
+  if (bc->merge != NULL) {
+    out = mergeAddSource(bc->merge, sealed.file_id, sealed.num);
+    return_value_if(!out, false, ERR_OUT_OF_MEMORY);
+  }
+
+  // A file the scrubber could not take is only left unchecked.
+  if (bc->scrub != NULL) {
+    scrubAddFile(bc->scrub, sealed.file_id, bc->file_table.files[sealed.file_id].path);
+  }
+
+  return true;
+}
+
+// Returns the len bytes at pos of a file: a view into its mapping with Options.mmap_segments,
+// otherwise a copy in scratch. Bytes of the active file that are still buffered are taken from the
+// write buffer.
+private char *readSpan(BcHandle *bc, u32 file_id, isize pos, isize len, Arena *scratch) {
+  bool is_active = file_id == bc->active_file_id;
+
+  if (bc->options.mmap_segments && !is_active) {
+    BcFile *file = bc->file_table.files + file_id;
+
+    // The file may have been appended to by a merge since it was mapped.
+    if (file->map_len < pos + len) {
+      bool out = mapFile(bc, file_id);
+      return_value_if(!out || file->map_len < pos + len, NULL, ERR_ACCESS);
+    }
+
+    return file->map + pos;
+  }
+
+  char *buffer = new (scratch, char, len, NOZERO);
+  return_value_if(buffer == NULL, NULL, ERR_OUT_OF_MEMORY);
+
+  if (is_active) {
+    bool out = readActive(bc->write_buffer, buffer, pos, len);
+    return_value_if(!out, NULL, ERR_ACCESS);
+    return buffer;
+  }
+
+  int fd = getFileFd(bc, file_id);
+  return_value_if(fd == -1, NULL, ERR_ACCESS);
+
+  isize bytes_read = readAt(fd, buffer, len, pos);
+  return_value_if(bytes_read < len, NULL, ERR_ACCESS);
+
+  return buffer;
+}
+
+// Reads what the active file holds up to the write buffer from the file, and the rest from the
+// buffer.
+private bool readActive(WriteBuffer *wb, char *buffer, isize pos, isize len) {
+  isize file_len = len;
+  if (pos + len > wb->offset) file_len = pos < wb->offset ? wb->offset - pos : 0;
+
+  if (file_len > 0 && readAt(wb->fd, buffer, file_len, pos) < file_len) return false;
+
+  if (file_len < len) {
+    isize buffered_pos = pos + file_len - wb->offset;
+    if (wb->len - buffered_pos < len - file_len) return false;
+    memcpy(buffer + file_len, wb->data + buffered_pos, len - file_len);
+  }
+
+  return true;
+}
+
+// readSpan for Options.concurrent_reads, which only reads what the writer publishes. A record of
+// the active file is read while watching the write buffer's seq, and read again if the buffer was
+// flushed or the file replaced meanwhile. Sealed files never change and are read through the
+// descriptors the writer opened, or one opened just for this read if the writer has not got to it.
+private char *readShared(BcHandle *bc, u32 file_id, isize pos, isize len, Arena *scratch) {
+  WriteBuffer *wb = bc->write_buffer;
+  char *buffer = new (scratch, char, len, NOZERO);
+  return_value_if(buffer == NULL, NULL, ERR_OUT_OF_MEMORY);
+
+  BcFile *file = NULL;
+  int fd = -1;
+  char *map = NULL;
+  isize map_len = 0;
+  while (true) {
+    u64 seq = atomic_load_explicit((_Atomic u64 *)&wb->seq, memory_order_acquire);
+    if (seq & 1) continue;
+
+    bool is_active = file_id == bc->active_file_id;
+    bool is_read = false;
+    if (is_active) {
+      WriteBuffer view = *wb;
+      is_read = readActive(&view, buffer, pos, len);
+    } else {
+      file = sharedFile(bc, file_id);
+      fd = file->fd;
+      map = file->map;
+      map_len = file->map_len;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit((_Atomic u64 *)&wb->seq, memory_order_relaxed) != seq) continue;
+
+    if (!is_active) break;
+    return_value_if(!is_read, NULL, ERR_ACCESS);
+    return buffer;
+  }
+
+  // A background merge may unmap the file once the reader is done, the record is copied out then.
+  if (bc->options.mmap_segments && map_len >= pos + len) {
+    if (bc->merge == NULL) return map + pos;
+    memcpy(buffer, map + pos, len);
+    return buffer;
+  }
+
+  bool is_private = fd == -1;
+  if (is_private) fd = open(file->path, O_RDONLY | O_CLOEXEC);
+  return_value_if(fd == -1, NULL, ERR_ACCESS);
+
+  isize bytes_read = readAt(fd, buffer, len, pos);
+  if (is_private) close(fd);
+  return_value_if(bytes_read < len, NULL, ERR_ACCESS);
+
+  return buffer;
+}
+
+private int compareHits(const void *a, const void *b) {
+  const KeyDirEntry *x = &((const MultiGetHit *)a)->kd_entry;
+  const KeyDirEntry *y = &((const MultiGetHit *)b)->kd_entry;
+
+  if (x->file_id != y->file_id) return x->file_id < y->file_id ? -1 : 1;
+  if (x->val_pos != y->val_pos) return x->val_pos < y->val_pos ? -1 : 1;
+  return 0;
+}
+
+private isize getRamSize(void) {
+    isize pages = sysconf(_SC_PHYS_PAGES);
+    isize page_size = sysconf(_SC_PAGE_SIZE);
+
+    return_value_if(pages == -1 || page_size == -1, -1, ERR_SYSCONF);
+    return_value_if(pages >= PTRDIFF_MAX / page_size, -1, ERR_ARITHEMATIC_OVERFLOW);
+
+    isize ram_size = pages * page_size;
+
+    return ram_size;
+}
+
+private i64 getTimestamp(void) {
+  struct timeval tv;
+  i8 out = gettimeofday(&tv, NULL);
+  return_value_if(out == -1, -1, "gettimeofday failed.\n");
+  return tv.tv_sec;
+}
+
+// Returns the id of file_path in the handle's file table, adding it if it is not present yet.
+i64 addFile(BcHandle *bc, char *file_path) {
+  FileTable *ft = &bc->file_table;
+
+  i64 file_id = findFile(bc, file_path);
+  if (file_id != -1) return file_id;
+
+  if (ft->len == ft->capacity) {
+    return_value_if(ft->capacity > UINT32_MAX / 2, -1, ERR_ARITHEMATIC_OVERFLOW);
+    u32 capacity = ft->capacity == 0 ? FILE_TABLE_INIT_CAP : 2 * ft->capacity;
+
+    BcFile *files = new (&bc->arena, BcFile, capacity, NOZERO);
+    return_value_if(files == NULL, -1, ERR_OUT_OF_MEMORY);
+
+    // Concurrent readers may still hold the old table, which stays in the arena, see sharedFile.
+    if (ft->len > 0) memcpy(files, ft->files, ft->len * sizeof(BcFile));
+    atomic_store_explicit((_Atomic(BcFile *) *)&ft->files, files, memory_order_release);
+    ft->capacity = capacity;
+  }
+
+  BcFile *file = ft->files + ft->len;
+  memcpy(file->path, file_path, PATH_MAX);
+  file->fd = -1;
+  file->lru_prev = NO_FILE;
+  file->lru_next = NO_FILE;
+  file->map = NULL;
+  file->map_len = 0;
+  file->stats = (FileStats){0};
+  file->is_removed = false;
+  file->is_verified = false;
+
+  return ft->len++;
+}
+
+// A file as concurrent readers see it. addFile publishes a moved table only once it is complete,
+// and a reader still holding the old one finds the file as it was when the table moved, which is
+// what the keydir entry it looked up refers to.
+private BcFile *sharedFile(BcHandle *bc, u32 file_id) {
+  BcFile *files =
+      atomic_load_explicit((_Atomic(BcFile *) *)&bc->file_table.files, memory_order_acquire);
+  return files + file_id;
+}
+
+i64 findFile(BcHandle *bc, char *file_path) {
+  FileTable *ft = &bc->file_table;
+
+  for (u32 i = 0; i < ft->len; i++) {
+    if (strncmp(ft->files[i].path, file_path, PATH_MAX) == 0) return i;
+  }
+
+  return -1;
+}
+
+// Returns a read only descriptor for an immutable file, opening it if it is not cached. When the
+// cache is full the least recently used descriptor is closed to make room. With
+// Options.concurrent_reads readers may be using any of them, so -1 is returned instead.
+int getFileFd(BcHandle *bc, u32 file_id) {
+  FileTable *ft = &bc->file_table;
+  BcFile *file = ft->files + file_id;
+
+  if (file->fd != -1) {
+    lruUnlink(ft, file_id);
+  } else {
+    if (ft->open_fds >= bc->options.fd_cache_size) {
+      if (bc->options.concurrent_reads) return -1;
+      closeFileFd(bc, ft->lru_tail);
+    }
+
+    file->fd = open(file->path, O_RDONLY | O_CLOEXEC);
+    return_value_if(file->fd == -1, -1, ERR_ACCESS);
+    ft->open_fds++;
+  }
+
+  file->lru_prev = NO_FILE;
+  file->lru_next = ft->lru_head;
+  if (ft->lru_head != NO_FILE) ft->files[ft->lru_head].lru_prev = file_id;
+  ft->lru_head = file_id;
+  if (ft->lru_tail == NO_FILE) ft->lru_tail = file_id;
+
+  return file->fd;
+}
+
+void closeFileFd(BcHandle *bc, u32 file_id) {
+  FileTable *ft = &bc->file_table;
+  BcFile *file = ft->files + file_id;
+  if (file->fd == -1) return;
+
+  // Reads queued for the ring use the descriptor once they are submitted, not before.
+  if (bc->io->has_ring) uring_submit(&bc->io->ring, 0);
+
+  lruUnlink(ft, file_id);
+  close(file->fd);
+  file->fd = -1;
+  ft->open_fds--;
+}
+
+void lruUnlink(FileTable *ft, u32 file_id) {
+  BcFile *file = ft->files + file_id;
+
+  if (file->lru_prev != NO_FILE) {
+    ft->files[file->lru_prev].lru_next = file->lru_next;
+  } else {
+    ft->lru_head = file->lru_next;
+  }
+
+  if (file->lru_next != NO_FILE) {
+    ft->files[file->lru_next].lru_prev = file->lru_prev;
+  } else {
+    ft->lru_tail = file->lru_prev;
+  }
+
+  file->lru_prev = NO_FILE;
+  file->lru_next = NO_FILE;
+}
+
+// Replaces the extension of a data file's path with the hint extension.
+void getHintPath(char *hint_path, char *file_path) {
+  memcpy(hint_path, file_path, PATH_MAX);
+
+  char *extension = strrchr(hint_path, '.');
+  if (extension == NULL) extension = hint_path + strnlen(hint_path, PATH_MAX - HINT_EXT.len - 2);
+  snprintf(extension, HINT_EXT.len + 2, ".%s", HINT_EXT.data);
+}
+
+// Uses the hint at hint_path in place of the file it describes, if it is intact and was written for
+// a file of data_len bytes.
+private bool loadHint(ScanJob *job, char *hint_path, isize data_len) {
+  int fd = open(hint_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  i8 res = fstat(fd, &st);
+  if (res == -1 || st.st_size < (isize)(sizeof(HintFileHeader) + sizeof(u64))) {
+    close(fd);
+    return false;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  HintFileHeader header;
+  memcpy(&header, map, sizeof(HintFileHeader));
+
+  isize entries_len = st.st_size - sizeof(HintFileHeader) - sizeof(u64);
+  bool is_valid = header.magic == HINT_MAGIC && header.data_len == data_len &&
+                  header.count >= 0 && header.keys_len >= 0 &&
+                  header.count <= entries_len / (isize)sizeof(HintEntry) &&
+                  header.count * (isize)sizeof(HintEntry) + header.keys_len == entries_len &&
+                  crc_64(0, map, st.st_size) == 0;
+
+  isize entries_cap = (header.count + 1) * sizeof(ScanEntry);
+  ScanEntry *entries = MAP_FAILED;
+  if (is_valid) {
+    entries = mmap(NULL, entries_cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+
+  if (entries == MAP_FAILED) {
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  char *hint_entries = map + sizeof(HintFileHeader);
+  char *keys = hint_entries + header.count * sizeof(HintEntry);
+
+  isize len = 0;
+  for (; len < header.count; len++) {
+    HintEntry hint_entry;
+    memcpy(&hint_entry, hint_entries + len * sizeof(HintEntry), sizeof(HintEntry));
+
+    if (hint_entry.key_off < 0 || hint_entry.key_len < 0 ||
+        hint_entry.key_off > header.keys_len - hint_entry.key_len) {
+      break;
+    }
+
+    entries[len] = (ScanEntry){
+        .key = {.data = keys + hint_entry.key_off, .len = hint_entry.key_len},
+        .hash = hint_entry.hash,
+        .kd_entry =
+            {
+                .timestamp = hint_entry.timestamp,
+                .val_pos = hint_entry.val_pos,
+                .val_len = hint_entry.val_len,
+                .file_id = job->file_id,
+            },
+    };
+  }
+
+  if (len < header.count) {
+    munmap(entries, entries_cap);
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  job->map = map;
+  job->map_len = st.st_size;
+  job->entries = entries;
+  job->entries_cap = entries_cap;
+  job->len = len;
+  job->is_hint_used = true;
+
+  return true;
+}
+
+// Moves a private anonymous mapping to a larger one, keeping its first len bytes.
+void *growMapping(void *map, isize len, isize cap, isize new_cap) {
+  void *new_map =
+      mmap(NULL, new_cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return_value_if(new_map == MAP_FAILED, NULL, ERR_OUT_OF_MEMORY);
+
+  if (map != NULL) {
+    memcpy(new_map, map, len);
+    munmap(map, cap);
+  }
+
+  return new_map;
+}
+
+// Records the entry for the hint of the file being written. A failure only marks the hint as
+// incomplete so that it is not written, the file is then scanned on the next bc_open.
+bool hintAdd(HintBuilder *hint, s8 key, u64 key_hash, KeyDirEntry kd_entry) {
+  if (hint->is_incomplete) return false;
+
+  isize entries_size = hint->len * sizeof(HintEntry);
+  if (entries_size + (isize)sizeof(HintEntry) > hint->cap) {
+    isize cap = hint->cap == 0 ? HINT_INIT_CAP : 2 * hint->cap;
+    hint->entries = growMapping(hint->entries, entries_size, hint->cap, cap);
+    hint->cap = hint->entries == NULL ? 0 : cap;
+  }
+
+  if (hint->entries != NULL && hint->keys_len + key.len > hint->keys_cap) {
+    isize cap = hint->keys_cap == 0 ? HINT_INIT_CAP : hint->keys_cap;
+    while (cap < hint->keys_len + key.len) cap *= 2;
+    hint->keys = growMapping(hint->keys, hint->keys_len, hint->keys_cap, cap);
+    hint->keys_cap = hint->keys == NULL ? 0 : cap;
+  }
+
+  if (hint->entries == NULL || hint->keys == NULL) {
+    hint->is_incomplete = true;
+    return false;
+  }
+
+  hint->entries[hint->len++] = (HintEntry){
+      .hash = key_hash,
+      .timestamp = kd_entry.timestamp,
+      .val_pos = kd_entry.val_pos,
+      .val_len = kd_entry.val_len,
+      .key_off = hint->keys_len,
+      .key_len = key.len,
+  };
+  memcpy(hint->keys + hint->keys_len, key.data, key.len);
+  hint->keys_len += key.len;
+
+  return true;
+}
+
+// Writes the collected entries as the hint of a sealed file of data_len bytes and empties the
+// builder. The file is written under a temporary name and renamed, so a hint is never partial.
+bool hintWrite(HintBuilder *hint, char *hint_path, isize data_len) {
+  bool is_incomplete = hint->is_incomplete;
+  isize len = hint->len;
+  isize keys_len = hint->keys_len;
+
+  hint->len = 0;
+  hint->keys_len = 0;
+  hint->is_incomplete = false;
+
+  return_value_if(is_incomplete, false, ERR_OUT_OF_MEMORY);
+
+  char tmp_path[PATH_MAX];
+  i32 tmp_path_len = snprintf(tmp_path, PATH_MAX, "%s.tmp", hint_path);
+  return_value_if(tmp_path_len >= PATH_MAX, false, ERR_ACCESS);
+
+  HintFileHeader header = {
+      .magic = HINT_MAGIC,
+      .count = len,
+      .keys_len = keys_len,
+      .data_len = data_len,
+  };
+
+  u64 crc = crc_64(0, &header, sizeof(HintFileHeader));
+  crc = crc_64(crc, hint->entries, len * sizeof(HintEntry));
+  crc = crc_64(crc, hint->keys, keys_len);
+
+  struct iovec iov[] = {
+      {.iov_base = &header, .iov_len = sizeof(HintFileHeader)},
+      {.iov_base = hint->entries, .iov_len = len * sizeof(HintEntry)},
+      {.iov_base = hint->keys, .iov_len = keys_len},
+      {.iov_base = &crc, .iov_len = sizeof(u64)},
+  };
+  isize total = sizeof(HintFileHeader) + len * sizeof(HintEntry) + keys_len + sizeof(u64);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  return_value_if(fd == -1, false, ERR_ACCESS);
+
+  isize bytes_written = writev(fd, iov, countof(iov));
+  close(fd);
+
+  bool is_written = bytes_written == total && rename(tmp_path, hint_path) == 0;
+  if (!is_written) unlink(tmp_path);
+  return_value_if(!is_written, false, ERR_ACCESS);
+
+  return true;
+}
+
+void hintFree(HintBuilder *hint) {
+  if (hint->entries != NULL) munmap(hint->entries, hint->cap);
+  if (hint->keys != NULL) munmap(hint->keys, hint->keys_cap);
+  *hint = (HintBuilder){0};
+}
+
+// Maps the whole file read only, replacing any previous mapping. Empty files are left unmapped.
+private bool mapFile(BcHandle *bc, u32 file_id) {
+  BcFile *file = bc->file_table.files + file_id;
+
+  if (file->map != NULL) munmap(file->map, file->map_len);
+  file->map = NULL;
+  file->map_len = 0;
+
+  int fd = open(file->path, O_RDONLY | O_CLOEXEC);
+  return_value_if(fd == -1, false, ERR_ACCESS);
+
+  struct stat st;
+  i8 res = fstat(fd, &st);
+  if (res == -1 || st.st_size == 0) {
+    close(fd);
+    return res != -1;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return_value_if(map == MAP_FAILED, false, ERR_ACCESS);
+
+  file->map = map;
+  file->map_len = st.st_size;
+
+  return true;
+}
+
+void unmapFiles(BcHandle *bc) {
+  for (u32 i = 0; i < bc->file_table.len; i++) {
+    BcFile *file = bc->file_table.files + i;
+    if (file->map == NULL) continue;
+
+    munmap(file->map, file->map_len);
+    file->map = NULL;
+    file->map_len = 0;
+  }
+}
+
+// pread that retries short reads, returns the number of bytes read or -1 on error.
+isize readAt(int fd, char *buffer, isize len, isize offset) {
+  isize total = 0;
+
+  while (total < len) {
+    isize bytes_read = pread(fd, buffer + total, len - total, offset + total);
+    if (bytes_read == -1 && errno == EINTR) continue;
+    return_value_if(bytes_read == -1, -1, ERR_ACCESS);
+    if (bytes_read == 0) break;
+
+    total += bytes_read;
+  }
+
+  return total;
+}
+
+// pwritev that retries short writes, advancing iov past what was written.
+private bool writevAt(int fd, struct iovec *iov, int count, isize offset) {
+  while (count > 0) {
+    isize written = pwritev(fd, iov, count, offset);
+    if (written == -1 && errno == EINTR) continue;
+    return_value_if(written == -1, false, ERR_ACCESS);
+
+    offset += written;
+    while (count > 0 && written >= (isize)iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return true;
+}
+
+// pwrite that retries short writes.
+private bool writeAt(int fd, char *buffer, isize len, isize offset) {
+  isize total = 0;
+
+  while (total < len) {
+    isize bytes_written = pwrite(fd, buffer + total, len - total, offset + total);
+    if (bytes_written == -1 && errno == EINTR) continue;
+    return_value_if(bytes_written == -1, false, ERR_ACCESS);
+
+    total += bytes_written;
+  }
+
+  return true;
+}
+
+// write that retries short writes.
+bool writeAll(int fd, char *buffer, isize len) {
+  isize total = 0;
+
+  while (total < len) {
+    isize bytes_written = write(fd, buffer + total, len - total);
+    if (bytes_written == -1 && errno == EINTR) continue;
+    return_value_if(bytes_written == -1, false, ERR_ACCESS);
+
+    total += bytes_written;
+  }
+
+  return true;
+}
+
+bool getSnapshotPath(BcHandle *bc, char *snapshot_path) {
+  i32 len = snprintf(snapshot_path, PATH_MAX, "%s/%s", bc->parent_dir_path, SNAPSHOT_FILE.data);
+  return_value_if(len >= PATH_MAX, false, ERR_ACCESS);
+  return true;
+}
+
+// Identifies a file by its kind and number, which unlike its file id stay the same across opens.
+// size is -1 if the file cannot be accessed.
+private SnapshotFile getSnapshotFile(BcHandle *bc, u32 file_id) {
+  char *file_path = bc->file_table.files[file_id].path;
+  isize merged_dir_path_len = strnlen(bc->merged_dir_path, PATH_MAX);
+
+  SnapshotFile file = {
+      .num = strtoll(strrchr(file_path, '/') + 1, NULL, 16),
+      .size = -1,
+      .dead_keys = bc->file_table.files[file_id].stats.dead_keys,
+      .is_merged = strncmp(file_path, bc->merged_dir_path, merged_dir_path_len) == 0,
+  };
+
+  struct stat st;
+  if (stat(file_path, &st) == 0) file.size = st.st_size;
+
+  return file;
+}
+
+// Loads the keydir from the snapshot written by bc_checkpoint and sets watermark to the position
+// replay has to start from. A missing snapshot, or one that does not match the files on disk, is
+// ignored.
+private bool loadSnapshot(BcHandle *bc, Watermark *watermark) {
+  char snapshot_path[PATH_MAX];
+  if (!getSnapshotPath(bc, snapshot_path)) return false;
+
+  int fd = open(snapshot_path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return false;
+
+  struct stat st;
+  i8 res = fstat(fd, &st);
+  if (res == -1 || st.st_size < (isize)(sizeof(SnapshotHeader) + sizeof(u64))) {
+    close(fd);
+    return false;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  bool is_ok = applySnapshot(bc, map, st.st_size, watermark);
+  munmap(map, st.st_size);
+
+  return is_ok;
+}
+
+private bool applySnapshot(BcHandle *bc, char *map, isize map_len, Watermark *watermark) {
+  SnapshotHeader header;
+  memcpy(&header, map, sizeof(SnapshotHeader));
+
+  isize body_len = map_len - sizeof(SnapshotHeader) - sizeof(u64);
+  bool is_valid =
+      header.magic == SNAPSHOT_MAGIC && header.capacity >= 0 && header.capacity <= body_len &&
+      header.count >= 0 && header.count <= body_len / (isize)sizeof(SnapshotEntry) &&
+      header.files_len >= 0 && header.files_len <= body_len / (isize)sizeof(SnapshotFile) &&
+      header.keys_len >= 0 && header.keys_len <= body_len &&
+      header.files_len * (isize)sizeof(SnapshotFile) + header.capacity +
+              header.count * (isize)sizeof(SnapshotEntry) + header.keys_len ==
+          body_len &&
+      header.watermark.num >= 1 && header.watermark.num <= bc->num_files &&
+      header.watermark.pos >= 0 && crc_64(0, map, map_len) == 0;
+  if (!is_valid) return false;
+
+  char *files = map + sizeof(SnapshotHeader);
+  u8 *ctrl = (u8 *)files + header.files_len * sizeof(SnapshotFile);
+  char *entries = (char *)ctrl + header.capacity;
+  char *keys = entries + header.count * sizeof(SnapshotEntry);
+
+  // Every file is checked before any of them is added to the file table. Sealed files must not
+  // have changed, and the file holding the watermark may only have grown since.
+  Arena scratch = bc->scratch;
+  u32 *file_ids = new (&scratch, u32, header.files_len, NOZERO);
+  if (file_ids == NULL) return false;
+
+  for (isize pass = 0; pass < 2; pass++) {
+    for (isize i = 0; i < header.files_len; i++) {
+      SnapshotFile file;
+      memcpy(&file, files + i * sizeof(SnapshotFile), sizeof(SnapshotFile));
+
+      char file_path[PATH_MAX];
+      bool out = file.is_merged
+                     ? getFilePath(file_path, bc->merged_dir_path, MERGED_EXT, file.num)
+                     : getFilePath(file_path, bc->data_dir_path, BIN_EXT, file.num);
+      if (!out || file.num < 1 || file.num > UINT32_MAX) return false;
+
+      if (pass == 1) {
+        i64 file_id = addFile(bc, file_path);
+        if (file_id == -1) return false;
+        file_ids[i] = file_id;
+        bc->file_table.files[file_id].stats.dead_keys = file.dead_keys;
+        continue;
+      }
+
+      struct stat st;
+      if (stat(file_path, &st) == -1) return false;
+
+      bool is_watermark_file = !file.is_merged && file.num == header.watermark.num;
+      if (is_watermark_file ? st.st_size < header.watermark.pos : st.st_size != file.size) {
+        return false;
+      }
+    }
+  }
+
+  // The slots are reused as they are when the group width matches, otherwise every entry is
+  // inserted again using its stored hash.
+  bool is_same_layout = header.group_width == ht_group_width();
+  HashTableResult ht_res = is_same_layout
+                               ? ht_create_from_ctrl(&bc->arena, header.capacity, ctrl)
+                               : ht_create(&bc->arena, KEY_DIR_INIT_CAP);
+  if (!ht_res.is_ok || (is_same_layout && ht_res.ht.len != header.count)) return false;
+  HashTable *ht = &ht_res.ht;
+
+  char *arena_keys = keys;
+  if (is_same_layout) {
+    arena_keys = new (&bc->arena, char, header.keys_len, NOZERO);
+    if (arena_keys == NULL) return false;
+    memcpy(arena_keys, keys, header.keys_len);
+  }
+
+  isize slot = 0;
+  for (isize i = 0; i < header.count; i++) {
+    SnapshotEntry entry;
+    memcpy(&entry, entries + i * sizeof(SnapshotEntry), sizeof(SnapshotEntry));
+
+    if (entry.key_off < 0 || entry.key_len < 0 || entry.key_off > header.keys_len - entry.key_len ||
+        entry.file < 0 || entry.file >= header.files_len) {
+      return false;
+    }
+
+    s8 key = {.data = arena_keys + entry.key_off, .len = entry.key_len};
+    KeyDirEntry kd_entry = {
+        .timestamp = entry.timestamp,
+        .val_pos = entry.val_pos,
+        .val_len = entry.val_len,
+        .file_id = file_ids[entry.file],
+    };
+
+    if (is_same_layout) {
+      while (ctrl[slot] & HT_EMPTY) slot++;
+      ht->cur.kv_pairs[slot++] = (KvPair){.key = key, .val = kd_entry, .hash = entry.hash};
+    } else if (!ht_insert_hashed(ht, key, entry.hash, kd_entry, &bc->arena)) {
+      return false;
+    }
+  }
+
+  bc->key_dir = *ht;
+  *watermark = header.watermark;
+
+  return true;
+}
+
+private bool growKeyDir(BcHandle *bc, isize merged_first, isize merged_last, Watermark watermark) {
+  isize merged_files_num = merged_last - merged_first + 1;
+  isize jobs_len = merged_files_num + bc->num_files - watermark.num + 1;
+
+  // Records loaded from a snapshot are counted first, replay then counts the ones it applies.
+  countLive(bc);
+
+  Arena scratch = bc->scratch;
+  ScanJob *jobs = new (&scratch, ScanJob, jobs_len);
+  return_value_if(jobs == NULL, false, ERR_OUT_OF_MEMORY);
+
+  // Merged files only ever hold records older than every data file, so they are replayed first.
+  // Files are then replayed in the order they were written and records in the order they were
+  // appended, later records overwriting earlier ones, which does not depend on the timestamps.
+  // bc_merge may leave gaps in both series, the files missing there held nothing live.
+  isize len = 0;
+  for (isize i = 0; i < jobs_len; i++) {
+    bool is_merged = i < merged_files_num;
+    isize num = is_merged ? merged_first + i : i - merged_files_num + watermark.num;
+
+    char file_path[PATH_MAX] = {0};
+    bool out = is_merged ? getFilePath(file_path, bc->merged_dir_path, MERGED_EXT, num)
+                         : getFilePath(file_path, bc->data_dir_path, BIN_EXT, num);
+    return_value_if(!out, false, ERR_OBJECT_INITIALIZATION_FAILED);
+
+    bool is_sealed = is_merged || num < bc->num_files;
+    if (is_sealed && access(file_path, F_OK) == -1 && errno == ENOENT) continue;
+
+    i64 file_id = addFile(bc, file_path);
+    return_value_if(file_id == -1, false, ERR_OBJECT_INITIALIZATION_FAILED);
+
+    jobs[len].file_id = file_id;
+    jobs[len].merged_num = is_merged ? num : 0;
+    jobs[len].replay_pos = !is_merged && num == watermark.num ? watermark.pos : 0;
+    len++;
+  }
+  jobs_len = len;
+
+  ScanQueue queue = {
+      .jobs = jobs,
+      .len = jobs_len,
+      .files = bc->file_table.files,
+      .hint_dir_path = bc->hint_dir_path,
+  };
+  pthread_mutex_init(&queue.lock, NULL);
+  pthread_cond_init(&queue.done, NULL);
+
+  isize threads_num = bc->options.recovery_threads;
+  if (threads_num > jobs_len) threads_num = jobs_len;
+
+  pthread_t *threads = new (&scratch, pthread_t, threads_num);
+  return_value_if(threads == NULL, false, ERR_OUT_OF_MEMORY);
+
+  for (isize i = 0; i < threads_num; i++) {
+    if (pthread_create(threads + i, NULL, scanWorker, &queue) != 0) {
+      threads_num = i;
+      break;
+    }
+  }
+
+  // Without any worker the files are simply scanned here, before they are applied.
+  if (threads_num == 0) scanWorker(&queue);
+
+  // Jobs are applied strictly in order, overlapping with the workers scanning later files.
+  bool is_ok = true;
+  for (isize i = 0; i < jobs_len; i++) {
+    ScanJob *job = jobs + i;
+
+    pthread_mutex_lock(&queue.lock);
+    while (!job->is_done) pthread_cond_wait(&queue.done, &queue.lock);
+    pthread_mutex_unlock(&queue.lock);
+
+    is_ok = is_ok && job->is_ok && applyScanJob(bc, job);
+    releaseScanJob(job);
+  }
+
+  for (isize i = 0; i < threads_num; i++) pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&queue.lock);
+  pthread_cond_destroy(&queue.done);
+
+  return_value_if(!is_ok, false, ERR_OBJECT_INITIALIZATION_FAILED);
+  countDead(bc);
+  return true;
+}
+
+private void *scanWorker(void *arg) {
+  ScanQueue *queue = arg;
+
+  while (true) {
+    isize i = atomic_fetch_add(&queue->next, 1);
+    if (i >= queue->len) break;
+
+    ScanJob *job = queue->jobs + i;
+    bool is_ok = scanFile(queue, job);
+
+    pthread_mutex_lock(&queue->lock);
+    job->is_ok = is_ok;
+    job->is_done = true;
+    pthread_cond_broadcast(&queue->done);
+    pthread_mutex_unlock(&queue->lock);
+  }
+
+  return NULL;
+}
+
+// Loads the hint of a data or merged file, or else maps the file and decodes all of its complete
+// records into job->entries, hashing their keys on the way. The keys point into the mapping, which
+// is kept until the job is applied.
+private bool scanFile(ScanQueue *queue, ScanJob *job) {
+  char *file_path = queue->files[job->file_id].path;
+
+  int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+  return_value_if(fd == -1, false, ERR_ACCESS);
+
+  struct stat st;
+  i8 res = fstat(fd, &st);
+  if (res == -1 || st.st_size == 0) {
+    close(fd);
+    return res != -1;
+  }
+
+  // A hint that is missing, damaged or written for a different file length is ignored and the
+  // file itself is scanned instead.
+  char hint_path[PATH_MAX] = {0};
+  if (job->merged_num > 0) {
+    getFilePath(hint_path, queue->hint_dir_path, HINT_EXT, job->merged_num);
+  } else {
+    getHintPath(hint_path, file_path);
+  }
+
+  // A hint only ever covers complete records, so the whole file is valid when it is used.
+  job->valid_len = st.st_size;
+  if (loadHint(job, hint_path, st.st_size)) {
+    close(fd);
+    return true;
+  }
+
+  job->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  return_value_if(job->map == MAP_FAILED, false, ERR_ACCESS);
+  job->map_len = st.st_size;
+  madvise(job->map, job->map_len, MADV_SEQUENTIAL);
+
+  isize meta_len = HEADER_SIZE + sizeof(u64);
+  job->entries_cap = (job->map_len / meta_len + 1) * sizeof(ScanEntry);
+  job->entries = mmap(NULL, job->entries_cap, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return_value_if(job->entries == MAP_FAILED, false, ERR_OUT_OF_MEMORY);
+
+  isize pos = 0;
+  while (job->map_len - pos >= meta_len) {
+    char *record = job->map + pos;
+    Header header = decodeHeader(record);
+
+    // The records of a complete batch follow its header, a partially written one ends the file.
+    if (header.key_len == BATCH_MARKER) {
+      if (!isBatchComplete(record, job->map_len - pos)) break;
+      pos += sizeof(BatchHeader);
+      continue;
+    }
+
+    // A record cut short by a crash ends the file.
+    isize remaining = job->map_len - pos - meta_len;
+    if (header.key_len < 0 || header.val_len < 0 || header.key_len > remaining ||
+        header.val_len > remaining - header.key_len) {
+      break;
+    }
+
+    ScanEntry *entry = job->entries + job->len;
+    entry->kd_entry = (KeyDirEntry){
+        .timestamp = header.timestamp,
+        .val_pos = pos,
+        .val_len = header.val_len,
+        .file_id = job->file_id,
+    };
+    entry->key = (s8){.data = record + KEY_OFFSET, .len = header.key_len};
+    entry->hash = ht_hash(entry->key);
+
+    pos += meta_len + header.key_len + header.val_len;
+    job->len++;
+  }
+
+  job->valid_len = pos;
+  return true;
+}
+
+private bool applyScanJob(BcHandle *bc, ScanJob *job) {
+  for (isize i = 0; i < job->len; i++) {
+    ScanEntry *entry = job->entries + i;
+    if (entry->kd_entry.val_pos < job->replay_pos) continue;
+
+    HtUpsertResult res =
+        ht_upsert_hashed(&bc->key_dir, entry->key, entry->hash, entry->kd_entry, &bc->arena);
+    return_value_if(!res.is_ok, false, ERR_KEY_INSERT_FAILED);
+    countUpsert(bc, entry->key, entry->kd_entry, res);
+  }
+
+  // The active file is sealed by a later rotation, so its hint is rebuilt from what was scanned.
+  // Whatever follows its last complete record or batch was cut short by a crash and is cut off, so
+  // that new records are not appended after it.
+  if (job->file_id == bc->active_file_id) {
+    for (isize i = 0; i < job->len; i++) {
+      ScanEntry *entry = job->entries + i;
+      hintAdd(&bc->hint, entry->key, entry->hash, entry->kd_entry);
+    }
+
+    bool is_scanned = !job->is_hint_used && job->map != NULL;
+    if (bc->options.read_write && is_scanned && job->valid_len < bc->cursor) {
+      i8 res = ftruncate(bc->write_buffer->fd, job->valid_len);
+      return_value_if(res == -1, false, ERR_ACCESS);
+      bc->cursor = job->valid_len;
+    }
+    return true;
+  }
+
+  if (!bc->options.mmap_segments) return true;
+
+  // The mapping of a scanned file is handed over to the file table instead of being mapped again.
+  BcFile *file = bc->file_table.files + job->file_id;
+  if (!job->is_hint_used && job->map != NULL) {
+    file->map = job->map;
+    file->map_len = job->map_len;
+    job->map = NULL;
+    return true;
+  }
+
+  return mapFile(bc, job->file_id);
+}
+
+private void releaseScanJob(ScanJob *job) {
+  if (job->map != NULL && job->map != MAP_FAILED) munmap(job->map, job->map_len);
+  if (job->entries != NULL && job->entries != MAP_FAILED) munmap(job->entries, job->entries_cap);
+  job->map = NULL;
+  job->entries = NULL;
+}
+
+// The record just written for key is live, the one it overwrote is dead from now on.
+private void countUpsert(BcHandle *bc, s8 key, KeyDirEntry kd_entry, HtUpsertResult res) {
+  BcFile *files = bc->file_table.files;
+
+  FileStats *stats = &files[kd_entry.file_id].stats;
+  stats->live_bytes += HEADER_SIZE + sizeof(u64) + key.len + kd_entry.val_len;
+  stats->live_keys++;
+
+  if (!res.is_replaced) return;
+
+  isize prev_len = HEADER_SIZE + sizeof(u64) + key.len + res.prev.val_len;
+  FileStats *prev_stats = &files[res.prev.file_id].stats;
+  prev_stats->live_bytes -= prev_len;
+  prev_stats->live_keys--;
+  prev_stats->dead_bytes += prev_len;
+  prev_stats->dead_keys++;
+}
+
+// A live record was copied to another file, the bytes it leaves behind go with its source.
+void countMove(BcHandle *bc, u32 from_id, u32 to_id, isize record_len) {
+  BcFile *files = bc->file_table.files;
+
+  files[from_id].stats.live_bytes -= record_len;
+  files[from_id].stats.live_keys--;
+  files[to_id].stats.live_bytes += record_len;
+  files[to_id].stats.live_keys++;
+}
+
+private void countLive(BcHandle *bc) {
+  HashTable *ht = &bc->key_dir;
+  ht_rehash_all(ht);
+
+  for (isize i = 0; i < ht->cur.capacity; i++) {
+    if (ht->cur.ctrl[i] & HT_EMPTY) continue;
+
+    KvPair *kv_pair = ht->cur.kv_pairs + i;
+    FileStats *stats = &bc->file_table.files[kv_pair->val.file_id].stats;
+    stats->live_bytes += HEADER_SIZE + sizeof(u64) + kv_pair->key.len + kv_pair->val.val_len;
+    stats->live_keys++;
+  }
+}
+
+// Whatever part of a file is not live is dead, which also covers the records a snapshot skipped.
+private void countDead(BcHandle *bc) {
+  FileTable *ft = &bc->file_table;
+
+  for (u32 i = 0; i < ft->len; i++) {
+    BcFile *file = ft->files + i;
+
+    struct stat st;
+    if (stat(file->path, &st) == 0) file->stats.dead_bytes = st.st_size - file->stats.live_bytes;
+  }
+}
+
+// Whether a read of the file checks the CRC of the record, see Options.verify_reads. Concurrent
+// readers race for the first read of a file and the sample counter, which at worst checks a read
+// more than needed.
+private bool shouldVerify(BcHandle *bc, u32 file_id) {
+  switch (bc->options.verify_reads) {
+    case BC_VERIFY_ALWAYS:
+      return true;
+    case BC_VERIFY_FIRST_READ: {
+      bool *is_verified = &sharedFile(bc, file_id)->is_verified;
+      return !atomic_exchange_explicit((_Atomic bool *)is_verified, true, memory_order_relaxed);
+    }
+    case BC_VERIFY_SAMPLED: {
+      u64 reads = atomic_fetch_add_explicit((_Atomic u64 *)&bc->reads, 1, memory_order_relaxed);
+      return reads % bc->options.verify_sample_rate == 0;
+    }
+    case BC_VERIFY_NEVER:
+      return false;
+  }
 
   return true;
 }
@@ -17,17 +17,350 @@ You should have received a copy of the GNU General Public License along with bit
 #pragma once
 
 #include <linux/limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 
 #include "ht.h"
+#include "uring.h"
 #include "utils.h"
 
+#define NO_FILE UINT32_MAX
+
+#define COMMIT_HIST_LEN 32
+
+// Reads of bc_get, bc_multi_get and bc_submit that check the CRC of the record they read: every
+// one, the first one of every file since bc_open, one in Options.verify_sample_rate, or none.
+// Unless every read is checked, the scrubber checks the sealed files in the background, see
+// Scrubber.
+typedef enum {
+  BC_VERIFY_ALWAYS,
+  BC_VERIFY_FIRST_READ,
+  BC_VERIFY_SAMPLED,
+  BC_VERIFY_NEVER,
+} BcVerify;
+
 typedef struct {
   bool read_write;
-  bool sync_on_put;
+  bool sync_on_put;         // every put is fdatasync'd before it returns
   isize max_file_size;
+  isize fd_cache_size;      // open descriptors kept for immutable files, defaults to 64 when <= 0
+  bool mmap_segments;       // serve reads of immutable files from read only mappings, see bc_get
+  isize scratch_size;       // per operation scratch space for put, delete and merge, 16 MiB default
+  isize recovery_threads;   // threads scanning files in bc_open, defaults to the online CPUs
+  bool group_commit;        // like sync_on_put, but puts share one fdatasync per group, see bc_put
+  isize commit_delay_us;    // longest a group waits for more puts, defaults to 1000 when <= 0
+  isize commit_batch_size;  // puts that close a group before its delay, defaults to 64 when <= 0
+  isize write_buffer_size;  // bytes buffered before they are written out, 1 MiB when <= 0
+  bool io_uring;            // serve bc_submit through io_uring, when built with BC_IO_URING
+  isize io_depth;           // requests bc_submit keeps in flight, defaults to 64 when <= 0
+  bool concurrent_reads;    // bc_get may run on many threads next to one writer, see bc_get
+  bool background_merge;    // merge sealed data files on a background thread, see bc_merge
+  isize merge_keep_files;   // newest sealed data files it leaves alone, defaults to 2 when <= 0
+  isize merge_step_size;    // bytes of a data file it merges per step, 4 MiB when <= 0
+  isize merge_rate_limit;   // bytes per second it reads and writes, unlimited when <= 0
+  double merge_dead_ratio;  // share of dead bytes that makes bc_merge rewrite a file, see bc_merge
+  isize merge_min_reclaim;  // dead bytes below which bc_merge rewrites nothing
+  isize merge_max_files;    // files bc_merge rewrites at most at once, unlimited when <= 0
+  isize merge_threads;      // workers bc_merge splits the files among, none when <= 1
+  bool crc32c_records;      // new records carry a CRC32C instead of a CRC-64, batches excepted
+  BcVerify verify_reads;    // reads that check the record's CRC, all of them by default
+  isize verify_sample_rate; // one in this many reads is checked when sampled, 64 when <= 0
+  isize scrub_rate_limit;   // bytes per second the scrubber reads, 16 MiB when <= 0
+  bool scrub_quarantine;    // the scrubber has keys whose record is corrupt deleted, see Scrubber
 } Options;
 
+typedef enum { BC_IO_GET, BC_IO_PUT, BC_IO_DELETE, BC_IO_SYNC } BcIoOp;
+
+// A request for bc_submit. key and val are the arguments of the matching blocking call; once the
+// request is returned by bc_complete, is_ok holds its outcome and, for a get, val the value read.
+// The request itself must stay in place until then. The rest is private to the handle.
+typedef struct BcIo {
+  BcIoOp op;
+  s8 key;
+  s8 val;
+  void *user_data;
+  bool is_ok;
+
+  char *buffer;
+  isize buffer_len;
+  bool is_verified;
+  struct BcIo *next;
+} BcIo;
+
+// Requests submitted through the ring and not completed yet are counted in in_flight, writes counts
+// the writes of the write buffer among them. Completed requests wait in the done list for
+// bc_complete.
+typedef struct {
+  Uring ring;
+  bool has_ring;
+  bool is_failed;
+  isize depth;
+  isize in_flight;
+  isize writes;
+  BcIo *done_head;
+  BcIo *done_tail;
+  isize done_len;
+} IoQueue;
+
+// Records appended to the active file that are not written to it yet. data holds the file's bytes
+// from offset on and is written out with pwrite at offset once full or when a sync needs it, so
+// offset + len is always the handle's cursor. The commit thread holds a pointer to it, so it lives
+// in the handle arena. data up to submitted has been handed to the ring by a BC_IO_SYNC and is only
+// dropped once the ring has written it. seq lets concurrent readers notice that the buffer was
+// flushed or the active file replaced while they read.
+typedef struct {
+  char *data;
+  isize len;
+  isize cap;
+  isize offset;
+  isize submitted;
+  int fd;
+  IoQueue *io;
+  u64 seq;
+} WriteBuffer;
+
+// latency is measured from the start of bc_put to its group being durable. latency_hist[i] counts
+// the puts that took less than 2^i microseconds but not less than 2^(i-1), the last bucket also
+// holds everything slower.
+typedef struct {
+  isize syncs;
+  isize puts;
+  i64 latency_total_ns;
+  i64 latency_max_ns;
+  isize latency_hist[COMMIT_HIST_LEN];
+} CommitStats;
+
+// State of Options.group_commit. Appends are serialized by write_lock, everything else is guarded
+// by lock. Puts [1, written_seq] have been appended and [1, durable_seq] are known to be durable.
+// The commit thread holds a pointer to it, so it lives in the handle arena.
+typedef struct {
+  pthread_mutex_t write_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t pending;
+  pthread_cond_t durable;
+  pthread_t thread;
+
+  WriteBuffer *write_buffer;
+  i64 written_seq;
+  i64 durable_seq;
+  i64 group_start_ns;
+  i64 delay_ns;
+  isize batch_size;
+  bool is_syncing;
+  bool is_stopping;
+  bool is_failed;
+
+  CommitStats stats;
+} GroupCommit;
+
+// Live records are the ones the keydir points to, every other byte of a file is dead: records
+// overwritten or deleted since, batch headers and whatever a crash cut short.
+typedef struct {
+  isize live_bytes;
+  isize dead_bytes;
+  isize live_keys;
+  isize dead_keys;
+} FileStats;
+
+// fd is -1 unless the file is in the descriptor cache, which is kept in least recently used order
+// through lru_prev and lru_next. map is the file's read only mapping when Options.mmap_segments is
+// set and NULL otherwise. A removed file keeps its slot, so that file ids stay valid.
+typedef struct {
+  char path[PATH_MAX];
+  int fd;
+  u32 lru_prev;
+  u32 lru_next;
+
+  char *map;
+  isize map_len;
+
+  FileStats stats;
+  bool is_removed;
+  bool is_verified;
+} BcFile;
+
+typedef struct {
+  BcFile *files;
+  u32 len;
+  u32 capacity;
+
+  u32 lru_head;
+  u32 lru_tail;
+  isize open_fds;
+} FileTable;
+
+// Fixed-width hint file entry, the key itself is stored at key_off in the key area that follows
+// the entries. hash is the key's ht_hash so the keydir can be rebuilt without hashing any key.
+typedef struct {
+  u64 hash;
+  i64 timestamp;
+  isize val_pos;
+  isize val_len;
+  isize key_off;
+  isize key_len;
+} HintEntry;
+
+// Hint entries of a file that is still being written, kept outside the arena since they are
+// dropped once the file is sealed and its hint file is written.
+typedef struct {
+  HintEntry *entries;
+  isize len;
+  isize cap;
+
+  char *keys;
+  isize keys_len;
+  isize keys_cap;
+
+  bool is_incomplete;
+} HintBuilder;
+
+// A sealed data file waiting for the background merge.
+typedef struct {
+  u32 file_id;
+  isize num;
+} MergeSource;
+
+// A live record copied by a step of the background merge from old_pos of its source to new_pos of
+// a merged file. key points into the step's read buffer.
+typedef struct {
+  s8 key;
+  u64 hash;
+  i64 timestamp;
+  isize val_len;
+  isize old_pos;
+  isize new_pos;
+} MergeMove;
+
+// Lets the writer close the files a background merge removed once no concurrent reader can be
+// using them any more. A reader counts itself in readers[epoch & 1] while it reads. The writer
+// adds the id of a removed file to pending, and flips epoch once nothing is waiting; the
+// descriptors and mappings of the files then waiting are closed as soon as the readers of the old
+// epoch are gone.
+typedef struct {
+  u64 epoch;
+  i64 readers[2];
+
+  u32 *pending;
+  isize pending_len;
+  isize pending_cap;
+  u32 *waiting;
+  isize waiting_len;
+  isize waiting_cap;
+} ReadEpoch;
+
+// The thread of the background merge copies the records the keydir points to out of the oldest
+// sealed data file into the merged files, at most step_size bytes of it per step, and then leaves
+// the moves of the step for the writer. The next put or batch repoints the keydir at the copies in
+// one go and, once the whole source is copied, unlinks it; only then is the next step taken. The
+// thread reads the keydir through ht_get_shared. lock guards the fields before the paths, the rest
+// belongs to the thread, but for epoch, which the writer and concurrent readers share.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+  HashTable *key_dir;
+
+  MergeSource *sources;
+  isize sources_len;
+  isize sources_cap;
+  isize sources_next;
+
+  MergeMove *moves;
+  isize moves_len;
+  isize moves_cap;
+  isize moves_num;
+  bool is_source_done;
+  bool is_ready;
+  bool is_stopping;
+  bool is_failed;
+
+  char data_dir_path[PATH_MAX];
+  char merged_dir_path[PATH_MAX];
+  char hint_dir_path[PATH_MAX];
+  isize keep_files;
+  isize step_size;
+  isize rate_limit;
+  isize max_file_size;
+
+  int source_fd;
+  isize source_pos;
+  isize source_len;
+  char *buffer;
+  isize buffer_cap;
+
+  int out_fd;
+  isize out_num;
+  isize out_cursor;
+  HintBuilder hint;
+
+  i64 throttle_start_ns;
+  isize throttle_bytes;
+
+  ReadEpoch epoch;
+} BackgroundMerge;
+
+// A sealed file for the scrubber, its path copied since the file table may move meanwhile.
+typedef struct {
+  u32 file_id;
+  char path[PATH_MAX];
+} ScrubFile;
+
+// A corrupt record the scrubber found at pos of a file. Its key, as far as the file can be
+// trusted, is the key_len bytes at key_off of the key area of the scrubber.
+typedef struct {
+  u32 file_id;
+  isize pos;
+  isize key_off;
+  isize key_len;
+} ScrubFinding;
+
+// Counted since bc_open: full passes over the sealed files, files and bytes read, records checked,
+// corrupt ones found and, of those, the ones whose key was deleted.
+typedef struct {
+  isize passes;
+  isize files;
+  isize bytes;
+  isize records;
+  isize corrupt;
+  isize quarantined;
+} ScrubStats;
+
+// State of the scrubber, which runs unless Options.verify_reads checks every read. Its thread reads
+// the sealed files the writer hands it over and over, at most rate_limit bytes per second and at
+// idle CPU and I/O priority. Where the file system allows it the files are read with O_DIRECT, so
+// that the disk is checked rather than the page cache, which is not disturbed either. Every
+// corrupt record is reported on stderr. With Options.scrub_quarantine it is also left in found,
+// and the next put, delete or batch first deletes its key with a tombstone, as bc_delete would, if
+// the keydir still points to it. Reads then stop returning the record and the next merge drops it.
+// lock guards everything before the buffer.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+
+  ScrubFile *files;
+  isize files_len;
+  isize files_cap;
+
+  ScrubFinding *found;
+  isize found_len;
+  isize found_cap;
+  char *keys;
+  isize keys_len;
+  isize keys_cap;
+
+  ScrubStats stats;
+  bool is_quarantine;
+  bool is_stopping;
+
+  isize rate_limit;
+  char *buffer;
+  isize buffer_cap;
+  i64 throttle_start_ns;
+  isize throttle_bytes;
+} Scrubber;
+
 typedef struct {
   isize cursor;
   isize num_files;
@@ -38,10 +371,23 @@ typedef struct {
   char merged_dir_path[PATH_MAX];
   char active_file_path[PATH_MAX];
 
-  FILE *active_fp;
+  u32 active_file_id;
+  WriteBuffer *write_buffer;
+  IoQueue *io;
+  FileTable file_table;
   HashTable key_dir;
+  HintBuilder hint;
+  GroupCommit *commit;
+  BackgroundMerge *merge;
+  Scrubber *scrub;
   Options options;
+  u64 reads;
+
+  // arena only holds what lives as long as the handle: the keydir, its keys and the file table.
+  // scratch is carved out of it once and reused by every operation that needs temporary memory.
   Arena arena;
+  Arena scratch;
+  char *arena_base;
 } BcHandle;
 
 typedef struct {
@@ -49,10 +395,128 @@ typedef struct {
   bool is_ok;
 } BcHandleResult;
 
+// path points into the handle's file table and lives as long as the handle.
+typedef struct {
+  char *path;
+  FileStats stats;
+} BcFileStats;
+
+// Puts and deletes collected for bc_write_batch, already encoded as the records it appends. buffer
+// is allocated from arena, which must outlive the batch.
+typedef struct {
+  Arena *arena;
+  char *buffer;
+  isize len;
+  isize cap;
+  isize count;
+  bool is_failed;
+} BcBatch;
+
+// A put whose value is handed over in chunks, see bc_put_begin. The record is appended as the
+// chunks come in, its CRC kept up to date along the way, so only the write buffer ever holds any
+// of it. key must stay valid until bc_put_end.
+typedef struct {
+  BcHandle *bc;
+  s8 key;
+  KeyDirEntry kd_entry;
+  isize written;
+  u64 crc;
+  i64 start_ns;
+  bool is_crc32c;
+  bool is_failed;
+} BcPutStream;
+
+// A get that reads the value into the caller's buffers a piece at a time, see bc_get_begin. The
+// file is read through a descriptor of its own, so a merge removing it meanwhile does not matter.
+// With is_verified set, the CRC of the record is computed as it is read and checked once the
+// value is read to the end; crc32c is only computed for a record whose trailer carries the tag.
+typedef struct {
+  BcHandle *bc;
+  int fd;
+  u32 file_id;
+  isize pos;
+  isize left;
+  u64 trailer;
+  u64 crc;
+  u32 crc32c;
+  bool is_verified;
+} BcGetStream;
+
 BcHandleResult bc_open(Arena arena, s8 dir_path, Options options);
 void bc_close(BcHandle *bc);
-s8 bc_get(BcHandle *bc, s8 key);
+// The record is read into scratch and the returned value points into it, so it lives as long as the
+// caller keeps that memory. With Options.mmap_segments set, a value stored outside the active file
+// is instead a view into the file's mapping, which stays valid until the next bc_merge or bc_close.
+// With Options.background_merge, any put, delete or batch may end it as well, since it may remove
+// the file the background merge is done with; concurrent readers are then given a copy instead.
+//
+// With Options.concurrent_reads set, any number of threads may call bc_get, each with its own
+// scratch, while one thread puts, deletes and writes batches. Readers take no lock: they retry
+// their keydir lookup, or their read of the active file, when the writer changed it meanwhile.
+// Files are kept open for them, up to half the RLIMIT_NOFILE soft limit; the others are opened by
+// each read. bc_merge, bc_checkpoint and bc_close still need the readers to be stopped.
+s8 bc_get(BcHandle *bc, s8 key, Arena *scratch);
+// Gets count keys at once, setting vals[i] to what bc_get would return for keys[i], and returns how
+// many were found. Records close to each other in a file are fetched with a single read. Like
+// bc_get, it may be called by concurrent readers, and allocates only from scratch.
+isize bc_multi_get(BcHandle *bc, s8 *keys, s8 *vals, isize count, Arena *scratch);
+// With Options.group_commit set, bc_put may be called from several threads at once. It returns once
+// the fdatasync of its group is done, or false if that sync failed, after which every put fails.
 bool bc_put(BcHandle *bc, s8 key, s8 val);
 bool bc_delete(BcHandle *bc, s8 key);
+BcBatch bc_batch_create(Arena *arena);
+bool bc_batch_put(BcBatch *batch, s8 key, s8 val);
+bool bc_batch_delete(BcBatch *batch, s8 key);
+// Appends every record of the batch with a single write and only then updates the keydir. After a
+// crash either the whole batch is recovered or none of it. The batch can be reused once emptied by
+// setting its len and count to 0.
+bool bc_write_batch(BcHandle *bc, BcBatch *batch);
+// Starts a put of a value of val_len bytes, which bc_put_write takes in chunks of any size. The
+// stream has the handle to itself until bc_put_end: no other put, delete, batch or merge may run
+// meanwhile, with Options.group_commit set the others wait for it. Readers only see the value
+// once bc_put_end has added it to the keydir.
+bool bc_put_begin(BcHandle *bc, BcPutStream *stream, s8 key, isize val_len);
+bool bc_put_write(BcPutStream *stream, s8 chunk);
+// Adds the record to the keydir if exactly val_len bytes were written and every write succeeded,
+// otherwise cuts it off the active file again and returns false. Must follow every bc_put_begin
+// that returned true.
+bool bc_put_end(BcPutStream *stream);
+// Starts reading the value of key, returning false if it is missing or deleted. Like bc_get it may
+// be called by any number of threads with Options.concurrent_reads set. bc_get_end must follow
+// every bc_get_begin that returned true.
+bool bc_get_begin(BcHandle *bc, BcGetStream *stream, s8 key);
+// Reads up to len bytes of the value into buffer and returns how many, 0 once it is read to the
+// end or -1 on failure, which includes a CRC mismatch found with the last bytes.
+isize bc_get_read(BcGetStream *stream, char *buffer, isize len);
+void bc_get_end(BcGetStream *stream);
+// Queues a request, which a later bc_complete returns once it is done. With Options.io_uring set,
+// gets that have to read a file and syncs go through io_uring, so that many of them are in flight
+// at once; puts and deletes only fill the write buffer and are done right away, as is every
+// request without a ring. A get reads into scratch, which must outlive the request. Returns false
+// if the request could not be queued, which is never the case for a handle without group commit.
+bool bc_submit(BcHandle *bc, BcIo *io, Arena *scratch);
+// Stores up to max completed requests into ios, in no particular order, and waits until at least
+// min of them are done or nothing is in flight any more. Returns how many were stored.
+isize bc_complete(BcHandle *bc, BcIo **ios, isize max, isize min);
+// Rewrites sealed data files and earlier merged files into new merged files in the caller's thread,
+// keeping only the records the keydir points to. Files without any live record are just removed.
+// Of the rest, only files whose dead bytes make up at least Options.merge_dead_ratio of them are
+// rewritten, at most Options.merge_max_files of them, and only when that reclaims at least
+// Options.merge_min_reclaim bytes. Older data files holding dead records are rewritten along with a
+// data file, since replay would let those records win over the copies. With Options.merge_threads
+// set, the files are split among that many threads, each writing merged files of its own, and the
+// keydir is repointed at all of their copies at once after they are done. A handle opened with
+// Options.background_merge merges on a thread of its own instead, see BackgroundMerge, and refuses
+// bc_merge.
 bool bc_merge(BcHandle *bc);
 bool bc_sync(BcHandle *bc);
+CommitStats bc_commit_stats(BcHandle *bc);
+// Writes the keydir to a snapshot that the next bc_open loads instead of replaying the files it
+// covers. bc_close takes one, calling it periodically also bounds the replay after a crash.
+bool bc_checkpoint(BcHandle *bc);
+isize bc_arena_high_water(BcHandle *bc);
+// Stores the counters of up to max files the handle uses, the active one included, into stats and
+// returns how many files there are.
+isize bc_file_stats(BcHandle *bc, BcFileStats *stats, isize max);
+// Returns the counters of the scrubber, all 0 for a handle without one.
+ScrubStats bc_scrub_stats(BcHandle *bc);
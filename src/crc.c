@@ -0,0 +1,172 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+
+#include "crc.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc64speed.h"
+
+typedef u64 (*Crc64Fn)(u64 crc, const void *data, isize len);
+typedef u32 (*Crc32cFn)(u32 crc, const void *data, isize len);
+
+private void crcSelect(void);
+private u64 crc64Table(u64 crc, const void *data, isize len);
+private u32 crc32cTable(u32 crc, const void *data, isize len);
+#if defined(__x86_64__)
+private u64 crc64Clmul(u64 crc, const void *data, isize len);
+private u32 crc32cSse42(u32 crc, const void *data, isize len);
+#endif
+
+#define CRC32C_POLY 0x82F63B78  // reflected
+
+// Below this many bytes folding does not pay for its setup.
+#define CRC_CLMUL_MIN_LEN 64
+
+// x^n mod P of the CRC-64 polynomial, bit reflected, for carry-less multiplication: a 128 bit
+// block is folded over n bits with the constants of x^(n + 63) and x^(n - 1).
+#define CRC_X575 0xAF86EFB16D9AB4FB
+#define CRC_X511 0xF49784A634F014E4
+#define CRC_X447 0xA062B2319D66692F
+#define CRC_X383 0x7B3211A760160DB8
+#define CRC_X319 0x6BA4D760AB38201E
+#define CRC_X255 0xEF3D1D18ED889ED2
+#define CRC_X191 0xD9D7BE7D505DA32C
+#define CRC_X127 0x381D0015C96F4444
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static Crc64Fn crc64_fn = crc64Table;
+static Crc32cFn crc32c_fn = crc32cTable;
+static const char *crc_name = "crc64 table, crc32c table";
+static u32 crc32c_table[256];
+
+void crc_init(void) { pthread_once(&crc_once, crcSelect); }
+
+u64 crc_64(u64 crc, const void *data, isize len) { return crc64_fn(crc, data, len); }
+
+u32 crc_32c(u32 crc, const void *data, isize len) { return crc32c_fn(crc, data, len); }
+
+const char *crc_implementation(void) { return crc_name; }
+
+private void crcSelect(void) {
+  crc64speed_init();
+
+  for (u32 i = 0; i < 256; i++) {
+    u32 crc = i;
+    for (isize j = 0; j < 8; j++) crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+    crc32c_table[i] = crc;
+  }
+
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  bool has_clmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+  bool has_sse42 = __builtin_cpu_supports("sse4.2");
+
+  if (has_clmul) crc64_fn = crc64Clmul;
+  if (has_sse42) crc32c_fn = crc32cSse42;
+
+  if (has_clmul && has_sse42) crc_name = "crc64 pclmulqdq, crc32c sse4.2";
+  if (has_clmul && !has_sse42) crc_name = "crc64 pclmulqdq, crc32c table";
+  if (!has_clmul && has_sse42) crc_name = "crc64 table, crc32c sse4.2";
+#endif
+}
+
+private u64 crc64Table(u64 crc, const void *data, isize len) {
+  return crc64speed(crc, data, len);
+}
+
+private u32 crc32cTable(u32 crc, const void *data, isize len) {
+  const u8 *bytes = data;
+
+  crc = ~crc;
+  for (isize i = 0; i < len; i++) crc = crc32c_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+
+// Folds a block over the distance of k into the bytes that follow it.
+__attribute__((target("pclmul,sse4.1"))) private __m128i crcFold(__m128i block, __m128i k) {
+  return _mm_xor_si128(_mm_clmulepi64_si128(block, k, 0x00), _mm_clmulepi64_si128(block, k, 0x11));
+}
+
+// Keeps four 16 byte blocks in flight, folding each over the 64 bytes that follow, then folds them
+// into one and that one over the remaining blocks. Everything not a whole block, and the final
+// reduction to 64 bits, is left to the tables: a CRC register of 0 followed by the folded block
+// has the CRC of all the bytes it stands for.
+__attribute__((target("pclmul,sse4.1"))) private u64 crc64Clmul(u64 crc, const void *data,
+                                                                isize len) {
+  if (len < CRC_CLMUL_MIN_LEN) return crc64speed(crc, data, len);
+
+  const char *bytes = data;
+  __m128i k512 = _mm_set_epi64x(CRC_X511, CRC_X575);
+  __m128i k384 = _mm_set_epi64x(CRC_X383, CRC_X447);
+  __m128i k256 = _mm_set_epi64x(CRC_X255, CRC_X319);
+  __m128i k128 = _mm_set_epi64x(CRC_X127, CRC_X191);
+
+  // The CRC register so far is the same as the first 8 bytes xored with it and a register of 0.
+  __m128i x0 = _mm_xor_si128(_mm_loadu_si128((__m128i *)bytes), _mm_cvtsi64_si128(crc));
+  __m128i x1 = _mm_loadu_si128((__m128i *)(bytes + 16));
+  __m128i x2 = _mm_loadu_si128((__m128i *)(bytes + 32));
+  __m128i x3 = _mm_loadu_si128((__m128i *)(bytes + 48));
+  isize pos = 64;
+
+  for (; len - pos >= 64; pos += 64) {
+    x0 = _mm_xor_si128(crcFold(x0, k512), _mm_loadu_si128((__m128i *)(bytes + pos)));
+    x1 = _mm_xor_si128(crcFold(x1, k512), _mm_loadu_si128((__m128i *)(bytes + pos + 16)));
+    x2 = _mm_xor_si128(crcFold(x2, k512), _mm_loadu_si128((__m128i *)(bytes + pos + 32)));
+    x3 = _mm_xor_si128(crcFold(x3, k512), _mm_loadu_si128((__m128i *)(bytes + pos + 48)));
+  }
+
+  __m128i x = _mm_xor_si128(crcFold(x0, k384), crcFold(x1, k256));
+  x = _mm_xor_si128(x, _mm_xor_si128(crcFold(x2, k128), x3));
+
+  for (; len - pos >= 16; pos += 16) {
+    x = _mm_xor_si128(crcFold(x, k128), _mm_loadu_si128((__m128i *)(bytes + pos)));
+  }
+
+  char block[16];
+  _mm_storeu_si128((__m128i *)block, x);
+  crc = crc64speed(0, block, sizeof(block));
+
+  return crc64speed(crc, bytes + pos, len - pos);
+}
+
+__attribute__((target("sse4.2"))) private u32 crc32cSse42(u32 crc, const void *data, isize len) {
+  const char *bytes = data;
+  u64 crc64 = ~crc;
+  isize pos = 0;
+
+  for (; len - pos >= 8; pos += 8) {
+    u64 word;
+    memcpy(&word, bytes + pos, sizeof(u64));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+
+  crc = crc64;
+  for (; pos < len; pos++) crc = _mm_crc32_u8(crc, bytes[pos]);
+
+  return ~crc;
+}
+
+#endif
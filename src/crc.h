@@ -0,0 +1,32 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+
+#pragma once
+
+#include "utils.h"
+
+// Checksums of records, batches, hints and snapshots. crc_64 is the CRC-64 of crc64speed.c (Jones
+// polynomial, reflected), crc_32c the CRC32C of iSCSI and ext4; both take the crc of the bytes
+// before data and return the one including them. crc_init picks the fastest implementation the CPU
+// supports: carry-less multiplication and the SSE4.2 crc32 instruction on x86-64, the slicing
+// tables everywhere else. It must run before the others and may run any number of times.
+void crc_init(void);
+u64 crc_64(u64 crc, const void *data, isize len);
+u32 crc_32c(u32 crc, const void *data, isize len);
+
+// Names the implementations crc_init picked, for benchmarks.
+const char *crc_implementation(void);
@@ -16,11 +16,94 @@ You should have received a copy of the GNU General Public License along with bit
 
 #include "ht.h"
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 
-private u64 hash(isize ht_capacity, s8 key);
-private void copyKeyToHt(HashTable *ht, KvPair kv_pair, isize index, u8 inc_len);
+#include "wyhash.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define HT_MAX_LOAD_NUM 7
+#define HT_MAX_LOAD_DEN 8
+#define HT_REHASH_STEP 64
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((u8)((hash) & 0x7F))
+
+// A group is the run of ctrl bytes compared at once. Match masks have one bit per slot for the
+// SIMD variants, and one bit per byte (the high bit) for the portable word-at-a-time variant,
+// GROUP_SHIFT turns the index of a set bit back into a slot offset.
+#if defined(__AVX2__)
+#define GROUP_WIDTH 32
+#define GROUP_SHIFT 0
+typedef u32 GroupMask;
+
+private GroupMask groupMatch(u8 *group, u8 h2) {
+  __m256i ctrl = _mm256_load_si256((__m256i *)group);
+  return _mm256_movemask_epi8(_mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8(h2)));
+}
+
+private GroupMask groupMatchEmpty(u8 *group) {
+  return _mm256_movemask_epi8(_mm256_load_si256((__m256i *)group));
+}
+#elif defined(__SSE2__)
+#define GROUP_WIDTH 16
+#define GROUP_SHIFT 0
+typedef u32 GroupMask;
+
+private GroupMask groupMatch(u8 *group, u8 h2) {
+  __m128i ctrl = _mm_load_si128((__m128i *)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h2)));
+}
+
+private GroupMask groupMatchEmpty(u8 *group) {
+  return _mm_movemask_epi8(_mm_load_si128((__m128i *)group));
+}
+#else
+#define GROUP_WIDTH 8
+#define GROUP_SHIFT 3
+typedef u64 GroupMask;
+
+#define LSB_BYTES 0x0101010101010101
+#define MSB_BYTES 0x8080808080808080
+
+// May report a false match in the byte following a real one, which only costs a key comparison.
+// Assumes a little-endian byte order.
+private GroupMask groupMatch(u8 *group, u8 h2) {
+  u64 ctrl;
+  memcpy(&ctrl, group, sizeof(u64));
+  u64 x = ctrl ^ (LSB_BYTES * h2);
+  return (x - LSB_BYTES) & ~x & MSB_BYTES;
+}
+
+private GroupMask groupMatchEmpty(u8 *group) {
+  u64 ctrl;
+  memcpy(&ctrl, group, sizeof(u64));
+  return ctrl & MSB_BYTES;
+}
+#endif
+
+#define MASK_FIRST(mask) (__builtin_ctzll(mask) >> GROUP_SHIFT)
+#define MASK_NEXT(mask) ((mask) & ((mask)-1))
+
+typedef struct {
+  isize index;
+  bool is_found;
+} Probe;
+
+private HtUpsertResult insertHashed(HashTable *ht, s8 key, u64 key_hash, KeyDirEntry val,
+                                   Arena *arena);
+private void writeBegin(HashTable *ht);
+private void writeEnd(HashTable *ht);
+private bool findShared(HtArray *arr, s8 key, u64 key_hash, KeyDirEntry *val, u64 seq,
+                        u64 *seq_ptr);
+private bool initArray(HtArray *arr, Arena *arena, isize capacity);
+private Probe findSlot(HtArray *arr, s8 key, u64 key_hash);
+private bool startRehash(HashTable *ht, Arena *arena);
+private void rehashStep(HashTable *ht, isize steps);
 
 HashTableResult ht_create(Arena *arena, isize ht_capacity) {
   HashTableResult ht_res = {.ht = {0}, .is_ok = false};
@@ -29,63 +112,272 @@ HashTableResult ht_create(Arena *arena, isize ht_capacity) {
 
   HashTable *ht = &ht_res.ht;
   ht->len = 0;
-  ht->capacity = ht_capacity;
-  ht->kv_pairs = new(arena, KvPair, ht_capacity, NOZERO);
+
+  if (ht_capacity < GROUP_WIDTH) ht_capacity = GROUP_WIDTH;
+  bool out = initArray(&ht->cur, arena, ht_capacity);
+  return_value_if(!out, ht_res, ERR_OUT_OF_MEMORY);
 
   ht_res.is_ok = true;
   return ht_res;
 }
 
-bool ht_insert(HashTable *ht, s8 key, KeyDirEntry val) {
-  KvPair kv_pair = {.key = key, .val = val, .is_occupied = false};
+bool ht_insert(HashTable *ht, s8 key, KeyDirEntry val, Arena *arena) {
+  return ht_insert_hashed(ht, key, ht_hash(key), val, arena);
+}
+
+bool ht_insert_hashed(HashTable *ht, s8 key, u64 key_hash, KeyDirEntry val, Arena *arena) {
+  return ht_upsert_hashed(ht, key, key_hash, val, arena).is_ok;
+}
+
+HtUpsertResult ht_upsert_hashed(HashTable *ht, s8 key, u64 key_hash, KeyDirEntry val,
+                                Arena *arena) {
+  writeBegin(ht);
+  HtUpsertResult out = insertHashed(ht, key, key_hash, val, arena);
+  writeEnd(ht);
+
+  return out;
+}
+
+private HtUpsertResult insertHashed(HashTable *ht, s8 key, u64 key_hash, KeyDirEntry val,
+                                   Arena *arena) {
+  HtUpsertResult res = {0};
+  rehashStep(ht, HT_REHASH_STEP);
 
-  u64 index = hash(ht->capacity, kv_pair.key);
+  return_value_if(ht->len >= PTRDIFF_MAX / HT_MAX_LOAD_DEN, res, ERR_ARITHEMATIC_OVERFLOW);
+  if ((ht->len + 1) * HT_MAX_LOAD_DEN > ht->cur.capacity * HT_MAX_LOAD_NUM) {
+    // Inserts outran the incremental rehash, finish it before starting the next one.
+    if (ht->old.ctrl != NULL) rehashStep(ht, ht->old.capacity);
 
-  //if (ht->kv_pairs[index].is_occupied != 0 || ht->kv_pairs[index].is_occupied != 1) printf("%s\n", key.data);
-  if (!ht->kv_pairs[index].is_occupied) {
-    copyKeyToHt(ht, kv_pair, index, 1);
-    return true;
+    bool out = startRehash(ht, arena);
+    return_value_if(!out, res, ERR_KEY_INSERT_FAILED);
   }
 
-  while (ht->kv_pairs[index].is_occupied) {
-    if (s8cmp(kv_pair.key, ht->kv_pairs[index].key)) {
-      copyKeyToHt(ht, kv_pair, index, 0);
-      return true;
+  Probe probe = findSlot(&ht->cur, key, key_hash);
+  KvPair *kv_pair = ht->cur.kv_pairs + probe.index;
+
+  if (probe.is_found) {
+    res.prev = kv_pair->val;
+    res.is_replaced = true;
+  } else {
+    Probe old_probe = {0};
+    if (ht->old.ctrl != NULL) old_probe = findSlot(&ht->old, key, key_hash);
+
+    // A key that is only in the old array keeps its stored copy.
+    s8 stored_key = {0};
+    if (old_probe.is_found) {
+      stored_key = ht->old.kv_pairs[old_probe.index].key;
+      res.prev = ht->old.kv_pairs[old_probe.index].val;
+      res.is_replaced = true;
+    } else {
+      stored_key.data = new (arena, char, key.len, NOZERO);
+      return_value_if(stored_key.data == NULL, res, ERR_OUT_OF_MEMORY);
+      memcpy(stored_key.data, key.data, key.len);
+      stored_key.len = key.len;
+      ht->len++;
     }
-    index = (index + 1) & (ht->capacity - 1);
+
+    ht->cur.ctrl[probe.index] = H2(key_hash);
+    kv_pair->key = stored_key;
+    kv_pair->hash = key_hash;
   }
+  kv_pair->val = val;
 
-  copyKeyToHt(ht, kv_pair, index, 1);
-  return true;
+  res.is_ok = true;
+  return res;
 }
 
 KeyDirEntry *ht_get(HashTable *ht, s8 key) {
-  u64 index = hash(ht->capacity, key);
+  if (ht->old.ctrl != NULL) {
+    writeBegin(ht);
+    rehashStep(ht, HT_REHASH_STEP);
+    writeEnd(ht);
+  }
 
-  while (ht->kv_pairs[index].is_occupied) {
-    if (s8cmp(key, ht->kv_pairs[index].key)) {
-      return &ht->kv_pairs[index].val;
-    }
+  u64 key_hash = ht_hash(key);
+  Probe probe = findSlot(&ht->cur, key, key_hash);
+  if (probe.is_found) return &ht->cur.kv_pairs[probe.index].val;
 
-    index = (index + 1) & (ht->capacity - 1);
+  if (ht->old.ctrl != NULL) {
+    probe = findSlot(&ht->old, key, key_hash);
+    if (probe.is_found) return &ht->old.kv_pairs[probe.index].val;
   }
 
   return NULL;
 }
 
-private u64 hash(isize ht_capacity, s8 key) {
-  u64 hash = 0XCBF29CE484222325;
+bool ht_get_shared(HashTable *ht, s8 key, KeyDirEntry *val) {
+  u64 key_hash = ht_hash(key);
+  u64 *seq_ptr = &ht->seq;
+
+  while (true) {
+    u64 seq = atomic_load_explicit((_Atomic u64 *)seq_ptr, memory_order_acquire);
+    if (seq & 1) continue;
+
+    // The arrays are only probed once it is known that no resize swapped them meanwhile.
+    HtArray cur = ht->cur;
+    HtArray old = ht->old;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit((_Atomic u64 *)seq_ptr, memory_order_relaxed) != seq) continue;
+
+    bool is_found = findShared(&cur, key, key_hash, val, seq, seq_ptr);
+    if (!is_found && old.ctrl != NULL) {
+      is_found = findShared(&old, key, key_hash, val, seq, seq_ptr);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit((_Atomic u64 *)seq_ptr, memory_order_relaxed) == seq) return is_found;
+  }
+}
+
+u64 ht_hash(s8 key) { return wyhash(key.data, key.len, 0); }
+
+void ht_rehash_all(HashTable *ht) {
+  writeBegin(ht);
+  rehashStep(ht, ht->old.capacity);
+  writeEnd(ht);
+}
+
+isize ht_group_width(void) { return GROUP_WIDTH; }
+
+HashTableResult ht_create_from_ctrl(Arena *arena, isize ht_capacity, u8 *ctrl) {
+  HashTableResult ht_res = {.ht = {0}, .is_ok = false};
+  return_value_if(ht_capacity < GROUP_WIDTH || (ht_capacity & (ht_capacity - 1)) != 0, ht_res,
+                  ERR_INVALID_SIZE);
+  return_value_if(ht_capacity > PTRDIFF_MAX / sizeof(KvPair), ht_res, ERR_ARITHEMATIC_OVERFLOW);
+
+  isize len = 0;
+  for (isize i = 0; i < ht_capacity; i++) len += !(ctrl[i] & HT_EMPTY);
+
+  // Probes only terminate on an empty slot, which the load factor limit guarantees.
+  return_value_if(len * HT_MAX_LOAD_DEN > ht_capacity * HT_MAX_LOAD_NUM, ht_res, ERR_INVALID_SIZE);
+
+  HashTable *ht = &ht_res.ht;
+  bool out = initArray(&ht->cur, arena, ht_capacity);
+  return_value_if(!out, ht_res, ERR_OUT_OF_MEMORY);
+
+  memcpy(ht->cur.ctrl, ctrl, ht_capacity);
+  ht->len = len;
+
+  ht_res.is_ok = true;
+  return ht_res;
+}
+
+private void writeBegin(HashTable *ht) {
+  u64 seq = atomic_load_explicit((_Atomic u64 *)&ht->seq, memory_order_relaxed);
+  atomic_store_explicit((_Atomic u64 *)&ht->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+private void writeEnd(HashTable *ht) {
+  u64 seq = atomic_load_explicit((_Atomic u64 *)&ht->seq, memory_order_relaxed);
+  atomic_store_explicit((_Atomic u64 *)&ht->seq, seq + 1, memory_order_release);
+}
+
+// findSlot for ht_get_shared. The slots may be written while they are probed, so a matching slot
+// is only trusted, and its key pointer followed, once seq shows that nothing was written so far.
+// The probe gives up after visiting every group, which a slot array changing under it could make
+// it do. Returns false when the key was not found or the probe has to be started over.
+private bool findShared(HtArray *arr, s8 key, u64 key_hash, KeyDirEntry *val, u64 seq,
+                        u64 *seq_ptr) {
+  isize group_mask = arr->capacity / GROUP_WIDTH - 1;
+  isize group = H1(key_hash) & group_mask;
+  u8 h2 = H2(key_hash);
+
+  for (isize stride = 1; stride <= group_mask + 1; stride++) {
+    isize base = group * GROUP_WIDTH;
+    u8 *ctrl = arr->ctrl + base;
+
+    for (GroupMask mask = groupMatch(ctrl, h2); mask != 0; mask = MASK_NEXT(mask)) {
+      KvPair kv_pair = arr->kv_pairs[base + MASK_FIRST(mask)];
+      if (kv_pair.hash != key_hash || kv_pair.key.len != key.len) continue;
+
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit((_Atomic u64 *)seq_ptr, memory_order_relaxed) != seq) return false;
+
+      if (s8cmp(key, kv_pair.key)) {
+        *val = kv_pair.val;
+        return true;
+      }
+    }
+
+    if (groupMatchEmpty(ctrl) != 0) return false;
+    group = (group + stride) & group_mask;
+  }
+
+  return false;
+}
+
+private bool initArray(HtArray *arr, Arena *arena, isize capacity) {
+  arr->ctrl = alloc(arena, sizeof(u8), GROUP_WIDTH, capacity, NOZERO);
+  arr->kv_pairs = new (arena, KvPair, capacity, NOZERO);
+  return_value_if(arr->ctrl == NULL || arr->kv_pairs == NULL, false, ERR_OUT_OF_MEMORY);
+
+  memset(arr->ctrl, HT_EMPTY, capacity);
+  arr->capacity = capacity;
+
+  return true;
+}
+
+// Returns the slot holding key, or the first empty slot on its probe sequence. Groups are visited
+// in triangular order, which covers every group of a power of two sized array. The load factor
+// limit guarantees that an empty slot exists, so the probe always terminates.
+private Probe findSlot(HtArray *arr, s8 key, u64 key_hash) {
+  isize group_mask = arr->capacity / GROUP_WIDTH - 1;
+  isize group = H1(key_hash) & group_mask;
+  u8 h2 = H2(key_hash);
+
+  for (isize stride = 1;; stride++) {
+    isize base = group * GROUP_WIDTH;
+    u8 *ctrl = arr->ctrl + base;
+
+    for (GroupMask mask = groupMatch(ctrl, h2); mask != 0; mask = MASK_NEXT(mask)) {
+      isize index = base + MASK_FIRST(mask);
+      KvPair *kv_pair = arr->kv_pairs + index;
+      if (kv_pair->hash == key_hash && s8cmp(key, kv_pair->key)) {
+        return (Probe){.index = index, .is_found = true};
+      }
+    }
+
+    GroupMask empty = groupMatchEmpty(ctrl);
+    if (empty != 0) return (Probe){.index = base + MASK_FIRST(empty), .is_found = false};
 
-  for (isize i = 0; i < key.len; i++) {
-    hash ^= key.data[i];
-    hash *= 0x00000100000001B3;
+    group = (group + stride) & group_mask;
   }
+}
+
+private bool startRehash(HashTable *ht, Arena *arena) {
+  return_value_if(ht->cur.capacity > PTRDIFF_MAX / 2 / sizeof(KvPair), false,
+                  ERR_ARITHEMATIC_OVERFLOW);
+
+  HtArray arr = {0};
+  bool out = initArray(&arr, arena, 2 * ht->cur.capacity);
+  return_value_if(!out, false, ERR_OUT_OF_MEMORY);
 
-  return (hash) & (ht_capacity - 1);
+  ht->old = ht->cur;
+  ht->cur = arr;
+  ht->rehash_index = 0;
+
+  return true;
 }
 
-private void copyKeyToHt(HashTable *ht, KvPair kv_pair, isize index, u8 inc_len) {
-  memcpy(ht->kv_pairs + index, &kv_pair, sizeof(s8) + sizeof(KeyDirEntry));
-  ht->len += inc_len;
-  ht->kv_pairs[index].is_occupied = true;
+// Moves up to steps slots of the old array into the new one. A key that was written after the
+// resize started is already in the new array and is newer than its old copy, so it is skipped.
+private void rehashStep(HashTable *ht, isize steps) {
+  if (ht->old.ctrl == NULL) return;
+
+  for (; steps > 0 && ht->rehash_index < ht->old.capacity; steps--, ht->rehash_index++) {
+    if (ht->old.ctrl[ht->rehash_index] & HT_EMPTY) continue;
+
+    KvPair *old = ht->old.kv_pairs + ht->rehash_index;
+    Probe probe = findSlot(&ht->cur, old->key, old->hash);
+    if (probe.is_found) continue;
+
+    ht->cur.ctrl[probe.index] = H2(old->hash);
+    ht->cur.kv_pairs[probe.index] = *old;
+  }
+
+  if (ht->rehash_index == ht->old.capacity) {
+    ht->old = (HtArray){0};
+    ht->rehash_index = 0;
+  }
 }
@@ -26,22 +26,43 @@ You should have received a copy of the GNU General Public License along with bit
 #include "utils.h"
 
 typedef struct {
-  char *file_id;
-  isize val_len;
   isize val_pos;
+  isize val_len;
   i64 timestamp;
+  u32 file_id;
 } KeyDirEntry;
 
+// hash caches the key's full hash, so a probe rejects most fingerprint collisions without reading
+// the key and a resize never hashes a key again.
 typedef struct {
   s8 key;
   KeyDirEntry val;
-  bool is_occupied;
+  u64 hash;
 } KvPair;
 
+#define HT_EMPTY 0x80
+
+// One array of slots. ctrl holds a metadata byte per slot: 0x80 if it is empty, or the low 7 bits
+// of the key's hash when it is full. Lookups compare a whole group of ctrl bytes at once and only
+// touch the slots whose fingerprint matches.
 typedef struct {
-  isize len;
   isize capacity;
+  u8 *ctrl;
   KvPair *kv_pairs;
+} HtArray;
+
+// The table grows by doubling once it is seven eighths full. Entries are moved from the old
+// array to the new one a few slots at a time on every insert and lookup, so a resize never stalls
+// a single operation; while that is in progress both arrays are probed.
+//
+// seq is odd while the table is being modified, and bumped again once the modification is done,
+// which lets ht_get_shared tell that a modification overlapped it.
+typedef struct {
+  isize len;
+  HtArray cur;
+  HtArray old;
+  isize rehash_index;
+  u64 seq;
 } HashTable;
 
 typedef struct {
@@ -49,6 +70,33 @@ typedef struct {
   bool is_ok;
 } HashTableResult;
 
+// prev is the entry the insert overwrote, when is_replaced is set.
+typedef struct {
+  KeyDirEntry prev;
+  bool is_replaced;
+  bool is_ok;
+} HtUpsertResult;
+
+u64 ht_hash(s8 key);
 HashTableResult ht_create(Arena *arena, isize ht_capacity);
-bool ht_insert(HashTable *ht, s8 key, KeyDirEntry val);
+// The key is copied into arena when it is not in the table yet, the caller's copy is not retained.
+bool ht_insert(HashTable *ht, s8 key, KeyDirEntry val, Arena *arena);
+// Same as ht_insert for a key whose ht_hash was already computed.
+bool ht_insert_hashed(HashTable *ht, s8 key, u64 key_hash, KeyDirEntry val, Arena *arena);
+// Same as ht_insert_hashed, also telling which entry of the key was overwritten, if any.
+HtUpsertResult ht_upsert_hashed(HashTable *ht, s8 key, u64 key_hash, KeyDirEntry val,
+                                Arena *arena);
 KeyDirEntry *ht_get(HashTable *ht, s8 key);
+// A lookup that may run on any number of threads while one other thread inserts. It never modifies
+// the table, copies the entry into val instead of pointing into the table, and starts over when a
+// modification overlapped it. Arrays replaced by a resize stay in the arena, so a lookup that still
+// probes one never reads freed memory.
+bool ht_get_shared(HashTable *ht, s8 key, KeyDirEntry *val);
+// Finishes a resize in progress, so that every entry is in ht->cur.
+void ht_rehash_all(HashTable *ht);
+// Number of ctrl bytes compared at once. Where a key lands in ht->cur depends on it, so ctrl bytes
+// saved by a build with another group width cannot be reused.
+isize ht_group_width(void);
+// Creates a table whose cur array has the given ctrl bytes, as saved from an earlier ht->cur. The
+// caller then fills in the kv_pairs of the full slots.
+HashTableResult ht_create_from_ctrl(Arena *arena, isize ht_capacity, u8 *ctrl);
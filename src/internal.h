@@ -0,0 +1,93 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include "bitcask.h"
+#include "utils.h"
+
+// What bitcask.c shares with the modules that run parts of a handle on their own: merge.c, which
+// holds bc_merge and the background merge, and scrub.c, which holds the scrubber. Nothing here is
+// part of the interface of bitcask.h.
+
+#define BIN_EXT s8("bin")
+#define MERGED_EXT s8("merge")
+#define HINT_EXT s8("hint")
+
+#define BATCH_MARKER -1
+
+#define HEADER_SIZE (sizeof(i64) + 2 * sizeof(isize))
+
+#define KEY_LEN_OFFSET sizeof(i64)
+#define VAL_LEN_OFFSET KEY_LEN_OFFSET + sizeof(isize)
+#define KEY_OFFSET VAL_LEN_OFFSET + sizeof(isize)
+
+typedef struct {
+  i64 timestamp;
+  isize key_len;
+  isize val_len;
+} Header;
+
+// Precedes the records of a batch. key_len is BATCH_MARKER, which no record can have, so it is told
+// apart by the field a record header keeps its key length in. Recovery only replays the batch when
+// all body_len bytes of it are present and match body_crc.
+typedef struct {
+  i64 count;
+  isize key_len;
+  isize body_len;
+  u64 body_crc;
+  u64 crc;
+} BatchHeader;
+
+// bitcask.c
+bool appendEntry(BcHandle *bc, s8 key, s8 val);
+bool syncActiveFile(BcHandle *bc);
+i64 getMonotonicNs(void);
+i64 commitAppended(GroupCommit *commit);
+bool commitWait(GroupCommit *commit, i64 seq, i64 start_ns);
+Header decodeHeader(char *buffer);
+bool isRecordValid(char *record, isize record_len);
+bool findFiles(char *dir_path, s8 extension, isize *first, isize *last);
+void countMove(BcHandle *bc, u32 from_id, u32 to_id, isize record_len);
+bool getFilePath(char *file_path, char *dir_path, s8 extension, isize num_files);
+void getHintPath(char *hint_path, char *file_path);
+void *growMapping(void *map, isize len, isize cap, isize new_cap);
+bool hintAdd(HintBuilder *hint, s8 key, u64 key_hash, KeyDirEntry kd_entry);
+bool hintWrite(HintBuilder *hint, char *hint_path, isize data_len);
+void hintFree(HintBuilder *hint);
+bool getSnapshotPath(BcHandle *bc, char *snapshot_path);
+bool writeAll(int fd, char *buffer, isize len);
+i64 addFile(BcHandle *bc, char *file_path);
+i64 findFile(BcHandle *bc, char *file_path);
+int getFileFd(BcHandle *bc, u32 file_id);
+void closeFileFd(BcHandle *bc, u32 file_id);
+void lruUnlink(FileTable *ft, u32 file_id);
+isize readAt(int fd, char *buffer, isize len, isize offset);
+void unmapFiles(BcHandle *bc);
+
+// merge.c
+bool mergeStart(BcHandle *bc, isize first_num);
+void mergeStop(BcHandle *bc);
+bool mergeAddSource(BackgroundMerge *merge, u32 file_id, isize num);
+void mergePoll(BcHandle *bc);
+u64 readEnter(BcHandle *bc);
+void readExit(BcHandle *bc, u64 epoch);
+
+// scrub.c
+bool scrubStart(BcHandle *bc);
+void scrubStop(BcHandle *bc);
+bool scrubAddFile(Scrubber *scrub, u32 file_id, char *path);
+void scrubPoll(BcHandle *bc);
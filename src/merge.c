@@ -0,0 +1,1533 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include "bitcask.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "ht.h"
+#include "internal.h"
+#include "utils.h"
+
+// Writes the runs of live records a merge copies into a merged file. Short runs are gathered in
+// buffer, long ones are copied with copy_file_range for as long as the file systems support it.
+typedef struct {
+  int fd;
+  char *buffer;
+  isize len;
+  bool is_copy_unsupported;
+} MergeWriter;
+
+// A live record bc_merge copied from old_pos of a source to new_pos of the merged file being
+// written. Its key is the key_len bytes at key_off of the keys of the MergeOutput.
+typedef struct {
+  isize key_off;
+  isize key_len;
+  u32 source_id;
+  isize old_pos;
+  isize new_pos;
+  isize record_len;
+} MergeMoved;
+
+// A source bc_merge is done with, removed once the copies of its records are all in place.
+typedef struct {
+  i64 file_id;
+  char path[PATH_MAX];
+  char hint_path[PATH_MAX];
+} MergeDone;
+
+// A merge writes a new series of merged files, each one sealed with its hint file once full.
+// file_id is the merged file being written, if has_file is set. The keydir is only repointed at
+// its copies, moved, once it is synced and closed, and only then are the sources in done removed.
+typedef struct {
+  MergeWriter writer;
+  bool has_file;
+  u32 file_id;
+  isize num;
+  isize cursor;
+  HintBuilder hint;
+
+  MergeMoved *moved;
+  isize moved_len;
+  isize moved_cap;
+  char *keys;
+  isize keys_len;
+  isize keys_cap;
+  MergeDone *done;
+  isize done_len;
+  isize done_cap;
+} MergeOutput;
+
+// The files bc_merge may rewrite, in replay order: merged files [merged_first, merged_first +
+// merged_len), then data files from data_first on, len of them in all.
+typedef struct {
+  isize merged_first;
+  isize merged_len;
+  isize data_first;
+  isize len;
+} MergeSources;
+
+// A live record that a worker of a parallel bc_merge copied from old_pos of a source to new_pos of
+// the out_index-th merged file the worker wrote. key points into the source's mapping.
+typedef struct {
+  s8 key;
+  u32 source_id;
+  isize old_pos;
+  isize record_len;
+  isize out_index;
+  isize new_pos;
+} MergeCopy;
+
+// The sources picked by a parallel bc_merge, indices into its MergeSources, are handed out to the
+// workers through next. A worker maps its sources and leaves them mapped in maps until bc_merge
+// is done with the keys of its copies. Merged file numbers are taken from next_num.
+typedef struct {
+  BcHandle *bc;
+  MergeSources sources;
+  isize *picked;
+  isize picked_len;
+  char **maps;
+  isize *map_lens;
+  atomic_ptrdiff_t next;
+  atomic_ptrdiff_t next_num;
+} MergeQueue;
+
+// One worker of a parallel bc_merge: the merged files it wrote in outs, numbers in the order they
+// were written, and the copies whose keys bc_merge repoints at them once every worker is done.
+// Consecutive live records of a source, the run_len bytes at run_pos, are written out together.
+typedef struct {
+  MergeQueue *queue;
+  MergeWriter writer;
+  isize cursor;
+  HintBuilder hint;
+  isize run_pos;
+  isize run_len;
+
+  isize *outs;
+  isize outs_len;
+  isize outs_cap;
+
+  MergeCopy *copies;
+  isize copies_len;
+  isize copies_cap;
+
+  bool is_ok;
+} MergeWorker;
+
+private bool mergeEntries(BcHandle *bc, u32 file_id, char *source_path, char *hint_path,
+                          MergeOutput *merge_out, Arena scratch);
+private bool mergeParallel(BcHandle *bc, MergeQueue *queue, Arena scratch);
+private void *mergeParallelWorker(void *arg);
+private bool mergeSource(MergeWorker *worker, isize k);
+private bool mergeSourceCopy(MergeWorker *worker, char *record, isize record_len, Header header);
+private bool mergeSourceFlush(MergeWorker *worker, int fd, char *map);
+private bool mergeSourceSeal(MergeWorker *worker);
+private bool mergeFlushRun(MergeOutput *merge_out, int fd, char *run, isize run_pos,
+                           isize *run_len);
+private bool mergeWrite(MergeWriter *writer, int in_fd, isize pos, char *run, isize len);
+private bool mergeWriteRange(MergeWriter *writer, int in_fd, isize pos, isize len, char *buffer,
+                            isize cap);
+private isize mergeCopyRange(MergeWriter *writer, int in_fd, isize pos, isize len);
+private bool mergeWriterFlush(MergeWriter *writer);
+private i64 getMergeSource(BcHandle *bc, MergeSources sources, isize i, char *path,
+                           char *hint_path);
+private bool isMergeDue(BcHandle *bc, FileStats *stats);
+private void removeSource(BcHandle *bc, i64 file_id, char *path, char *hint_path);
+private bool openMergeOutput(BcHandle *bc, MergeOutput *merge_out);
+private bool closeMergeOutput(BcHandle *bc, MergeOutput *merge_out);
+private bool mergeOutputMove(MergeOutput *merge_out, s8 key, u32 source_id, isize old_pos,
+                             isize new_pos, isize record_len);
+private bool mergeOutputDone(MergeOutput *merge_out, i64 file_id, char *path, char *hint_path);
+private void mergeOutputApply(BcHandle *bc, MergeOutput *merge_out);
+private void mergeOutputDiscard(BcHandle *bc, MergeOutput *merge_out);
+private void mergeOutputFree(MergeOutput *merge_out);
+private void mergeApply(BcHandle *bc);
+private void mergeRemoveSource(BcHandle *bc, MergeSource source);
+private bool retireFile(BcHandle *bc, u32 file_id);
+private void retirePoll(BcHandle *bc);
+private void retireFree(BcHandle *bc, u32 *file_ids, isize len);
+private void *mergeWorker(void *arg);
+private bool mergeStep(BackgroundMerge *merge, MergeSource source, HashTable *key_dir);
+private bool mergeCopy(BackgroundMerge *merge, char *record, isize record_len, Header header);
+private bool mergeSeal(BackgroundMerge *merge);
+private bool mergeThrottle(BackgroundMerge *merge, isize bytes);
+
+#define MERGE_INIT_CAP ((isize)1 << 16)
+#define MERGE_READ_BUFFER_SIZE ((isize)1 << 22)
+#define MERGE_WRITE_BUFFER_SIZE ((isize)1 << 20)
+#define MERGE_COPY_MIN_LEN ((isize)1 << 16)
+
+bool bc_merge(BcHandle *bc) {
+  return_value_if(bc->merge != NULL, false, ERR_MERGE_BACKGROUND);
+
+  isize first_num, last_num, merged_first, merged_last;
+  bool is_ok = findFiles(bc->data_dir_path, BIN_EXT, &first_num, &last_num) &&
+               findFiles(bc->merged_dir_path, MERGED_EXT, &merged_first, &merged_last);
+  return_value_if(!is_ok, false, ERR_ACCESS);
+  return_value_if(first_num >= bc->num_files, false, ERR_MERGE);
+
+  // The files a snapshot refers to are rewritten, so it has to go before any of them does.
+  char snapshot_path[PATH_MAX];
+  is_ok = getSnapshotPath(bc, snapshot_path);
+  return_value_if(!is_ok, false, ERR_ACCESS);
+
+  i8 res = unlink(snapshot_path);
+  return_value_if(res == -1 && errno != ENOENT, false, ERR_ACCESS);
+
+  // Sources are unlinked below, so every mapping is dropped and recreated on demand by bc_get.
+  unmapFiles(bc);
+
+  // The earlier merged files come before the data files, which keeps the order that replay depends
+  // on: the new merged files only hold records older than every data file left.
+  MergeSources sources = {
+      .merged_first = merged_first,
+      .merged_len = merged_last - merged_first + 1,
+      .data_first = first_num,
+  };
+  sources.len = sources.merged_len + bc->num_files - first_num;
+
+  isize max_files = bc->options.merge_max_files > 0 ? bc->options.merge_max_files : PTRDIFF_MAX;
+
+  // Files without a live record are removed right away, the rest are picked. A merged file can be
+  // picked on its own. A data file that is due takes every older data file holding dead records
+  // along, or those records would win over the copies on replay; data_end is the last one taken.
+  isize merged_picked = 0;
+  isize picked = 0;
+  isize reclaim = 0;
+  isize pending = 0;
+  isize pending_reclaim = 0;
+  isize data_end = -1;
+  bool is_full = false;
+  for (isize i = 0; i < sources.len; i++) {
+    char source_path[PATH_MAX];
+    char hint_path[PATH_MAX];
+    i64 file_id = getMergeSource(bc, sources, i, source_path, hint_path);
+
+    FileStats *stats = file_id == -1 ? NULL : &bc->file_table.files[file_id].stats;
+    if (stats == NULL || stats->live_keys == 0) {
+      removeSource(bc, file_id, source_path, hint_path);
+      continue;
+    }
+
+    bool is_due = isMergeDue(bc, stats);
+    if (is_full) continue;
+
+    if (i < sources.merged_len) {
+      if (is_due && picked < max_files) {
+        merged_picked++;
+        picked++;
+        reclaim += stats->dead_bytes;
+      }
+      continue;
+    }
+
+    if (!is_due && stats->dead_keys == 0) continue;
+
+    pending++;
+    pending_reclaim += stats->dead_bytes;
+    if (!is_due) continue;
+
+    is_full = picked + pending > max_files;
+    if (is_full) continue;
+
+    picked += pending;
+    reclaim += pending_reclaim;
+    pending = 0;
+    pending_reclaim = 0;
+    data_end = i;
+  }
+
+  if (picked == 0 || reclaim < bc->options.merge_min_reclaim) return true;
+
+  Arena scratch = bc->scratch;
+  MergeQueue queue = {.bc = bc, .sources = sources, .next_num = merged_last};
+  queue.picked = new (&scratch, isize, picked, NOZERO);
+  return_value_if(queue.picked == NULL, false, ERR_OUT_OF_MEMORY);
+
+  for (isize i = 0; i < sources.len; i++) {
+    char source_path[PATH_MAX];
+    char hint_path[PATH_MAX];
+    i64 file_id = getMergeSource(bc, sources, i, source_path, hint_path);
+    if (file_id == -1 || bc->file_table.files[file_id].is_removed) continue;
+
+    FileStats *stats = &bc->file_table.files[file_id].stats;
+    bool is_due = isMergeDue(bc, stats);
+    bool is_picked = i < sources.merged_len ? is_due && merged_picked-- > 0
+                                            : i <= data_end && (is_due || stats->dead_keys > 0);
+
+    if (is_picked) queue.picked[queue.picked_len++] = i;
+  }
+
+  if (bc->options.merge_threads > 1) {
+    queue.maps = new (&scratch, char *, queue.picked_len);
+    queue.map_lens = new (&scratch, isize, queue.picked_len);
+    return_value_if(queue.maps == NULL || queue.map_lens == NULL, false, ERR_OUT_OF_MEMORY);
+
+    is_ok = mergeParallel(bc, &queue, scratch);
+    return_value_if(!is_ok, false, ERR_ACCESS);
+    return true;
+  }
+
+  MergeOutput merge_out = {.writer.fd = -1, .num = merged_last};
+  merge_out.writer.buffer = new (&scratch, char, MERGE_WRITE_BUFFER_SIZE, NOZERO);
+  return_value_if(merge_out.writer.buffer == NULL, false, ERR_OUT_OF_MEMORY);
+
+  is_ok = openMergeOutput(bc, &merge_out);
+  return_value_if(!is_ok, false, ERR_ACCESS);
+
+  for (isize k = 0; k < queue.picked_len && is_ok; k++) {
+    char source_path[PATH_MAX];
+    char hint_path[PATH_MAX];
+    i64 file_id = getMergeSource(bc, sources, queue.picked[k], source_path, hint_path);
+
+    is_ok = mergeEntries(bc, file_id, source_path, hint_path, &merge_out, scratch);
+  }
+
+  // The copies of a merge that failed may never have been written, so the keydir stays put.
+  is_ok = is_ok && closeMergeOutput(bc, &merge_out);
+  if (is_ok) {
+    mergeOutputApply(bc, &merge_out);
+  } else {
+    mergeOutputDiscard(bc, &merge_out);
+  }
+
+  hintFree(&merge_out.hint);
+  mergeOutputFree(&merge_out);
+  return_value_if(!is_ok, false, ERR_ACCESS);
+
+  return true;
+}
+
+// Copies the records of a source that the keydir points to into the merged files. Everything else
+// was overwritten or deleted since, or belongs to a batch that never completed. Live tombstones
+// are kept, since the keydir has no way to drop a key. The keydir is repointed at the copies, and
+// the source removed, once the merged file holding the last of them is synced and closed.
+//
+// The source is read MERGE_READ_BUFFER_SIZE bytes at a time. Consecutive live records form a run,
+// which is written as one range once a dead record, the end of the buffer or the end of the
+// merged file breaks it. Of a record larger than the buffer only the header and key are read, the
+// record is then copied on its own by mergeCopy.
+private bool mergeEntries(BcHandle *bc, u32 file_id, char *source_path, char *hint_path,
+                          MergeOutput *merge_out, Arena scratch) {
+  closeFileFd(bc, file_id);
+
+  int fd = open(source_path, O_RDONLY | O_CLOEXEC);
+  return_value_if(fd == -1, false, ERR_ACCESS);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  isize cap = MERGE_READ_BUFFER_SIZE;
+  char *buffer = new (&scratch, char, cap, NOZERO);
+  if (buffer == NULL) close(fd);
+  return_value_if(buffer == NULL, false, ERR_OUT_OF_MEMORY);
+
+  // buffer holds len bytes of the source from buffer_pos on, the run starts at run_pos.
+  isize buffer_pos = 0;
+  isize len = 0;
+  isize pos = 0;
+  isize run_pos = 0;
+  isize run_len = 0;
+  bool is_ok = true;
+
+  while (is_ok) {
+    isize offset = pos - buffer_pos;
+    isize need = HEADER_SIZE;
+    Header header = {0};
+
+    if (offset + HEADER_SIZE <= len) {
+      header = decodeHeader(buffer + offset);
+
+      // Batches only matter for recovery, their records are merged like any other.
+      if (header.key_len == BATCH_MARKER) {
+        is_ok = mergeFlushRun(merge_out, fd, buffer + run_pos - buffer_pos, run_pos, &run_len);
+        pos += sizeof(BatchHeader);
+        continue;
+      }
+
+      // Whatever follows the last complete record was cut short by a crash and is dropped.
+      if (header.key_len < 0 || header.val_len < 0 ||
+          header.key_len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - header.val_len) {
+        break;
+      }
+      need = HEADER_SIZE + sizeof(u64) + header.key_len + header.val_len;
+    }
+    isize span = need > cap ? HEADER_SIZE + header.key_len : need;
+
+    // The buffer is refilled from pos on, once the run it holds is written out.
+    if (offset + span > len) {
+      is_ok = mergeFlushRun(merge_out, fd, buffer + run_pos - buffer_pos, run_pos, &run_len);
+      if (!is_ok) break;
+
+      // Only a key larger than the buffer grows it.
+      isize kept = offset < len ? len - offset : 0;
+      if (span > cap) {
+        char *grown = new (&scratch, char, span, NOZERO);
+        is_ok = grown != NULL;
+        if (!is_ok) break;
+
+        memcpy(grown, buffer + offset, kept);
+        buffer = grown;
+        cap = span;
+      } else {
+        memmove(buffer, buffer + offset, kept);
+      }
+
+      // What was merged is not needed in the page cache any more.
+      if (pos > buffer_pos) posix_fadvise(fd, buffer_pos, pos - buffer_pos, POSIX_FADV_DONTNEED);
+      buffer_pos = pos;
+      len = kept;
+
+      isize bytes_read = readAt(fd, buffer + len, cap - len, buffer_pos + len);
+      is_ok = bytes_read != -1;
+      if (bytes_read <= 0) break;
+
+      len += bytes_read;
+      continue;
+    }
+
+    isize record_len = need;
+    s8 key = {.data = buffer + offset + KEY_OFFSET, .len = header.key_len};
+    KeyDirEntry *kd_entry = ht_get(&bc->key_dir, key);
+
+    if (kd_entry == NULL || kd_entry->file_id != file_id || kd_entry->val_pos != pos) {
+      is_ok = mergeFlushRun(merge_out, fd, buffer + run_pos - buffer_pos, run_pos, &run_len);
+      pos += record_len;
+      continue;
+    }
+
+    is_ok = merge_out->cursor < PTRDIFF_MAX - run_len - record_len;
+    if (!is_ok) close(fd);
+    return_value_if(!is_ok, false, ERR_ARITHEMATIC_OVERFLOW);
+
+    bool is_oversized = record_len > len - offset;
+    if (is_oversized) {
+      is_ok = mergeFlushRun(merge_out, fd, buffer + run_pos - buffer_pos, run_pos, &run_len);
+      if (!is_ok) break;
+    }
+
+    if (run_len == 0) run_pos = pos;
+    KeyDirEntry copy = *kd_entry;
+    copy.file_id = merge_out->file_id;
+    copy.val_pos = merge_out->cursor + run_len;
+    hintAdd(&merge_out->hint, key, ht_hash(key), copy);
+
+    is_ok = mergeOutputMove(merge_out, key, file_id, pos, copy.val_pos, record_len);
+    if (!is_ok) break;
+
+    // The copy goes through the buffer if it has to, which is read again from after the record.
+    if (is_oversized) {
+      is_ok = mergeWriteRange(&merge_out->writer, fd, pos, record_len, buffer, cap);
+      if (!is_ok) break;
+
+      posix_fadvise(fd, pos, record_len, POSIX_FADV_DONTNEED);
+      merge_out->cursor += record_len;
+      buffer_pos = pos + record_len;
+      len = 0;
+    } else {
+      run_len += record_len;
+    }
+    pos += record_len;
+
+    if (merge_out->cursor + run_len >= bc->options.max_file_size) {
+      is_ok = mergeFlushRun(merge_out, fd, buffer + run_pos - buffer_pos, run_pos, &run_len) &&
+              closeMergeOutput(bc, merge_out);
+      if (is_ok) mergeOutputApply(bc, merge_out);
+      is_ok = is_ok && openMergeOutput(bc, merge_out);
+    }
+  }
+
+  is_ok = is_ok && mergeFlushRun(merge_out, fd, buffer + run_pos - buffer_pos, run_pos, &run_len);
+  close(fd);
+  return_value_if(!is_ok, false, ERR_ACCESS);
+
+  is_ok = mergeOutputDone(merge_out, file_id, source_path, hint_path);
+  return_value_if(!is_ok, false, ERR_OUT_OF_MEMORY);
+
+  return true;
+}
+
+// Hands the run, which starts at run_pos of the source held by fd, to the writer of the merged
+// file and starts a new one.
+private bool mergeFlushRun(MergeOutput *merge_out, int fd, char *run, isize run_pos,
+                           isize *run_len) {
+  if (*run_len == 0) return true;
+
+  bool out = mergeWrite(&merge_out->writer, fd, run_pos, run, *run_len);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  merge_out->cursor += *run_len;
+  *run_len = 0;
+  return true;
+}
+
+// Appends len bytes at pos of in_fd, which run holds, to the merged file. copy_file_range spares
+// copying them through user space, and on some file systems copying them at all, but costs a
+// system call per run, so runs shorter than MERGE_COPY_MIN_LEN are buffered instead. Where the
+// kernel or the file systems do not support it, every run is written from run.
+private bool mergeWrite(MergeWriter *writer, int in_fd, isize pos, char *run, isize len) {
+  if (len < MERGE_COPY_MIN_LEN) {
+    if (writer->len + len > MERGE_WRITE_BUFFER_SIZE && !mergeWriterFlush(writer)) return false;
+
+    memcpy(writer->buffer + writer->len, run, len);
+    writer->len += len;
+    return true;
+  }
+
+  if (!mergeWriterFlush(writer)) return false;
+
+  isize copied = mergeCopyRange(writer, in_fd, pos, len);
+  if (copied == -1) return false;
+
+  return writeAll(writer->fd, run + copied, len - copied);
+}
+
+// Like mergeWrite for a range that is not in memory. Without copy_file_range it is read into
+// buffer, cap bytes at a time, and written from there.
+private bool mergeWriteRange(MergeWriter *writer, int in_fd, isize pos, isize len, char *buffer,
+                            isize cap) {
+  if (!mergeWriterFlush(writer)) return false;
+
+  isize copied = mergeCopyRange(writer, in_fd, pos, len);
+  if (copied == -1) return false;
+
+  while (copied < len) {
+    isize chunk = len - copied < cap ? len - copied : cap;
+    isize bytes_read = readAt(in_fd, buffer, chunk, pos + copied);
+    return_value_if(bytes_read < chunk, false, ERR_ACCESS);
+
+    bool out = writeAll(writer->fd, buffer, chunk);
+    if (!out) return false;
+    copied += chunk;
+  }
+
+  return true;
+}
+
+// Copies as much of the len bytes at pos of in_fd to the merged file as copy_file_range will, and
+// returns how many that was, or -1 if it failed for any other reason than lacking support.
+private isize mergeCopyRange(MergeWriter *writer, int in_fd, isize pos, isize len) {
+  isize copied = 0;
+  while (!writer->is_copy_unsupported && copied < len) {
+    loff_t in_pos = pos + copied;
+    isize bytes_copied = copy_file_range(in_fd, &in_pos, writer->fd, NULL, len - copied, 0);
+    if (bytes_copied == -1 && errno == EINTR) continue;
+    if (bytes_copied <= 0) {
+      writer->is_copy_unsupported = bytes_copied == 0 || errno == ENOSYS || errno == EXDEV ||
+                                    errno == EINVAL || errno == EOPNOTSUPP;
+      return_value_if(!writer->is_copy_unsupported, -1, ERR_ACCESS);
+      break;
+    }
+
+    copied += bytes_copied;
+  }
+
+  return copied;
+}
+
+private bool mergeWriterFlush(MergeWriter *writer) {
+  bool out = writeAll(writer->fd, writer->buffer, writer->len);
+  writer->len = 0;
+
+  return out;
+}
+
+// Splits the picked sources among Options.merge_threads workers and, once all of them are done,
+// repoints the keydir at every copy in one go. Only then are the sources removed, oldest first, so
+// that a crash in between never leaves an older data file replayed over the copies. If any worker
+// fails, what the workers wrote is removed and the keydir is left as it was.
+private bool mergeParallel(BcHandle *bc, MergeQueue *queue, Arena scratch) {
+  isize threads_num = bc->options.merge_threads;
+  if (threads_num > queue->picked_len) threads_num = queue->picked_len;
+
+  // The workers look keys up while nothing modifies the keydir, which must not be resizing then.
+  ht_rehash_all(&bc->key_dir);
+
+  MergeWorker *workers = new (&scratch, MergeWorker, threads_num);
+  pthread_t *threads = new (&scratch, pthread_t, threads_num);
+  char *buffers = new (&scratch, char, threads_num * MERGE_WRITE_BUFFER_SIZE, NOZERO);
+  return_value_if(workers == NULL || threads == NULL || buffers == NULL, false, ERR_OUT_OF_MEMORY);
+
+  isize started = 0;
+  for (isize i = 0; i < threads_num; i++) {
+    workers[i] = (MergeWorker){.queue = queue, .is_ok = true};
+    workers[i].writer = (MergeWriter){.fd = -1, .buffer = buffers + i * MERGE_WRITE_BUFFER_SIZE};
+    if (started == i && pthread_create(threads + i, NULL, mergeParallelWorker, workers + i) == 0) {
+      started++;
+    }
+  }
+
+  // Workers that could not be started are run here, one after the other.
+  for (isize i = started; i < threads_num; i++) mergeParallelWorker(workers + i);
+  for (isize i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  bool is_ok = true;
+  for (isize i = 0; i < threads_num; i++) is_ok = is_ok && workers[i].is_ok;
+
+  for (isize i = 0; i < threads_num; i++) {
+    MergeWorker *worker = workers + i;
+
+    // Every merged file of the worker, in the order it wrote them, gets a file id.
+    u32 *out_ids = new (&scratch, u32, worker->outs_len, NOZERO);
+    is_ok = is_ok && out_ids != NULL;
+
+    for (isize j = 0; j < worker->outs_len; j++) {
+      char merged_path[PATH_MAX];
+      char hint_path[PATH_MAX];
+      getFilePath(merged_path, bc->merged_dir_path, MERGED_EXT, worker->outs[j]);
+      getFilePath(hint_path, bc->hint_dir_path, HINT_EXT, worker->outs[j]);
+
+      i64 file_id = is_ok ? addFile(bc, merged_path) : -1;
+      if (file_id == -1) {
+        unlink(merged_path);
+        unlink(hint_path);
+        is_ok = false;
+        continue;
+      }
+      out_ids[j] = file_id;
+      if (bc->scrub != NULL) scrubAddFile(bc->scrub, file_id, merged_path);
+    }
+
+    for (isize j = 0; j < worker->copies_len && is_ok; j++) {
+      MergeCopy *copy = worker->copies + j;
+      KeyDirEntry *kd_entry = ht_get(&bc->key_dir, copy->key);
+      if (kd_entry == NULL || kd_entry->file_id != copy->source_id ||
+          kd_entry->val_pos != copy->old_pos) {
+        continue;
+      }
+
+      kd_entry->file_id = out_ids[copy->out_index];
+      kd_entry->val_pos = copy->new_pos;
+      countMove(bc, copy->source_id, kd_entry->file_id, copy->record_len);
+    }
+
+    if (worker->copies != NULL) munmap(worker->copies, worker->copies_cap);
+    if (worker->outs != NULL) munmap(worker->outs, worker->outs_cap);
+    hintFree(&worker->hint);
+  }
+
+  for (isize k = 0; k < queue->picked_len; k++) {
+    if (queue->maps[k] != NULL) munmap(queue->maps[k], queue->map_lens[k]);
+
+    char source_path[PATH_MAX];
+    char hint_path[PATH_MAX];
+    i64 file_id = getMergeSource(bc, queue->sources, queue->picked[k], source_path, hint_path);
+    if (is_ok) removeSource(bc, file_id, source_path, hint_path);
+  }
+
+  return is_ok;
+}
+
+private void *mergeParallelWorker(void *arg) {
+  MergeWorker *worker = arg;
+  MergeQueue *queue = worker->queue;
+
+  while (worker->is_ok) {
+    isize k = atomic_fetch_add(&queue->next, 1);
+    if (k >= queue->picked_len) break;
+
+    worker->is_ok = mergeSource(worker, k);
+  }
+
+  if (worker->writer.fd != -1) worker->is_ok = mergeSourceSeal(worker) && worker->is_ok;
+
+  return NULL;
+}
+
+// Copies the records of the k-th picked source that the keydir points to into the merged files
+// of the worker.
+private bool mergeSource(MergeWorker *worker, isize k) {
+  MergeQueue *queue = worker->queue;
+  BcHandle *bc = queue->bc;
+
+  char source_path[PATH_MAX];
+  char hint_path[PATH_MAX];
+  i64 file_id = getMergeSource(bc, queue->sources, queue->picked[k], source_path, hint_path);
+  return_value_if(file_id == -1, false, ERR_ACCESS);
+
+  int fd = open(source_path, O_RDONLY | O_CLOEXEC);
+  return_value_if(fd == -1, false, ERR_ACCESS);
+
+  struct stat st;
+  i8 res = fstat(fd, &st);
+  if (res == -1) close(fd);
+  return_value_if(res == -1, false, ERR_ACCESS);
+  if (st.st_size == 0) {
+    close(fd);
+    return true;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) close(fd);
+  return_value_if(map == MAP_FAILED, false, ERR_ACCESS);
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  queue->maps[k] = map;
+  queue->map_lens[k] = st.st_size;
+
+  // The descriptor stays open for copy_file_range, the mapping for the keys of the copies.
+  bool is_ok = true;
+  bool is_valid = true;
+  for (isize pos = 0; pos + HEADER_SIZE <= st.st_size && is_ok;) {
+    Header header = decodeHeader(map + pos);
+
+    // Batches only matter for recovery, their records are merged like any other.
+    if (header.key_len == BATCH_MARKER) {
+      is_ok = mergeSourceFlush(worker, fd, map);
+      pos += sizeof(BatchHeader);
+      continue;
+    }
+
+    // Whatever follows the last complete record was cut short by a crash and is dropped.
+    if (header.key_len < 0 || header.val_len < 0 ||
+        header.key_len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - header.val_len) {
+      break;
+    }
+    isize record_len = HEADER_SIZE + sizeof(u64) + header.key_len + header.val_len;
+    if (record_len > st.st_size - pos) break;
+
+    // Every record is checked, not only live ones: a damaged key would look like a dead record
+    // and be dropped. A corrupt source fails the merge with every source in place.
+    is_valid = isRecordValid(map + pos, record_len);
+    if (!is_valid) break;
+
+    s8 key = {.data = map + pos + KEY_OFFSET, .len = header.key_len};
+    KeyDirEntry kd_entry;
+    bool is_live = ht_get_shared(&bc->key_dir, key, &kd_entry) && kd_entry.file_id == file_id &&
+                   kd_entry.val_pos == pos;
+    if (!is_live) {
+      is_ok = mergeSourceFlush(worker, fd, map);
+      pos += record_len;
+      continue;
+    }
+
+    if (worker->run_len == 0) worker->run_pos = pos;
+    is_ok = mergeSourceCopy(worker, map + pos, record_len, header);
+    if (!is_ok) break;
+
+    MergeCopy *copy = worker->copies + worker->copies_len - 1;
+    copy->source_id = file_id;
+    copy->old_pos = pos;
+    pos += record_len;
+
+    if (worker->cursor + worker->run_len >= bc->options.max_file_size) {
+      is_ok = mergeSourceFlush(worker, fd, map) && mergeSourceSeal(worker);
+    }
+  }
+
+  is_ok = is_ok && is_valid && mergeSourceFlush(worker, fd, map);
+  close(fd);
+  return_value_if(!is_valid, false, ERR_CRC_FAILED);
+
+  return is_ok;
+}
+
+// Adds a live record to the run of the worker, starting a new merged file if there is none, and
+// adds its copy with everything but the source filled in.
+private bool mergeSourceCopy(MergeWorker *worker, char *record, isize record_len, Header header) {
+  MergeQueue *queue = worker->queue;
+  BcHandle *bc = queue->bc;
+
+  if (worker->writer.fd == -1) {
+    isize size = worker->outs_len * sizeof(isize);
+    if (size + (isize)sizeof(isize) > worker->outs_cap) {
+      isize cap = worker->outs_cap == 0 ? MERGE_INIT_CAP : 2 * worker->outs_cap;
+      isize *outs = growMapping(worker->outs, size, worker->outs_cap, cap);
+      return_value_if(outs == NULL, false, ERR_OUT_OF_MEMORY);
+      worker->outs = outs;
+      worker->outs_cap = cap;
+    }
+
+    isize num = atomic_fetch_add(&queue->next_num, 1) + 1;
+    return_value_if(num > UINT32_MAX, false, ERR_ARITHEMATIC_OVERFLOW);
+
+    char merged_path[PATH_MAX];
+    getFilePath(merged_path, bc->merged_dir_path, MERGED_EXT, num);
+
+    worker->writer.fd = open(merged_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return_value_if(worker->writer.fd == -1, false, ERR_ACCESS);
+
+    worker->outs[worker->outs_len++] = num;
+    worker->cursor = 0;
+  }
+
+  isize size = worker->copies_len * sizeof(MergeCopy);
+  if (size + (isize)sizeof(MergeCopy) > worker->copies_cap) {
+    isize cap = worker->copies_cap == 0 ? MERGE_INIT_CAP : 2 * worker->copies_cap;
+    MergeCopy *copies = growMapping(worker->copies, size, worker->copies_cap, cap);
+    return_value_if(copies == NULL, false, ERR_OUT_OF_MEMORY);
+    worker->copies = copies;
+    worker->copies_cap = cap;
+  }
+
+  s8 key = {.data = record + KEY_OFFSET, .len = header.key_len};
+  KeyDirEntry kd_entry = {
+      .val_pos = worker->cursor + worker->run_len,
+      .val_len = header.val_len,
+      .timestamp = header.timestamp,
+  };
+  hintAdd(&worker->hint, key, ht_hash(key), kd_entry);
+
+  worker->copies[worker->copies_len++] = (MergeCopy){
+      .key = key,
+      .record_len = record_len,
+      .out_index = worker->outs_len - 1,
+      .new_pos = kd_entry.val_pos,
+  };
+  worker->run_len += record_len;
+
+  return true;
+}
+
+// Writes the run of the worker, which map of the source held by fd holds, to its merged file.
+private bool mergeSourceFlush(MergeWorker *worker, int fd, char *map) {
+  if (worker->run_len == 0) return true;
+
+  bool out = mergeWrite(&worker->writer, fd, worker->run_pos, map + worker->run_pos,
+                        worker->run_len);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  worker->cursor += worker->run_len;
+  worker->run_len = 0;
+  return true;
+}
+
+// Syncs and closes the merged file the worker is writing, drops it from the page cache and writes
+// its hint.
+private bool mergeSourceSeal(MergeWorker *worker) {
+  BcHandle *bc = worker->queue->bc;
+
+  bool is_synced = mergeWriterFlush(&worker->writer) && fdatasync(worker->writer.fd) == 0;
+  if (is_synced) posix_fadvise(worker->writer.fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  i8 res = close(worker->writer.fd);
+  worker->writer.fd = -1;
+  return_value_if(!is_synced || res == -1, false, ERR_ACCESS);
+
+  // A missing hint only makes the next bc_open scan the merged file, so it does not fail the merge.
+  char hint_path[PATH_MAX];
+  getFilePath(hint_path, bc->hint_dir_path, HINT_EXT, worker->outs[worker->outs_len - 1]);
+  hintWrite(&worker->hint, hint_path, worker->cursor);
+
+  return true;
+}
+
+private i64 getMergeSource(BcHandle *bc, MergeSources sources, isize i, char *path,
+                           char *hint_path) {
+  if (i < sources.merged_len) {
+    getFilePath(path, bc->merged_dir_path, MERGED_EXT, sources.merged_first + i);
+    getFilePath(hint_path, bc->hint_dir_path, HINT_EXT, sources.merged_first + i);
+  } else {
+    getFilePath(path, bc->data_dir_path, BIN_EXT, sources.data_first + i - sources.merged_len);
+    getHintPath(hint_path, path);
+  }
+
+  // A file the keydir did not point to when the snapshot was taken is not in the file table.
+  return findFile(bc, path);
+}
+
+private bool isMergeDue(BcHandle *bc, FileStats *stats) {
+  isize len = stats->live_bytes + stats->dead_bytes;
+  return stats->dead_bytes > 0 && stats->dead_bytes >= bc->options.merge_dead_ratio * len;
+}
+
+private void removeSource(BcHandle *bc, i64 file_id, char *path, char *hint_path) {
+  if (file_id != -1) {
+    closeFileFd(bc, file_id);
+    bc->file_table.files[file_id].stats = (FileStats){0};
+    bc->file_table.files[file_id].is_removed = true;
+  }
+
+  unlink(path);
+  unlink(hint_path);
+}
+
+// Starts the next merged file. Merged files are never appended to once closed.
+private bool openMergeOutput(BcHandle *bc, MergeOutput *merge_out) {
+  return_value_if(merge_out->num >= UINT32_MAX, false, ERR_ARITHEMATIC_OVERFLOW);
+  merge_out->num++;
+
+  char merged_file_path[PATH_MAX];
+  bool out = getFilePath(merged_file_path, bc->merged_dir_path, MERGED_EXT, merge_out->num);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  merge_out->writer.fd = open(merged_file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  return_value_if(merge_out->writer.fd == -1, false, ERR_ACCESS);
+  merge_out->cursor = 0;
+
+  i64 file_id = addFile(bc, merged_file_path);
+  return_value_if(file_id == -1, false, ERR_OBJECT_INITIALIZATION_FAILED);
+  merge_out->file_id = file_id;
+  merge_out->has_file = true;
+
+  return true;
+}
+
+// Syncs the merged file before closing it, since the keydir is repointed into it right after. Its
+// pages are dropped from the page cache afterwards, so that merging does not evict what foreground
+// reads need.
+private bool closeMergeOutput(BcHandle *bc, MergeOutput *merge_out) {
+  MergeWriter *writer = &merge_out->writer;
+  if (writer->fd == -1) return false;
+
+  bool is_synced = mergeWriterFlush(writer) && fdatasync(writer->fd) == 0;
+  if (is_synced) posix_fadvise(writer->fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  i8 res = close(writer->fd);
+  writer->fd = -1;
+  return_value_if(!is_synced || res == -1, false, ERR_ACCESS);
+
+  char hint_path[PATH_MAX];
+  bool out = getFilePath(hint_path, bc->hint_dir_path, HINT_EXT, merge_out->num);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  // A missing hint only makes the next bc_open scan the merged file, so it does not fail the merge.
+  hintWrite(&merge_out->hint, hint_path, merge_out->cursor);
+
+  if (bc->scrub != NULL) {
+    scrubAddFile(bc->scrub, merge_out->file_id, bc->file_table.files[merge_out->file_id].path);
+  }
+
+  return true;
+}
+
+private bool mergeOutputMove(MergeOutput *merge_out, s8 key, u32 source_id, isize old_pos,
+                             isize new_pos, isize record_len) {
+  isize size = merge_out->moved_len * sizeof(MergeMoved);
+  if (size + (isize)sizeof(MergeMoved) > merge_out->moved_cap) {
+    isize cap = merge_out->moved_cap == 0 ? MERGE_INIT_CAP : 2 * merge_out->moved_cap;
+    MergeMoved *moved = growMapping(merge_out->moved, size, merge_out->moved_cap, cap);
+    return_value_if(moved == NULL, false, ERR_OUT_OF_MEMORY);
+    merge_out->moved = moved;
+    merge_out->moved_cap = cap;
+  }
+
+  if (merge_out->keys_len + key.len > merge_out->keys_cap) {
+    isize cap = merge_out->keys_cap == 0 ? MERGE_INIT_CAP : 2 * merge_out->keys_cap;
+    while (cap < merge_out->keys_len + key.len) cap *= 2;
+    char *keys = growMapping(merge_out->keys, merge_out->keys_len, merge_out->keys_cap, cap);
+    return_value_if(keys == NULL, false, ERR_OUT_OF_MEMORY);
+    merge_out->keys = keys;
+    merge_out->keys_cap = cap;
+  }
+
+  memcpy(merge_out->keys + merge_out->keys_len, key.data, key.len);
+  merge_out->moved[merge_out->moved_len++] = (MergeMoved){
+      .key_off = merge_out->keys_len,
+      .key_len = key.len,
+      .source_id = source_id,
+      .old_pos = old_pos,
+      .new_pos = new_pos,
+      .record_len = record_len,
+  };
+  merge_out->keys_len += key.len;
+
+  return true;
+}
+
+private bool mergeOutputDone(MergeOutput *merge_out, i64 file_id, char *path, char *hint_path) {
+  isize size = merge_out->done_len * sizeof(MergeDone);
+  if (size + (isize)sizeof(MergeDone) > merge_out->done_cap) {
+    isize cap = merge_out->done_cap == 0 ? MERGE_INIT_CAP : 2 * merge_out->done_cap;
+    MergeDone *done = growMapping(merge_out->done, size, merge_out->done_cap, cap);
+    return_value_if(done == NULL, false, ERR_OUT_OF_MEMORY);
+    merge_out->done = done;
+    merge_out->done_cap = cap;
+  }
+
+  MergeDone *done = merge_out->done + merge_out->done_len++;
+  done->file_id = file_id;
+  memcpy(done->path, path, PATH_MAX);
+  memcpy(done->hint_path, hint_path, PATH_MAX);
+
+  return true;
+}
+
+// Called once the merged file is closed: repoints the keydir at its copies and removes the sources
+// done with, oldest first. Every copy of those is in this file or an earlier one.
+private void mergeOutputApply(BcHandle *bc, MergeOutput *merge_out) {
+  for (isize i = 0; i < merge_out->moved_len; i++) {
+    MergeMoved *moved = merge_out->moved + i;
+    s8 key = {.data = merge_out->keys + moved->key_off, .len = moved->key_len};
+
+    KeyDirEntry *kd_entry = ht_get(&bc->key_dir, key);
+    if (kd_entry == NULL || kd_entry->file_id != moved->source_id ||
+        kd_entry->val_pos != moved->old_pos) {
+      continue;
+    }
+
+    kd_entry->file_id = merge_out->file_id;
+    kd_entry->val_pos = moved->new_pos;
+    countMove(bc, moved->source_id, merge_out->file_id, moved->record_len);
+  }
+
+  for (isize i = 0; i < merge_out->done_len; i++) {
+    MergeDone *done = merge_out->done + i;
+    removeSource(bc, done->file_id, done->path, done->hint_path);
+  }
+
+  merge_out->has_file = false;
+  merge_out->moved_len = 0;
+  merge_out->keys_len = 0;
+  merge_out->done_len = 0;
+}
+
+// Drops the merged file being written, which the keydir never pointed into, and keeps every
+// source not removed yet.
+private void mergeOutputDiscard(BcHandle *bc, MergeOutput *merge_out) {
+  if (merge_out->writer.fd != -1) close(merge_out->writer.fd);
+  merge_out->writer.fd = -1;
+
+  if (merge_out->has_file) {
+    char hint_path[PATH_MAX];
+    getFilePath(hint_path, bc->hint_dir_path, HINT_EXT, merge_out->num);
+    removeSource(bc, merge_out->file_id, bc->file_table.files[merge_out->file_id].path, hint_path);
+    merge_out->has_file = false;
+  }
+
+  merge_out->moved_len = 0;
+  merge_out->keys_len = 0;
+  merge_out->done_len = 0;
+}
+
+private void mergeOutputFree(MergeOutput *merge_out) {
+  if (merge_out->moved != NULL) munmap(merge_out->moved, merge_out->moved_cap);
+  if (merge_out->keys != NULL) munmap(merge_out->keys, merge_out->keys_cap);
+  if (merge_out->done != NULL) munmap(merge_out->done, merge_out->done_cap);
+}
+
+bool mergeStart(BcHandle *bc, isize first_num) {
+  BackgroundMerge *merge = new (&bc->arena, BackgroundMerge);
+  return_value_if(merge == NULL, false, ERR_OUT_OF_MEMORY);
+
+  memcpy(merge->data_dir_path, bc->data_dir_path, PATH_MAX);
+  memcpy(merge->merged_dir_path, bc->merged_dir_path, PATH_MAX);
+  memcpy(merge->hint_dir_path, bc->hint_dir_path, PATH_MAX);
+  merge->keep_files = bc->options.merge_keep_files;
+  merge->step_size = bc->options.merge_step_size;
+  merge->rate_limit = bc->options.merge_rate_limit;
+  merge->max_file_size = bc->options.max_file_size;
+  merge->source_fd = -1;
+  merge->out_fd = -1;
+
+  // Merged files are never appended to once closed, so every run starts a new one.
+  isize merged_first;
+  bool is_found = findFiles(bc->merged_dir_path, MERGED_EXT, &merged_first, &merge->out_num);
+  return_value_if(!is_found, false, ERR_ACCESS);
+
+  for (isize num = first_num; num < bc->num_files; num++) {
+    char file_path[PATH_MAX];
+    getFilePath(file_path, bc->data_dir_path, BIN_EXT, num);
+    if (access(file_path, F_OK) == -1 && errno == ENOENT) continue;
+
+    i64 file_id = addFile(bc, file_path);
+    bool out = file_id != -1 && mergeAddSource(merge, file_id, num);
+    return_value_if(!out, false, ERR_OBJECT_INITIALIZATION_FAILED);
+  }
+
+  // Throttling waits on wake with a CLOCK_MONOTONIC deadline, so that bc_close cuts it short.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+  pthread_mutex_init(&merge->lock, NULL);
+  pthread_cond_init(&merge->wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  i8 res = pthread_create(&merge->thread, NULL, mergeWorker, merge);
+  if (res != 0) {
+    pthread_mutex_destroy(&merge->lock);
+    pthread_cond_destroy(&merge->wake);
+  }
+  return_value_if(res != 0, false, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  bc->merge = merge;
+  return true;
+}
+
+// Stops the thread and applies the step it may have left, so that no copy is lost.
+void mergeStop(BcHandle *bc) {
+  BackgroundMerge *merge = bc->merge;
+
+  pthread_mutex_lock(&merge->lock);
+  merge->is_stopping = true;
+  pthread_cond_signal(&merge->wake);
+  pthread_mutex_unlock(&merge->lock);
+
+  pthread_join(merge->thread, NULL);
+  mergeApply(bc);
+
+  pthread_mutex_destroy(&merge->lock);
+  pthread_cond_destroy(&merge->wake);
+
+  if (merge->sources != NULL) munmap(merge->sources, merge->sources_cap);
+  if (merge->moves != NULL) munmap(merge->moves, merge->moves_cap);
+  if (merge->buffer != NULL) munmap(merge->buffer, merge->buffer_cap);
+  hintFree(&merge->hint);
+
+  // bc_close has the readers stopped.
+  ReadEpoch *epoch = &merge->epoch;
+  retireFree(bc, epoch->pending, epoch->pending_len);
+  retireFree(bc, epoch->waiting, epoch->waiting_len);
+  if (epoch->pending != NULL) munmap(epoch->pending, epoch->pending_cap);
+  if (epoch->waiting != NULL) munmap(epoch->waiting, epoch->waiting_cap);
+  bc->merge = NULL;
+}
+
+bool mergeAddSource(BackgroundMerge *merge, u32 file_id, isize num) {
+  bool is_ok = true;
+  pthread_mutex_lock(&merge->lock);
+
+  isize size = merge->sources_len * sizeof(MergeSource);
+  if (size + (isize)sizeof(MergeSource) > merge->sources_cap) {
+    isize cap = merge->sources_cap == 0 ? MERGE_INIT_CAP : 2 * merge->sources_cap;
+    MergeSource *sources = growMapping(merge->sources, size, merge->sources_cap, cap);
+    is_ok = sources != NULL;
+    if (is_ok) {
+      merge->sources = sources;
+      merge->sources_cap = cap;
+    }
+  }
+
+  if (is_ok) {
+    merge->sources[merge->sources_len++] = (MergeSource){.file_id = file_id, .num = num};
+    pthread_cond_signal(&merge->wake);
+  }
+
+  pthread_mutex_unlock(&merge->lock);
+  return is_ok;
+}
+
+// Called by the writer before every put and batch. The thread only learns where the keydir is
+// here, since the handle is copied out of bc_open after the thread was started.
+void mergePoll(BcHandle *bc) {
+  BackgroundMerge *merge = bc->merge;
+
+  if (merge->key_dir != &bc->key_dir) {
+    pthread_mutex_lock(&merge->lock);
+    merge->key_dir = &bc->key_dir;
+    pthread_cond_signal(&merge->wake);
+    pthread_mutex_unlock(&merge->lock);
+  }
+
+  if (atomic_load_explicit((_Atomic bool *)&merge->is_ready, memory_order_acquire)) mergeApply(bc);
+  retirePoll(bc);
+}
+
+// Repoints every key whose record the step copied, unless the key was written again since, and
+// removes the source once all of it is copied.
+private void mergeApply(BcHandle *bc) {
+  BackgroundMerge *merge = bc->merge;
+  pthread_mutex_lock(&merge->lock);
+  if (!merge->is_ready) {
+    pthread_mutex_unlock(&merge->lock);
+    return;
+  }
+
+  MergeSource source = merge->sources[merge->sources_next];
+  bool is_ok = true;
+  if (merge->moves_len > 0) {
+    char merged_path[PATH_MAX];
+    getFilePath(merged_path, bc->merged_dir_path, MERGED_EXT, merge->moves_num);
+
+    i64 file_id = addFile(bc, merged_path);
+    is_ok = file_id != -1;
+    if (is_ok && bc->options.concurrent_reads) getFileFd(bc, file_id);
+
+    for (isize i = 0; i < merge->moves_len && is_ok; i++) {
+      MergeMove *move = merge->moves + i;
+      isize record_len = HEADER_SIZE + sizeof(u64) + move->key.len + move->val_len;
+
+      // The copy of a key written again since the step is dead as soon as it is in the file.
+      KeyDirEntry *kd_entry = ht_get(&bc->key_dir, move->key);
+      if (kd_entry == NULL || kd_entry->file_id != source.file_id ||
+          kd_entry->val_pos != move->old_pos) {
+        bc->file_table.files[file_id].stats.dead_bytes += record_len;
+        bc->file_table.files[file_id].stats.dead_keys++;
+        continue;
+      }
+
+      KeyDirEntry moved = {
+          .val_pos = move->new_pos,
+          .val_len = move->val_len,
+          .timestamp = move->timestamp,
+          .file_id = file_id,
+      };
+      is_ok = ht_insert_hashed(&bc->key_dir, move->key, move->hash, moved, &bc->arena);
+      countMove(bc, source.file_id, file_id, record_len);
+    }
+  }
+
+  // A source that could not be repointed entirely must stay, so the merge stops for good.
+  if (is_ok && merge->is_source_done) {
+    mergeRemoveSource(bc, source);
+    merge->sources_next++;
+  }
+
+  merge->is_failed = merge->is_failed || !is_ok;
+  merge->moves_len = 0;
+  merge->is_source_done = false;
+  atomic_store_explicit((_Atomic bool *)&merge->is_ready, false, memory_order_relaxed);
+  pthread_cond_signal(&merge->wake);
+  pthread_mutex_unlock(&merge->lock);
+}
+
+private void mergeRemoveSource(BcHandle *bc, MergeSource source) {
+  // A snapshot referring to the source would be ignored anyway, it is removed to save the check.
+  char snapshot_path[PATH_MAX];
+  if (getSnapshotPath(bc, snapshot_path)) unlink(snapshot_path);
+
+  // Concurrent readers may still be reading the source, its descriptor and mapping are closed once
+  // they are done. Should that not be recorded, they are kept until bc_close.
+  BcFile *file = bc->file_table.files + source.file_id;
+  if (!bc->options.concurrent_reads) {
+    closeFileFd(bc, source.file_id);
+    if (file->map != NULL) munmap(file->map, file->map_len);
+    file->map = NULL;
+    file->map_len = 0;
+  } else {
+    retireFile(bc, source.file_id);
+  }
+
+  file->stats = (FileStats){0};
+  file->is_removed = true;
+
+  char hint_path[PATH_MAX];
+  getHintPath(hint_path, file->path);
+  unlink(hint_path);
+  unlink(file->path);
+}
+
+// Counts a concurrent reader in, once the parity it counted itself under is still the current one.
+// A reader that saw the epoch before the writer flipped it is thereby seen by the writer.
+u64 readEnter(BcHandle *bc) {
+  ReadEpoch *epoch = &bc->merge->epoch;
+
+  while (true) {
+    u64 current = atomic_load((_Atomic u64 *)&epoch->epoch);
+    atomic_fetch_add((_Atomic i64 *)&epoch->readers[current & 1], 1);
+    if (atomic_load((_Atomic u64 *)&epoch->epoch) == current) return current;
+
+    atomic_fetch_sub((_Atomic i64 *)&epoch->readers[current & 1], 1);
+  }
+}
+
+void readExit(BcHandle *bc, u64 epoch) {
+  atomic_fetch_sub_explicit((_Atomic i64 *)&bc->merge->epoch.readers[epoch & 1], 1,
+                            memory_order_release);
+}
+
+// Takes a removed file out of the descriptor cache. Readers that looked it up before the keydir
+// was repointed still find its descriptor and mapping in the file table until retirePoll closes
+// them; readers entering from then on no longer look it up.
+private bool retireFile(BcHandle *bc, u32 file_id) {
+  ReadEpoch *epoch = &bc->merge->epoch;
+  FileTable *ft = &bc->file_table;
+  BcFile *file = ft->files + file_id;
+  if (file->fd == -1 && file->map == NULL) return true;
+
+  isize size = epoch->pending_len * sizeof(u32);
+  if (size + (isize)sizeof(u32) > epoch->pending_cap) {
+    isize cap = epoch->pending_cap == 0 ? MERGE_INIT_CAP : 2 * epoch->pending_cap;
+    u32 *pending = growMapping(epoch->pending, size, epoch->pending_cap, cap);
+    return_value_if(pending == NULL, false, ERR_OUT_OF_MEMORY);
+    epoch->pending = pending;
+    epoch->pending_cap = cap;
+  }
+
+  epoch->pending[epoch->pending_len++] = file_id;
+  if (file->fd != -1) {
+    lruUnlink(ft, file_id);
+    ft->open_fds--;
+  }
+
+  return true;
+}
+
+// Called by the writer before every put and batch. Closes the waiting files once the readers of
+// the previous epoch are gone, and then starts a new epoch for the pending ones.
+private void retirePoll(BcHandle *bc) {
+  ReadEpoch *epoch = &bc->merge->epoch;
+
+  if (epoch->waiting_len > 0) {
+    u64 previous = epoch->epoch - 1;
+    if (atomic_load((_Atomic i64 *)&epoch->readers[previous & 1]) > 0) return;
+
+    retireFree(bc, epoch->waiting, epoch->waiting_len);
+    epoch->waiting_len = 0;
+  }
+
+  if (epoch->pending_len == 0) return;
+
+  u32 *waiting = epoch->waiting;
+  isize waiting_cap = epoch->waiting_cap;
+  epoch->waiting = epoch->pending;
+  epoch->waiting_len = epoch->pending_len;
+  epoch->waiting_cap = epoch->pending_cap;
+  epoch->pending = waiting;
+  epoch->pending_len = 0;
+  epoch->pending_cap = waiting_cap;
+
+  atomic_fetch_add((_Atomic u64 *)&epoch->epoch, 1);
+}
+
+private void retireFree(BcHandle *bc, u32 *file_ids, isize len) {
+  for (isize i = 0; i < len; i++) {
+    BcFile *file = bc->file_table.files + file_ids[i];
+    if (file->fd != -1) close(file->fd);
+    if (file->map != NULL) munmap(file->map, file->map_len);
+    file->fd = -1;
+    file->map = NULL;
+    file->map_len = 0;
+  }
+}
+
+private void *mergeWorker(void *arg) {
+  BackgroundMerge *merge = arg;
+
+  pthread_mutex_lock(&merge->lock);
+  while (true) {
+    while (!merge->is_stopping && !merge->is_failed &&
+           (merge->key_dir == NULL || merge->is_ready ||
+            merge->sources_len - merge->sources_next <= merge->keep_files)) {
+      pthread_cond_wait(&merge->wake, &merge->lock);
+    }
+    if (merge->is_stopping || merge->is_failed) break;
+
+    MergeSource source = merge->sources[merge->sources_next];
+    HashTable *key_dir = merge->key_dir;
+    pthread_mutex_unlock(&merge->lock);
+
+    bool is_ok = mergeStep(merge, source, key_dir);
+
+    pthread_mutex_lock(&merge->lock);
+    merge->is_failed = !is_ok;
+    if (is_ok && (merge->moves_len > 0 || merge->is_source_done)) {
+      atomic_store_explicit((_Atomic bool *)&merge->is_ready, true, memory_order_release);
+    }
+  }
+  pthread_mutex_unlock(&merge->lock);
+
+  if (merge->source_fd != -1) close(merge->source_fd);
+  merge->source_fd = -1;
+  if (merge->out_fd != -1) mergeSeal(merge);
+
+  return NULL;
+}
+
+// Copies the records of the next step_size bytes of the source that the keydir points to. A record
+// larger than that is read whole. The copies are synced before the writer may repoint the keydir.
+private bool mergeStep(BackgroundMerge *merge, MergeSource source, HashTable *key_dir) {
+  if (merge->source_fd == -1) {
+    char source_path[PATH_MAX];
+    getFilePath(source_path, merge->data_dir_path, BIN_EXT, source.num);
+
+    merge->source_fd = open(source_path, O_RDONLY | O_CLOEXEC);
+    return_value_if(merge->source_fd == -1, false, ERR_ACCESS);
+    posix_fadvise(merge->source_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct stat st;
+    i8 res = fstat(merge->source_fd, &st);
+    return_value_if(res == -1, false, ERR_ACCESS);
+
+    merge->source_pos = 0;
+    merge->source_len = st.st_size;
+  }
+
+  merge->throttle_start_ns = getMonotonicNs();
+  merge->throttle_bytes = 0;
+
+  isize len = merge->source_len - merge->source_pos;
+  if (len > merge->step_size) len = merge->step_size;
+
+  isize pos = 0;
+  isize buffer_len = 0;
+  while (pos + (isize)HEADER_SIZE <= len) {
+    if (buffer_len < len) {
+      if (len > merge->buffer_cap) {
+        char *buffer = growMapping(merge->buffer, 0, merge->buffer_cap, len);
+        return_value_if(buffer == NULL, false, ERR_OUT_OF_MEMORY);
+        merge->buffer = buffer;
+        merge->buffer_cap = len;
+      }
+
+      isize bytes_read = readAt(merge->source_fd, merge->buffer, len, merge->source_pos);
+      return_value_if(bytes_read < len, false, ERR_ACCESS);
+      buffer_len = len;
+      if (!mergeThrottle(merge, len)) break;
+    }
+
+    char *record = merge->buffer + pos;
+    Header header = decodeHeader(record);
+
+    // Batches only matter for recovery, the keydir points to their records like to any other.
+    if (header.key_len == BATCH_MARKER) {
+      pos += sizeof(BatchHeader);
+      continue;
+    }
+
+    if (header.key_len < 0 || header.val_len < 0 ||
+        header.key_len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - header.val_len) {
+      break;
+    }
+    isize record_len = HEADER_SIZE + sizeof(u64) + header.key_len + header.val_len;
+
+    if (pos + record_len > len) {
+      if (pos > 0 || record_len > merge->source_len - merge->source_pos) break;
+      len = record_len;
+      continue;
+    }
+
+    s8 key = {.data = record + KEY_OFFSET, .len = header.key_len};
+    KeyDirEntry kd_entry;
+    bool is_live = ht_get_shared(key_dir, key, &kd_entry) && kd_entry.file_id == source.file_id &&
+                   kd_entry.val_pos == merge->source_pos + pos;
+    if (is_live) {
+      bool out = mergeCopy(merge, record, record_len, header);
+      return_value_if(!out, false, ERR_ACCESS);
+
+      merge->moves[merge->moves_len - 1].old_pos = merge->source_pos + pos;
+      if (!mergeThrottle(merge, record_len)) break;
+    }
+
+    pos += record_len;
+  }
+
+  // Stopped while throttled: the copies of the step are left unused, the source is not advanced.
+  if (merge->is_stopping) {
+    merge->moves_len = 0;
+    return true;
+  }
+
+  // Whatever follows the last complete record was cut short by a crash and is dropped. What was
+  // merged is not needed in the page cache any more.
+  if (pos > 0) posix_fadvise(merge->source_fd, merge->source_pos, pos, POSIX_FADV_DONTNEED);
+  merge->source_pos += pos;
+  merge->is_source_done = pos == 0 || merge->source_pos >= merge->source_len;
+  if (merge->is_source_done) {
+    close(merge->source_fd);
+    merge->source_fd = -1;
+  }
+
+  if (merge->moves_len > 0) {
+    i8 res = fdatasync(merge->out_fd);
+    return_value_if(res == -1, false, ERR_ACCESS);
+    posix_fadvise(merge->out_fd, 0, 0, POSIX_FADV_DONTNEED);
+    merge->moves_num = merge->out_num;
+  }
+
+  if (merge->out_fd != -1 && merge->out_cursor >= merge->max_file_size) {
+    bool out = mergeSeal(merge);
+    return_value_if(!out, false, ERR_ACCESS);
+  }
+
+  return true;
+}
+
+// Appends a live record to the merged file being written, starting a new one if there is none,
+// and adds its move with everything but old_pos filled in.
+private bool mergeCopy(BackgroundMerge *merge, char *record, isize record_len, Header header) {
+  if (merge->out_fd == -1) {
+    return_value_if(merge->out_num >= UINT32_MAX, false, ERR_ARITHEMATIC_OVERFLOW);
+
+    char out_path[PATH_MAX];
+    getFilePath(out_path, merge->merged_dir_path, MERGED_EXT, merge->out_num + 1);
+
+    merge->out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return_value_if(merge->out_fd == -1, false, ERR_ACCESS);
+    merge->out_num++;
+    merge->out_cursor = 0;
+  }
+
+  // A record of a corrupt source is not copied, the merge stops with the source still in place.
+  return_value_if(!isRecordValid(record, record_len), false, ERR_CRC_FAILED);
+
+  bool out = writeAll(merge->out_fd, record, record_len);
+  return_value_if(!out, false, ERR_ACCESS);
+
+  isize size = merge->moves_len * sizeof(MergeMove);
+  if (size + (isize)sizeof(MergeMove) > merge->moves_cap) {
+    isize cap = merge->moves_cap == 0 ? MERGE_INIT_CAP : 2 * merge->moves_cap;
+    MergeMove *moves = growMapping(merge->moves, size, merge->moves_cap, cap);
+    return_value_if(moves == NULL, false, ERR_OUT_OF_MEMORY);
+    merge->moves = moves;
+    merge->moves_cap = cap;
+  }
+
+  s8 key = {.data = record + KEY_OFFSET, .len = header.key_len};
+  u64 key_hash = ht_hash(key);
+  KeyDirEntry kd_entry = {
+      .val_pos = merge->out_cursor,
+      .val_len = header.val_len,
+      .timestamp = header.timestamp,
+  };
+  hintAdd(&merge->hint, key, key_hash, kd_entry);
+
+  merge->moves[merge->moves_len++] = (MergeMove){
+      .key = key,
+      .hash = key_hash,
+      .timestamp = header.timestamp,
+      .val_len = header.val_len,
+      .new_pos = merge->out_cursor,
+  };
+  merge->out_cursor += record_len;
+
+  return true;
+}
+
+// Closes the merged file being written and writes its hint.
+private bool mergeSeal(BackgroundMerge *merge) {
+  i8 res = close(merge->out_fd);
+  merge->out_fd = -1;
+  return_value_if(res == -1, false, ERR_ACCESS);
+
+  // Failing to write the hint only makes the next bc_open scan the merged file.
+  char hint_path[PATH_MAX];
+  getFilePath(hint_path, merge->hint_dir_path, HINT_EXT, merge->out_num);
+  hintWrite(&merge->hint, hint_path, merge->out_cursor);
+
+  return true;
+}
+
+// Waits for as long as it takes to keep the bytes moved by the current step under rate_limit.
+// Returns false if the handle is being closed meanwhile.
+private bool mergeThrottle(BackgroundMerge *merge, isize bytes) {
+  if (merge->rate_limit <= 0) return true;
+  merge->throttle_bytes += bytes;
+
+  i64 due_ns = merge->throttle_start_ns + (i64)(merge->throttle_bytes * 1e9 / merge->rate_limit);
+  struct timespec due = {.tv_sec = due_ns / 1000000000, .tv_nsec = due_ns % 1000000000};
+
+  pthread_mutex_lock(&merge->lock);
+  while (!merge->is_stopping && getMonotonicNs() < due_ns) {
+    pthread_cond_timedwait(&merge->wake, &merge->lock, &due);
+  }
+  bool is_stopping = merge->is_stopping;
+  pthread_mutex_unlock(&merge->lock);
+
+  return !is_stopping;
+}
@@ -0,0 +1,409 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+#define _GNU_SOURCE
+
+#include "bitcask.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "crc.h"
+#include "ht.h"
+#include "internal.h"
+#include "utils.h"
+
+private bool scrubQuarantine(BcHandle *bc, s8 key, ScrubFinding finding);
+private bool isFindingLive(BcHandle *bc, s8 key, ScrubFinding finding);
+private void *scrubWorker(void *arg);
+private bool scrubFile(Scrubber *scrub, ScrubFile *file);
+private void scrubReport(Scrubber *scrub, ScrubFile *file, isize pos, char *key, isize key_len);
+private bool scrubWait(Scrubber *scrub, i64 due_ns);
+
+#define SCRUB_READ_SIZE ((isize)1 << 20)
+#define SCRUB_ALIGN 4096
+#define SCRUB_MIN_PASS_NS 1000000000
+#define SCRUB_INIT_CAP ((isize)1 << 16)
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE (3 << 13)
+
+// Starts the scrubber on every sealed file bc_open found. Merged files the background merge writes
+// are only scrubbed once the handle is opened again.
+bool scrubStart(BcHandle *bc) {
+  Scrubber *scrub = new (&bc->arena, Scrubber);
+  return_value_if(scrub == NULL, false, ERR_OUT_OF_MEMORY);
+
+  scrub->rate_limit = bc->options.scrub_rate_limit;
+  scrub->is_quarantine = bc->options.read_write && bc->options.scrub_quarantine;
+
+  for (u32 i = 0; i < bc->file_table.len; i++) {
+    BcFile *file = bc->file_table.files + i;
+    if (file->is_removed || i == bc->active_file_id) continue;
+
+    bool out = scrubAddFile(scrub, i, file->path);
+    return_value_if(!out, false, ERR_OUT_OF_MEMORY);
+  }
+
+  // Waits between passes are timed against CLOCK_MONOTONIC, so that bc_close cuts them short.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+  pthread_mutex_init(&scrub->lock, NULL);
+  pthread_cond_init(&scrub->wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  i8 res = pthread_create(&scrub->thread, NULL, scrubWorker, scrub);
+  if (res != 0) {
+    pthread_mutex_destroy(&scrub->lock);
+    pthread_cond_destroy(&scrub->wake);
+  }
+  return_value_if(res != 0, false, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  bc->scrub = scrub;
+  return true;
+}
+
+// Stops the thread and deletes the keys of the corrupt records it left, so that none is missed.
+void scrubStop(BcHandle *bc) {
+  Scrubber *scrub = bc->scrub;
+
+  pthread_mutex_lock(&scrub->lock);
+  scrub->is_stopping = true;
+  pthread_cond_signal(&scrub->wake);
+  pthread_mutex_unlock(&scrub->lock);
+
+  pthread_join(scrub->thread, NULL);
+  scrubPoll(bc);
+
+  pthread_mutex_destroy(&scrub->lock);
+  pthread_cond_destroy(&scrub->wake);
+
+  if (scrub->files != NULL) munmap(scrub->files, scrub->files_cap);
+  if (scrub->found != NULL) munmap(scrub->found, scrub->found_cap);
+  if (scrub->keys != NULL) munmap(scrub->keys, scrub->keys_cap);
+  if (scrub->buffer != NULL) munmap(scrub->buffer, scrub->buffer_cap);
+  bc->scrub = NULL;
+}
+
+bool scrubAddFile(Scrubber *scrub, u32 file_id, char *path) {
+  bool is_ok = true;
+  pthread_mutex_lock(&scrub->lock);
+
+  isize size = scrub->files_len * sizeof(ScrubFile);
+  if (size + (isize)sizeof(ScrubFile) > scrub->files_cap) {
+    isize cap = scrub->files_cap == 0 ? SCRUB_INIT_CAP : 2 * scrub->files_cap;
+    ScrubFile *files = growMapping(scrub->files, size, scrub->files_cap, cap);
+    is_ok = files != NULL;
+    if (is_ok) {
+      scrub->files = files;
+      scrub->files_cap = cap;
+    }
+  }
+
+  if (is_ok) {
+    ScrubFile *file = scrub->files + scrub->files_len++;
+    file->file_id = file_id;
+    memcpy(file->path, path, PATH_MAX);
+    pthread_cond_signal(&scrub->wake);
+  }
+
+  pthread_mutex_unlock(&scrub->lock);
+  return_value_if(!is_ok, false, ERR_OUT_OF_MEMORY);
+
+  return true;
+}
+
+// Called before every put, delete and batch, ahead of write_lock. The corrupt records found so far
+// are taken over in one go, the thread starts new lists meanwhile. Their tombstones are appended
+// like those of bc_delete, under write_lock and synced along with the group they join.
+void scrubPoll(BcHandle *bc) {
+  Scrubber *scrub = bc->scrub;
+  if (atomic_load_explicit((_Atomic isize *)&scrub->found_len, memory_order_relaxed) == 0) return;
+
+  pthread_mutex_lock(&scrub->lock);
+  ScrubFinding *found = scrub->found;
+  isize found_len = scrub->found_len;
+  isize found_cap = scrub->found_cap;
+  char *keys = scrub->keys;
+  isize keys_cap = scrub->keys_cap;
+
+  scrub->found = NULL;
+  scrub->found_len = 0;
+  scrub->found_cap = 0;
+  scrub->keys = NULL;
+  scrub->keys_len = 0;
+  scrub->keys_cap = 0;
+  pthread_mutex_unlock(&scrub->lock);
+
+  isize quarantined = 0;
+  for (isize i = 0; i < found_len; i++) {
+    s8 key = {.data = keys + found[i].key_off, .len = found[i].key_len};
+    if (scrubQuarantine(bc, key, found[i])) quarantined++;
+  }
+
+  pthread_mutex_lock(&scrub->lock);
+  scrub->stats.quarantined += quarantined;
+  pthread_mutex_unlock(&scrub->lock);
+
+  if (found != NULL) munmap(found, found_cap);
+  if (keys != NULL) munmap(keys, keys_cap);
+}
+
+// Deletes key, as bc_delete would, if the keydir still points to the corrupt record found.
+private bool scrubQuarantine(BcHandle *bc, s8 key, ScrubFinding finding) {
+  GroupCommit *commit = bc->commit;
+  if (commit == NULL) {
+    bool out = isFindingLive(bc, key, finding) && appendEntry(bc, key, s8("🪦"));
+    if (out && bc->options.sync_on_put) out = syncActiveFile(bc);
+    return out;
+  }
+
+  i64 start_ns = getMonotonicNs();
+
+  pthread_mutex_lock(&commit->write_lock);
+  bool out = isFindingLive(bc, key, finding) && appendEntry(bc, key, s8("🪦"));
+  i64 seq = out ? commitAppended(commit) : 0;
+  pthread_mutex_unlock(&commit->write_lock);
+
+  return out && commitWait(commit, seq, start_ns);
+}
+
+private bool isFindingLive(BcHandle *bc, s8 key, ScrubFinding finding) {
+  KeyDirEntry *kd_entry = ht_get(&bc->key_dir, key);
+  return kd_entry != NULL && kd_entry->file_id == finding.file_id &&
+         kd_entry->val_pos == finding.pos;
+}
+
+// Goes over the files in the order they were handed over, starting again at the first once done.
+// A pass takes at least SCRUB_MIN_PASS_NS, so that a few small files are not read back to back.
+private void *scrubWorker(void *arg) {
+  Scrubber *scrub = arg;
+
+  // Failing to lower its priority only makes the scrubber compete with the readers and the writer.
+  setpriority(PRIO_PROCESS, gettid(), 19);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE);
+
+  i64 pass_start_ns = getMonotonicNs();
+  scrub->throttle_start_ns = pass_start_ns;
+
+  pthread_mutex_lock(&scrub->lock);
+  for (isize i = 0; true; i++) {
+    while (!scrub->is_stopping && scrub->files_len == 0) {
+      pthread_cond_wait(&scrub->wake, &scrub->lock);
+    }
+    if (scrub->is_stopping) break;
+
+    if (i >= scrub->files_len) {
+      scrub->stats.passes++;
+      pthread_mutex_unlock(&scrub->lock);
+
+      bool out = scrubWait(scrub, pass_start_ns + SCRUB_MIN_PASS_NS);
+      pass_start_ns = getMonotonicNs();
+      scrub->throttle_start_ns = pass_start_ns;
+      scrub->throttle_bytes = 0;
+
+      pthread_mutex_lock(&scrub->lock);
+      if (!out) break;
+      i = -1;
+      continue;
+    }
+
+    ScrubFile file = scrub->files[i];
+    pthread_mutex_unlock(&scrub->lock);
+
+    bool is_present = scrubFile(scrub, &file);
+
+    pthread_mutex_lock(&scrub->lock);
+    scrub->stats.files += is_present;
+
+    // A file merged away meanwhile is dropped from the list.
+    if (!is_present) {
+      isize size = (scrub->files_len - i - 1) * sizeof(ScrubFile);
+      memmove(scrub->files + i, scrub->files + i + 1, size);
+      scrub->files_len--;
+      i--;
+    }
+  }
+  pthread_mutex_unlock(&scrub->lock);
+
+  return NULL;
+}
+
+// Checks the CRC of every record of the file, reading it SCRUB_READ_SIZE bytes at a time from
+// SCRUB_ALIGN aligned offsets, as O_DIRECT needs. A header whose lengths cannot be right means
+// nothing after it can be found, so it ends the file. Returns false if the file is gone.
+private bool scrubFile(Scrubber *scrub, ScrubFile *file) {
+  int fd = open(file->path, O_RDONLY | O_CLOEXEC | O_DIRECT);
+  if (fd == -1 && errno == EINVAL) fd = open(file->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return errno != ENOENT;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return true;
+  }
+
+  // buffer holds len bytes of the file from buffer_pos on.
+  isize buffer_pos = 0;
+  isize len = 0;
+  isize pos = 0;
+  isize records = 0;
+  isize bytes = 0;
+
+  while (pos < st.st_size) {
+    isize offset = pos - buffer_pos;
+    isize need = HEADER_SIZE;
+    bool is_batch = false;
+
+    if (offset + HEADER_SIZE <= len) {
+      Header header = decodeHeader(scrub->buffer + offset);
+      is_batch = header.key_len == BATCH_MARKER;
+
+      if (is_batch) {
+        need = sizeof(BatchHeader);
+      } else if (header.key_len < 0 || header.val_len < 0 ||
+                 header.key_len >= PTRDIFF_MAX - HEADER_SIZE - sizeof(u64) - header.val_len) {
+        need = -1;
+      } else {
+        need = HEADER_SIZE + sizeof(u64) + header.key_len + header.val_len;
+      }
+
+      if (need == -1 || need > st.st_size - pos) {
+        scrubReport(scrub, file, pos, NULL, 0);
+        break;
+      }
+    }
+
+    if (offset + need > len) {
+      buffer_pos = pos & ~(isize)(SCRUB_ALIGN - 1);
+      offset = pos - buffer_pos;
+
+      isize cap = SCRUB_READ_SIZE;
+      while (cap < offset + need) cap *= 2;
+      if (cap > scrub->buffer_cap) {
+        if (scrub->buffer != NULL) munmap(scrub->buffer, scrub->buffer_cap);
+        scrub->buffer = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        scrub->buffer_cap = scrub->buffer == MAP_FAILED ? 0 : cap;
+        if (scrub->buffer == MAP_FAILED) scrub->buffer = NULL;
+        if (scrub->buffer == NULL) break;
+      }
+
+      len = readAt(fd, scrub->buffer, scrub->buffer_cap, buffer_pos);
+      if (len < offset + need) break;
+
+      bytes += len;
+      scrub->throttle_bytes += len;
+      i64 due_ns = (i64)(scrub->throttle_bytes * 1e9 / scrub->rate_limit);
+      if (!scrubWait(scrub, scrub->throttle_start_ns + due_ns)) break;
+      continue;
+    }
+
+    char *record = scrub->buffer + offset;
+    if (is_batch) {
+      BatchHeader batch_header;
+      memcpy(&batch_header, record, sizeof(BatchHeader));
+      if (crc_64(0, &batch_header, offsetof(BatchHeader, crc)) != batch_header.crc) {
+        scrubReport(scrub, file, pos, NULL, 0);
+      }
+    } else {
+      isize key_len = decodeHeader(record).key_len;
+      if (!isRecordValid(record, need)) scrubReport(scrub, file, pos, record + KEY_OFFSET, key_len);
+      records++;
+    }
+
+    pos += need;
+  }
+
+  close(fd);
+
+  pthread_mutex_lock(&scrub->lock);
+  scrub->stats.bytes += bytes;
+  scrub->stats.records += records;
+  pthread_mutex_unlock(&scrub->lock);
+
+  return true;
+}
+
+private void scrubReport(Scrubber *scrub, ScrubFile *file, isize pos, char *key, isize key_len) {
+  fprintf(stderr, "%s:%td : %s", file->path, pos, ERR_CORRUPT_RECORD);
+
+  pthread_mutex_lock(&scrub->lock);
+  scrub->stats.corrupt++;
+
+  // Without a key there is nothing the keydir could be asked about.
+  isize size = scrub->found_len * sizeof(ScrubFinding);
+  bool is_kept = scrub->is_quarantine && key != NULL;
+  if (is_kept && size + (isize)sizeof(ScrubFinding) > scrub->found_cap) {
+    isize cap = scrub->found_cap == 0 ? SCRUB_INIT_CAP : 2 * scrub->found_cap;
+    ScrubFinding *found = growMapping(scrub->found, size, scrub->found_cap, cap);
+    is_kept = found != NULL;
+    if (is_kept) {
+      scrub->found = found;
+      scrub->found_cap = cap;
+    }
+  }
+
+  if (is_kept && scrub->keys_len + key_len > scrub->keys_cap) {
+    isize cap = scrub->keys_cap == 0 ? SCRUB_INIT_CAP : 2 * scrub->keys_cap;
+    while (cap < scrub->keys_len + key_len) cap *= 2;
+    char *keys = growMapping(scrub->keys, scrub->keys_len, scrub->keys_cap, cap);
+    is_kept = keys != NULL;
+    if (is_kept) {
+      scrub->keys = keys;
+      scrub->keys_cap = cap;
+    }
+  }
+
+  if (is_kept) {
+    memcpy(scrub->keys + scrub->keys_len, key, key_len);
+    scrub->found[scrub->found_len++] = (ScrubFinding){
+        .file_id = file->file_id,
+        .pos = pos,
+        .key_off = scrub->keys_len,
+        .key_len = key_len,
+    };
+    scrub->keys_len += key_len;
+  }
+
+  pthread_mutex_unlock(&scrub->lock);
+}
+
+// Waits until due_ns, returning false if the handle is being closed meanwhile.
+private bool scrubWait(Scrubber *scrub, i64 due_ns) {
+  struct timespec due = {.tv_sec = due_ns / 1000000000, .tv_nsec = due_ns % 1000000000};
+
+  pthread_mutex_lock(&scrub->lock);
+  while (!scrub->is_stopping && getMonotonicNs() < due_ns) {
+    pthread_cond_timedwait(&scrub->wake, &scrub->lock, &due);
+  }
+  bool is_stopping = scrub->is_stopping;
+  pthread_mutex_unlock(&scrub->lock);
+
+  return !is_stopping;
+}
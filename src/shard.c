@@ -0,0 +1,251 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+
+#include "shard.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "ht.h"
+#include "utils.h"
+
+#define SHARD_COUNT_FILE "shards"
+
+typedef struct {
+  BcShard *shard;
+  Arena arena;
+  char *path;
+  Options options;
+  bool (*op)(BcHandle *bc);
+  bool is_ok;
+} ShardTask;
+
+private isize readShardCount(char *dir_path);
+private bool writeShardCount(char *dir_path, isize shard_count);
+private BcShard *route(BcSharded *sh, s8 key);
+private void *openShard(void *arg);
+private void *runShardOp(void *arg);
+private bool runShards(ShardTask *tasks, isize len, void *(*fn)(void *));
+private bool eachShard(BcSharded *sh, bool (*op)(BcHandle *bc));
+
+BcShardedResult bc_sharded_open(Arena arena, s8 dir_path, isize shard_count, Options options) {
+  BcShardedResult sh_res = {.sh = {0}, .is_ok = false};
+  BcSharded *sh = &sh_res.sh;
+
+  i8 res = mkdir(dir_path.data, 0700);
+  return_value_if(res == -1 && errno != EEXIST, sh_res, ERR_ACCESS);
+
+  // The count is written before any shard exists, so that no key is ever routed by another one.
+  isize stored_count = readShardCount(dir_path.data);
+  if (stored_count == 0) {
+    return_value_if(shard_count <= 0 || shard_count > SHARD_MAX_COUNT, sh_res, ERR_SHARD_COUNT);
+    bool out = writeShardCount(dir_path.data, shard_count);
+    return_value_if(!out, sh_res, ERR_ACCESS);
+    stored_count = shard_count;
+  }
+  return_value_if(stored_count == -1, sh_res, ERR_ACCESS);
+  return_value_if(shard_count > 0 && shard_count != stored_count, sh_res, ERR_SHARD_COUNT);
+
+  sh->len = stored_count;
+  sh->is_shared_read = options.concurrent_reads;
+  sh->shards = new (&arena, BcShard, sh->len);
+  ShardTask *tasks = new (&arena, ShardTask, sh->len);
+  return_value_if(sh->shards == NULL || tasks == NULL, sh_res, ERR_OUT_OF_MEMORY);
+
+  // Every shard recovers on its own thread, so they split the recovery threads between them.
+  if (options.recovery_threads <= 0) {
+    options.recovery_threads = sysconf(_SC_NPROCESSORS_ONLN) / sh->len;
+    if (options.recovery_threads <= 0) options.recovery_threads = 1;
+  }
+
+  for (isize i = 0; i < sh->len; i++) {
+    tasks[i] = (ShardTask){.shard = sh->shards + i, .options = options};
+    tasks[i].path = new (&arena, char, PATH_MAX, NOZERO);
+    return_value_if(tasks[i].path == NULL, sh_res, ERR_OUT_OF_MEMORY);
+  }
+
+  isize arena_share = (arena.end - arena.beg) / sh->len & ~(isize)63;
+  for (isize i = 0; i < sh->len; i++) {
+    ShardTask *task = tasks + i;
+    char *beg = arena.beg + i * arena_share;
+    task->arena = (Arena){.beg = beg, .end = beg + arena_share};
+
+    int len = snprintf(task->path, PATH_MAX, "%s/shard-%03td", dir_path.data, i);
+    return_value_if(len < 0 || len >= PATH_MAX, sh_res, ERR_ARITHEMATIC_OVERFLOW);
+
+    pthread_mutex_init(&sh->shards[i].lock, NULL);
+  }
+
+  sh_res.is_ok = runShards(tasks, sh->len, openShard);
+  if (!sh_res.is_ok) {
+    for (isize i = 0; i < sh->len; i++) {
+      if (tasks[i].is_ok) bc_close(&sh->shards[i].bc);
+    }
+  }
+  return_value_if(!sh_res.is_ok, sh_res, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  return sh_res;
+}
+
+void bc_sharded_close(BcSharded *sh) {
+  for (isize i = 0; i < sh->len; i++) {
+    bc_close(&sh->shards[i].bc);
+    pthread_mutex_destroy(&sh->shards[i].lock);
+  }
+}
+
+s8 bc_sharded_get(BcSharded *sh, s8 key, Arena *scratch) {
+  BcShard *shard = route(sh, key);
+  if (sh->is_shared_read) return bc_get(&shard->bc, key, scratch);
+
+  pthread_mutex_lock(&shard->lock);
+  s8 val = bc_get(&shard->bc, key, scratch);
+  pthread_mutex_unlock(&shard->lock);
+
+  return val;
+}
+
+bool bc_sharded_put(BcSharded *sh, s8 key, s8 val) {
+  BcShard *shard = route(sh, key);
+
+  pthread_mutex_lock(&shard->lock);
+  bool out = bc_put(&shard->bc, key, val);
+  pthread_mutex_unlock(&shard->lock);
+
+  return out;
+}
+
+bool bc_sharded_delete(BcSharded *sh, s8 key) {
+  BcShard *shard = route(sh, key);
+
+  pthread_mutex_lock(&shard->lock);
+  bool out = bc_delete(&shard->bc, key);
+  pthread_mutex_unlock(&shard->lock);
+
+  return out;
+}
+
+bool bc_sharded_merge(BcSharded *sh) { return eachShard(sh, bc_merge); }
+
+bool bc_sharded_sync(BcSharded *sh) { return eachShard(sh, bc_sync); }
+
+// The top bits of the hash pick the shard, the keydir of each shard indexes by the lower ones.
+private BcShard *route(BcSharded *sh, s8 key) {
+  u64 hash = ht_hash(key);
+  return sh->shards + (((hash >> 32) * sh->len) >> 32);
+}
+
+// Returns 0 when the store has no shard count yet, and -1 when it cannot be read.
+private isize readShardCount(char *dir_path) {
+  char path[PATH_MAX];
+  int len = snprintf(path, PATH_MAX, "%s/%s", dir_path, SHARD_COUNT_FILE);
+  return_value_if(len < 0 || len >= PATH_MAX, -1, ERR_ARITHEMATIC_OVERFLOW);
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT) return 0;
+  return_value_if(fd == -1, -1, ERR_ACCESS);
+
+  char buffer[32] = {0};
+  isize bytes_read = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  return_value_if(bytes_read <= 0, -1, ERR_ACCESS);
+
+  char *end;
+  isize shard_count = strtol(buffer, &end, 10);
+  return_value_if(end == buffer || shard_count <= 0 || shard_count > SHARD_MAX_COUNT, -1,
+                  ERR_SHARD_COUNT);
+
+  return shard_count;
+}
+
+// Written to a temporary file that is renamed into place, so a crash never leaves half a count.
+private bool writeShardCount(char *dir_path, isize shard_count) {
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  int len = snprintf(path, PATH_MAX, "%s/%s", dir_path, SHARD_COUNT_FILE);
+  int tmp_len = snprintf(tmp_path, PATH_MAX, "%s/%s.tmp", dir_path, SHARD_COUNT_FILE);
+  return_value_if(len < 0 || tmp_len < 0 || tmp_len >= PATH_MAX, false, ERR_ARITHEMATIC_OVERFLOW);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  return_value_if(fd == -1, false, ERR_ACCESS);
+
+  char buffer[32];
+  len = snprintf(buffer, sizeof(buffer), "%td\n", shard_count);
+  bool is_ok = write(fd, buffer, len) == len && fsync(fd) == 0;
+  close(fd);
+  return_value_if(!is_ok, false, ERR_ACCESS);
+
+  i8 res = rename(tmp_path, path);
+  return_value_if(res == -1, false, ERR_ACCESS);
+
+  return true;
+}
+
+private void *openShard(void *arg) {
+  ShardTask *task = arg;
+
+  s8 path = {.data = task->path, .len = strlen(task->path)};
+  BcHandleResult bc_res = bc_open(task->arena, path, task->options);
+  task->shard->bc = bc_res.bc;
+  task->is_ok = bc_res.is_ok;
+
+  return NULL;
+}
+
+private void *runShardOp(void *arg) {
+  ShardTask *task = arg;
+
+  pthread_mutex_lock(&task->shard->lock);
+  task->is_ok = task->op(&task->shard->bc);
+  pthread_mutex_unlock(&task->shard->lock);
+
+  return NULL;
+}
+
+// Runs fn for every task on a thread of its own, or on the caller's thread if none can be started.
+private bool runShards(ShardTask *tasks, isize len, void *(*fn)(void *)) {
+  pthread_t threads[SHARD_MAX_COUNT];
+  bool is_started[SHARD_MAX_COUNT];
+
+  for (isize i = 0; i < len; i++) {
+    is_started[i] = pthread_create(threads + i, NULL, fn, tasks + i) == 0;
+    if (!is_started[i]) fn(tasks + i);
+  }
+
+  bool is_ok = true;
+  for (isize i = 0; i < len; i++) {
+    if (is_started[i]) pthread_join(threads[i], NULL);
+    is_ok = is_ok && tasks[i].is_ok;
+  }
+
+  return is_ok;
+}
+
+private bool eachShard(BcSharded *sh, bool (*op)(BcHandle *bc)) {
+  ShardTask tasks[SHARD_MAX_COUNT];
+  for (isize i = 0; i < sh->len; i++) tasks[i] = (ShardTask){.shard = sh->shards + i, .op = op};
+
+  return runShards(tasks, sh->len, runShardOp);
+}
@@ -0,0 +1,58 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+
+#pragma once
+
+#include <pthread.h>
+
+#include "bitcask.h"
+#include "s8.h"
+#include "utils.h"
+
+#define SHARD_MAX_COUNT 1024
+
+// One partition of a sharded store, a complete bitcask in its own directory. lock serializes the
+// operations on it, except the gets of a store opened with Options.concurrent_reads.
+typedef struct {
+  pthread_mutex_t lock;
+  BcHandle bc;
+} BcShard;
+
+// Keys are spread over len shards by their hash, so writers of keys in different shards never
+// wait for each other. The shard count is stored in the top directory when the store is created.
+typedef struct {
+  BcShard *shards;
+  isize len;
+  bool is_shared_read;
+} BcSharded;
+
+typedef struct {
+  BcSharded sh;
+  bool is_ok;
+} BcShardedResult;
+
+// Opens the store in dir_path, creating it with shard_count shards if it does not exist. Reopening
+// an existing store uses the count it was created with; shard_count must then be that count or
+// <= 0. The arena is divided evenly between the shards, which are opened by one thread each.
+BcShardedResult bc_sharded_open(Arena arena, s8 dir_path, isize shard_count, Options options);
+void bc_sharded_close(BcSharded *sh);
+s8 bc_sharded_get(BcSharded *sh, s8 key, Arena *scratch);
+bool bc_sharded_put(BcSharded *sh, s8 key, s8 val);
+bool bc_sharded_delete(BcSharded *sh, s8 key);
+// Merges and syncs every shard, each on its own thread.
+bool bc_sharded_merge(BcSharded *sh);
+bool bc_sharded_sync(BcSharded *sh);
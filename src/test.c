@@ -1,11 +1,30 @@
+#define _GNU_SOURCE
+
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "bitcask.h"
+#include "crc.h"
+#include "crc64speed.h"
+#include "shard.h"
 #include "utils.h"
 
+typedef struct {
+  BcHandle *bc;
+  Arena scratch;
+  atomic_bool *is_done;
+  isize failed;
+} Reader;
+
 private isize getRamSize(void);
+private void *readValues(void *arg);
+private isize getDeadBytes(BcHandle *bc, Arena scratch);
+private int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw);
 
 private isize getRamSize(void) {
     isize pages = sysconf(_SC_PHYS_PAGES);
@@ -19,15 +38,55 @@ private isize getRamSize(void) {
     return ram_size;
  }
 
+// Reads the first 5000 keys over and over until the writer is done, counting wrong values.
+private void *readValues(void *arg) {
+  Reader *reader = arg;
+
+  for (u32 i = 0; !atomic_load(reader->is_done); i = (i + 7) % 5000) {
+    char key[10];
+    char val[10];
+
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+
+    Arena scratch = reader->scratch;
+    s8 got = bc_get(reader->bc, (s8){.data = key, .len = key_len}, &scratch);
+    if (!s8cmp(got, (s8){.data = val, .len = val_len})) reader->failed++;
+  }
+
+  return NULL;
+}
+
+private isize getDeadBytes(BcHandle *bc, Arena scratch) {
+  isize len = bc_file_stats(bc, NULL, 0);
+  BcFileStats *stats = new (&scratch, BcFileStats, len);
+  bc_file_stats(bc, stats, len);
+
+  isize dead_bytes = 0;
+  for (isize i = 0; i < len; i++) dead_bytes += stats[i].stats.dead_bytes;
+
+  return dead_bytes;
+}
+
+private int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+  (void)st, (void)flag, (void)ftw;
+  return remove(path);
+}
+
 int main(void) {
   isize cap = getRamSize();
   char *heap = mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
   return_value_if(heap == MAP_FAILED, -1, ERR_OUT_OF_MEMORY);
 
-  Arena arena = {.beg = heap, .end = heap + cap};
+  // The handle keeps its own copy of the arena it is given, so the test must allocate from a
+  // separate region or it will overwrite the handle's keys.
+  Arena arena = {.beg = heap, .end = heap + cap / 2};
+  Arena bc_arena = {.beg = heap + cap / 2, .end = heap + cap};
 
   Options options = {.read_write = true, .sync_on_put = false, .max_file_size = 6000};
-  BcHandleResult bc_res = bc_open(arena, s8("./bitcask-test"), options);
+  // Every section starts from an empty directory, so that a rerun checks what a fresh run does.
+  nftw("./bitcask-test", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  BcHandleResult bc_res = bc_open(bc_arena, s8("./bitcask-test"), options);
   return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
 
   BcHandle bc = bc_res.bc;
@@ -57,9 +116,17 @@ int main(void) {
   }
 
   // Get value
-  s8 val = bc_get(&bc, s8("key4444"));
+  s8 val = bc_get(&bc, s8("key4444"), &arena);
   return_value_if(!s8cmp(val, s8("val4444")), -1, "values are not equal.\n");
 
+  // Get several values at once
+  s8 keys[] = {s8("key4999"), s8("key1"), s8("missing"), s8("key4444"), s8("key2")};
+  s8 vals[countof(keys)];
+  isize found = bc_multi_get(&bc, keys, vals, countof(keys), &arena);
+  return_value_if(found != 4 || !s8cmp(vals[0], s8("val4999")) || vals[2].len != -1 ||
+                      !s8cmp(vals[4], s8("val2")),
+                  -1, "values are not equal.\n");
+
   // Delete values
   for (u32 i = 0; i < 5000; i += 2) {
     char key[10];
@@ -76,17 +143,405 @@ int main(void) {
     bc_delete(&bc, str_key);
   }
 
-  // Merge values
+  // Merge values, which reclaims the overwritten and deleted ones
+  isize dead_bytes = getDeadBytes(&bc, arena);
   bc_merge(&bc);
+  return_value_if(getDeadBytes(&bc, arena) >= dead_bytes, -1, "merge reclaimed nothing.\n");
 
   bc_sync(&bc);
 
   // Get value
-  s8 val2 = bc_get(&bc, s8("key1"));
+  s8 val2 = bc_get(&bc, s8("key1"), &arena);
   return_value_if(!s8cmp(val2, s8("val1")), -1, "values are not equal.\n");
 
-  munmap(heap, cap);
   bc_close(&bc);
 
+  // Read from several threads while the writer overwrites keys and adds new ones, which rotates
+  // the active file and resizes the keydir under the readers.
+  nftw("./bitcask-test-concurrent", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  Options concurrent_options = options;
+  concurrent_options.concurrent_reads = true;
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-concurrent"), concurrent_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < 5000; i++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    bc_put(&bc_res.bc, (s8){.data = key, .len = key_len}, (s8){.data = val, .len = val_len});
+  }
+
+  atomic_bool is_done = false;
+  Reader readers[4];
+  pthread_t threads[countof(readers)];
+  for (isize i = 0; i < countof(readers); i++) {
+    isize scratch_len = 1 << 16;
+    char *scratch = new (&arena, char, scratch_len, NOZERO);
+    readers[i] = (Reader){.bc = &bc_res.bc, .is_done = &is_done};
+    readers[i].scratch = (Arena){.beg = scratch, .end = scratch + scratch_len};
+    pthread_create(&threads[i], NULL, readValues, &readers[i]);
+  }
+
+  for (u32 i = 0; i < 20000; i++) {
+    char key[10];
+    char val[10];
+
+    isize key_len = snprintf(key, 10, i < 5000 ? "key%u" : "new%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+
+    s8 str_key = {.data = new (&arena, char, key_len), .len = key_len};
+    memcpy(str_key.data, key, key_len);
+    bc_put(&bc_res.bc, str_key, (s8){.data = val, .len = val_len});
+  }
+
+  atomic_store(&is_done, true);
+  isize failed = 0;
+  for (isize i = 0; i < countof(readers); i++) {
+    pthread_join(threads[i], NULL);
+    failed += readers[i].failed;
+  }
+  return_value_if(failed != 0, -1, "concurrent reads returned wrong values.\n");
+
+  s8 keys2[] = {s8("new19999"), s8("key1"), s8("missing")};
+  s8 vals2[countof(keys2)];
+  found = bc_multi_get(&bc_res.bc, keys2, vals2, countof(keys2), &arena);
+  return_value_if(found != 2 || !s8cmp(vals2[0], s8("val19999")) || !s8cmp(vals2[1], s8("val1")),
+                  -1, "values are not equal.\n");
+  bc_close(&bc_res.bc);
+
+  // Sharded store, reopened without giving the shard count
+  isize sh_cap = (isize)1 << 28;
+  char *sh_heap = new (&arena, char, sh_cap, NOZERO);
+  Arena sh_arena = {.beg = sh_heap, .end = sh_heap + sh_cap};
+  nftw("./bitcask-test-sharded", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  BcShardedResult sh_res = bc_sharded_open(sh_arena, s8("./bitcask-test-sharded"), 4, options);
+  return_value_if(!sh_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < 1000; i++) {
+    char key[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    bc_sharded_put(&sh_res.sh, (s8){.data = key, .len = key_len}, s8("sharded"));
+  }
+  bc_sharded_delete(&sh_res.sh, s8("key1"));
+  bc_sharded_close(&sh_res.sh);
+
+  sh_res = bc_sharded_open(sh_arena, s8("./bitcask-test-sharded"), 0, options);
+  return_value_if(!sh_res.is_ok || sh_res.sh.len != 4, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  s8 val3 = bc_sharded_get(&sh_res.sh, s8("key999"), &arena);
+  s8 val4 = bc_sharded_get(&sh_res.sh, s8("key1"), &arena);
+  return_value_if(!s8cmp(val3, s8("sharded")) || val4.len != -1, -1, "values are not equal.\n");
+  bc_sharded_close(&sh_res.sh);
+
+  // Hardware checksums match the tables at every length and alignment
+  crc_init();
+  char crc_buffer[600];
+  for (isize i = 0; i < countof(crc_buffer); i++) crc_buffer[i] = (char)(i * 131 + 7);
+  for (isize len = 0; len <= 512; len++) {
+    for (isize off = 0; off < 8; off++) {
+      u64 crc = (u64)len * 0x9E3779B97F4A7C15;
+      return_value_if(crc_64(crc, crc_buffer + off, len) != crc64speed(crc, crc_buffer + off, len),
+                      -1, "checksums are not equal.\n");
+    }
+  }
+  return_value_if(crc_32c(0, "123456789", 9) != 0xE3069283, -1, "checksums are not equal.\n");
+
+  // Records with a CRC32C read back by a handle writing CRC-64 ones
+  Options crc_options = {.read_write = true, .max_file_size = 6000, .crc32c_records = true};
+  nftw("./bitcask-test-crc32c", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-crc32c"), crc_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+  bc_put(&bc_res.bc, s8("key1"), s8("crc32c"));
+  bc_close(&bc_res.bc);
+
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-crc32c"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+  bc_put(&bc_res.bc, s8("key2"), s8("crc64"));
+
+  s8 val6 = bc_get(&bc_res.bc, s8("key1"), &arena);
+  s8 val7 = bc_get(&bc_res.bc, s8("key2"), &arena);
+  return_value_if(!s8cmp(val6, s8("crc32c")) || !s8cmp(val7, s8("crc64")), -1,
+                  "values are not equal.\n");
+  bc_close(&bc_res.bc);
+
+  // Background merge of overwritten keys, checked after a reopen
+  Options merge_options = {.read_write = true, .max_file_size = 6000, .background_merge = true};
+  nftw("./bitcask-test-merge", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-merge"), merge_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < 20000; i++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", i % 1000);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    bc_put(&bc_res.bc, (s8){.data = key, .len = key_len}, (s8){.data = val, .len = val_len});
+  }
+  bc_close(&bc_res.bc);
+
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-merge"), merge_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  s8 val5 = bc_get(&bc_res.bc, s8("key123"), &arena);
+  return_value_if(!s8cmp(val5, s8("val19123")), -1, "values are not equal.\n");
+  bc_close(&bc_res.bc);
+
+  // Scrubber finding a record corrupted on disk and deleting its key
+  nftw("./bitcask-test-scrub", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-scrub"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < 1000; i++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    bc_put(&bc_res.bc, (s8){.data = key, .len = key_len}, (s8){.data = val, .len = val_len});
+  }
+  bc_close(&bc_res.bc);
+
+  // The value of the first record, key0, starts after its 24 byte header and 4 byte key.
+  FILE *data_file = fopen("./bitcask-test-scrub/data_files/00000001.bin", "r+b");
+  return_value_if(data_file == NULL, -1, ERR_ACCESS);
+  fseek(data_file, 24 + 4, SEEK_SET);
+  fputc('X', data_file);
+  fclose(data_file);
+
+  Options scrub_options = options;
+  scrub_options.verify_reads = BC_VERIFY_NEVER;
+  scrub_options.scrub_quarantine = true;
+  scrub_options.scrub_rate_limit = (isize)1 << 30;
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-scrub"), scrub_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (isize i = 0; i < 1000 && bc_scrub_stats(&bc_res.bc).corrupt == 0; i++) usleep(10000);
+  bc_put(&bc_res.bc, s8("key1000"), s8("val1000"));
+
+  s8 val8 = bc_get(&bc_res.bc, s8("key0"), &arena);
+  s8 val9 = bc_get(&bc_res.bc, s8("key1"), &arena);
+  return_value_if(val8.len != -1 || !s8cmp(val9, s8("val1")), -1, "corrupt record was kept.\n");
+  bc_close(&bc_res.bc);
+
+  // Streamed value larger than the write buffer, read back after a reopen, and a put cut short
+  nftw("./bitcask-test-stream", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-stream"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  isize blob_len = 3 << 20;
+  char chunk[1000];
+  BcPutStream put_stream;
+  bool out = bc_put_begin(&bc_res.bc, &put_stream, s8("blob"), blob_len);
+  for (isize pos = 0; out && pos < blob_len; pos += countof(chunk)) {
+    isize len = blob_len - pos < countof(chunk) ? blob_len - pos : countof(chunk);
+    for (isize i = 0; i < len; i++) chunk[i] = (char)((pos + i) * 31 >> 3);
+    out = bc_put_write(&put_stream, (s8){.data = chunk, .len = len});
+  }
+  return_value_if(!bc_put_end(&put_stream), -1, "streamed put failed.\n");
+
+  out = bc_put_begin(&bc_res.bc, &put_stream, s8("short"), 100);
+  return_value_if(!out || bc_put_end(&put_stream), -1, "short streamed put was kept.\n");
+  bc_put(&bc_res.bc, s8("key1"), s8("val1"));
+  bc_close(&bc_res.bc);
+
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-stream"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  BcGetStream get_stream;
+  out = bc_get_begin(&bc_res.bc, &get_stream, s8("blob"));
+  return_value_if(!out, -1, ERR_KEY_MISSING);
+
+  isize blob_pos = 0;
+  for (isize len; (len = bc_get_read(&get_stream, chunk, 700)) > 0; blob_pos += len) {
+    for (isize i = 0; i < len; i++) {
+      return_value_if(chunk[i] != (char)((blob_pos + i) * 31 >> 3), -1, "values are not equal.\n");
+    }
+  }
+  bc_get_end(&get_stream);
+  return_value_if(blob_pos != blob_len, -1, "values are not equal.\n");
+
+  s8 val10 = bc_get(&bc_res.bc, s8("key1"), &arena);
+  return_value_if(bc_get_begin(&bc_res.bc, &get_stream, s8("short")) || !s8cmp(val10, s8("val1")),
+                  -1, "short streamed put was kept.\n");
+  bc_close(&bc_res.bc);
+
+  // Batches read back after a reopen, and a batch cut short by a crash recovering none of it
+  Options batch_options = {.read_write = true};
+  nftw("./bitcask-test-batch", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-batch"), batch_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  bc_put(&bc_res.bc, s8("gone"), s8("val"));
+  BcBatch batch = bc_batch_create(&arena);
+  for (u32 i = 0; i < 100; i++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    bc_batch_put(&batch, (s8){.data = key, .len = key_len}, (s8){.data = val, .len = val_len});
+  }
+  bc_batch_delete(&batch, s8("gone"));
+  return_value_if(!bc_write_batch(&bc_res.bc, &batch), -1, "batch write failed.\n");
+  bc_close(&bc_res.bc);
+
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-batch"), batch_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  batch = bc_batch_create(&arena);
+  for (u32 i = 0; i < 100; i++) {
+    char key[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    bc_batch_put(&batch, (s8){.data = key, .len = key_len}, s8("torn"));
+  }
+  bc_batch_delete(&batch, s8("key1"));
+  return_value_if(!bc_write_batch(&bc_res.bc, &batch), -1, "batch write failed.\n");
+
+  char batch_path[PATH_MAX];
+  memcpy(batch_path, bc_res.bc.file_table.files[bc_res.bc.active_file_id].path, PATH_MAX);
+  bc_close(&bc_res.bc);
+
+  // Cut the last bytes of the second batch off, and drop the snapshot so that the file is replayed.
+  struct stat batch_stat;
+  return_value_if(stat(batch_path, &batch_stat) == -1, -1, ERR_ACCESS);
+  return_value_if(truncate(batch_path, batch_stat.st_size - 10) == -1, -1, ERR_ACCESS);
+  unlink("./bitcask-test-batch/keydir.snapshot");
+
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-batch"), batch_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < 100; i++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    s8 got = bc_get(&bc_res.bc, (s8){.data = key, .len = key_len}, &arena);
+    return_value_if(!s8cmp(got, (s8){.data = val, .len = val_len}), -1, "values are not equal.\n");
+  }
+  s8 val11 = bc_get(&bc_res.bc, s8("gone"), &arena);
+  return_value_if(val11.len != -1, -1, "deleted key was kept.\n");
+  bc_close(&bc_res.bc);
+
+  // Crash after a rotation wrote the hint of the sealed file but before the next file was created,
+  // which leaves the sealed file, hint and all, to become the active one again
+  nftw("./bitcask-test-hint", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  Options hint_options = {.read_write = true, .max_file_size = 6000};
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-hint"), hint_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  u32 hint_keys = 0;
+  for (u32 file_id = bc_res.bc.active_file_id; file_id == bc_res.bc.active_file_id; hint_keys++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", hint_keys);
+    isize val_len = snprintf(val, 10, "val%u", hint_keys);
+    bc_put(&bc_res.bc, (s8){.data = key, .len = key_len}, (s8){.data = val, .len = val_len});
+  }
+
+  // The last put went to the new file, which is removed along with the snapshot.
+  char hint_path[PATH_MAX];
+  memcpy(hint_path, bc_res.bc.file_table.files[bc_res.bc.active_file_id].path, PATH_MAX);
+  bc_close(&bc_res.bc);
+  unlink(hint_path);
+  unlink("./bitcask-test-hint/keydir.snapshot");
+
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-hint"), hint_options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < hint_keys - 1; i++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    s8 got = bc_get(&bc_res.bc, (s8){.data = key, .len = key_len}, &arena);
+    return_value_if(!s8cmp(got, (s8){.data = val, .len = val_len}), -1, "values are not equal.\n");
+  }
+  bc_close(&bc_res.bc);
+
+  // Snapshot of a checkpoint loaded after a crash, with the records written since replayed
+  nftw("./bitcask-test-checkpoint", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-checkpoint"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < 1000; i++) {
+    char key[10];
+    char val[10];
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    bc_put(&bc_res.bc, (s8){.data = key, .len = key_len}, (s8){.data = val, .len = val_len});
+  }
+  return_value_if(!bc_checkpoint(&bc_res.bc), -1, "checkpoint failed.\n");
+  rename("./bitcask-test-checkpoint/keydir.snapshot", "./bitcask-test-checkpoint/checkpoint");
+
+  bc_put(&bc_res.bc, s8("key1"), s8("after"));
+  bc_delete(&bc_res.bc, s8("key2"));
+  bc_close(&bc_res.bc);
+
+  // The snapshot bc_close took is replaced by the older one, as if the handle had crashed.
+  rename("./bitcask-test-checkpoint/checkpoint", "./bitcask-test-checkpoint/keydir.snapshot");
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-checkpoint"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  s8 val12 = bc_get(&bc_res.bc, s8("key999"), &arena);
+  s8 val13 = bc_get(&bc_res.bc, s8("key1"), &arena);
+  s8 val14 = bc_get(&bc_res.bc, s8("key2"), &arena);
+  return_value_if(!s8cmp(val12, s8("val999")) || !s8cmp(val13, s8("after")) || val14.len != -1,
+                  -1, "values are not equal.\n");
+  bc_close(&bc_res.bc);
+
+  // Requests submitted and completed, with the puts read back by gets after a reopen
+  nftw("./bitcask-test-submit", removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-submit"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  BcIo ios[102];
+  BcIo *done[countof(ios)];
+  s8 submit_vals[100];
+  for (u32 i = 0; i < 100; i++) {
+    char *key = new (&arena, char, 10);
+    char *val = new (&arena, char, 10);
+    isize key_len = snprintf(key, 10, "key%u", i);
+    isize val_len = snprintf(val, 10, "val%u", i);
+    submit_vals[i] = (s8){.data = val, .len = val_len};
+    ios[i] = (BcIo){.op = BC_IO_PUT, .key = {.data = key, .len = key_len}, .val = submit_vals[i]};
+  }
+  ios[100] = (BcIo){.op = BC_IO_DELETE, .key = s8("key1")};
+  ios[101] = (BcIo){.op = BC_IO_SYNC};
+  for (isize i = 0; i < countof(ios); i++) {
+    return_value_if(!bc_submit(&bc_res.bc, ios + i, &arena), -1, "submit failed.\n");
+  }
+
+  isize done_len = 0;
+  while (done_len < countof(ios)) {
+    isize len = bc_complete(&bc_res.bc, done + done_len, countof(ios) - done_len, 1);
+    return_value_if(len == 0, -1, "requests were lost.\n");
+    done_len += len;
+  }
+  for (isize i = 0; i < done_len; i++) return_value_if(!done[i]->is_ok, -1, "request failed.\n");
+  bc_close(&bc_res.bc);
+
+  bc_res = bc_open(bc_arena, s8("./bitcask-test-submit"), options);
+  return_value_if(!bc_res.is_ok, -1, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  for (u32 i = 0; i < 100; i++) {
+    ios[i] = (BcIo){.op = BC_IO_GET, .key = ios[i].key, .user_data = submit_vals + i};
+    return_value_if(!bc_submit(&bc_res.bc, ios + i, &arena), -1, "submit failed.\n");
+  }
+
+  done_len = 0;
+  while (done_len < 100) {
+    isize len = bc_complete(&bc_res.bc, done + done_len, 100 - done_len, 1);
+    return_value_if(len == 0, -1, "requests were lost.\n");
+    done_len += len;
+  }
+  for (isize i = 0; i < done_len; i++) {
+    BcIo *io = done[i];
+    bool is_deleted = s8cmp(io->key, s8("key1"));
+    bool is_equal = io->is_ok && s8cmp(io->val, *(s8 *)io->user_data);
+    return_value_if(is_deleted ? io->is_ok : !is_equal, -1, "values are not equal.\n");
+  }
+  bc_close(&bc_res.bc);
+
+  munmap(heap, cap);
+
   return 0;
 }
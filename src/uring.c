@@ -0,0 +1,212 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+#include "uring.h"
+
+#ifdef BC_IO_URING
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "utils.h"
+
+private struct io_uring_sqe *getSqe(Uring *ring, u8 flags);
+private void *mapRing(int fd, isize len, i64 offset);
+
+bool uring_create(Uring *ring, u32 entries) {
+  *ring = (Uring){0};
+
+  struct io_uring_params params = {0};
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  return_value_if(fd == -1, false, ERR_OBJECT_INITIALIZATION_FAILED);
+  ring->fd = fd;
+
+  // Older kernels map the two rings separately, newer ones expect one mapping for both.
+  ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(u32);
+  ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+    ring->cq_map_len = ring->sq_map_len;
+  }
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_map = mapRing(fd, ring->sq_map_len, IORING_OFF_SQ_RING);
+  ring->cq_map = params.features & IORING_FEAT_SINGLE_MMAP
+                     ? ring->sq_map
+                     : mapRing(fd, ring->cq_map_len, IORING_OFF_CQ_RING);
+  ring->sqes = mapRing(fd, ring->sqes_len, IORING_OFF_SQES);
+
+  bool is_mapped = ring->sq_map != NULL && ring->cq_map != NULL && ring->sqes != NULL;
+  if (!is_mapped) uring_destroy(ring);
+  return_value_if(!is_mapped, false, ERR_OBJECT_INITIALIZATION_FAILED);
+
+  char *sq = ring->sq_map;
+  char *cq = ring->cq_map;
+  ring->sq_entries = params.sq_entries;
+  ring->sq_mask = *(u32 *)(sq + params.sq_off.ring_mask);
+  ring->sq_head = (u32 *)(sq + params.sq_off.head);
+  ring->sq_tail = (u32 *)(sq + params.sq_off.tail);
+  ring->sq_array = (u32 *)(sq + params.sq_off.array);
+  ring->cq_mask = *(u32 *)(cq + params.cq_off.ring_mask);
+  ring->cq_head = (u32 *)(cq + params.cq_off.head);
+  ring->cq_tail = (u32 *)(cq + params.cq_off.tail);
+  ring->cqes = cq + params.cq_off.cqes;
+
+  return true;
+}
+
+void uring_destroy(Uring *ring) {
+  if (ring->sqes != NULL) munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map != NULL && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_len);
+  if (ring->sq_map != NULL) munmap(ring->sq_map, ring->sq_map_len);
+  close(ring->fd);
+  *ring = (Uring){0};
+}
+
+bool uring_reserve(Uring *ring, u32 count) {
+  u32 head = atomic_load_explicit((_Atomic u32 *)ring->sq_head, memory_order_acquire);
+  u32 used = *ring->sq_tail + ring->queued - head;
+  if (ring->sq_entries - used >= count) return true;
+
+  return uring_submit(ring, 0);
+}
+
+void uring_read(Uring *ring, int fd, void *buffer, u32 len, isize offset, u64 user_data) {
+  struct io_uring_sqe *sqe = getSqe(ring, 0);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uptr)buffer;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+void uring_write(Uring *ring, int fd, void *buffer, u32 len, isize offset, u64 user_data, u8 flags) {
+  struct io_uring_sqe *sqe = getSqe(ring, flags);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uptr)buffer;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
+
+void uring_fdatasync(Uring *ring, int fd, u64 user_data, u8 flags) {
+  struct io_uring_sqe *sqe = getSqe(ring, flags);
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->user_data = user_data;
+}
+
+bool uring_submit(Uring *ring, u32 wait_nr) {
+  u32 tail = *ring->sq_tail + ring->queued;
+  atomic_store_explicit((_Atomic u32 *)ring->sq_tail, tail, memory_order_release);
+
+  u32 to_submit = ring->queued;
+  ring->queued = 0;
+
+  // The kernel may take the queued requests over several calls, it stops early when interrupted.
+  while (to_submit > 0 || wait_nr > 0) {
+    u32 flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int res = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, NULL, 0);
+    if (res == -1 && errno == EINTR) continue;
+    return_value_if(res == -1, false, ERR_ACCESS);
+
+    to_submit -= res;
+    if (to_submit == 0) break;
+  }
+
+  return true;
+}
+
+bool uring_pop(Uring *ring, UringCqe *cqe) {
+  u32 head = *ring->cq_head;
+  u32 tail = atomic_load_explicit((_Atomic u32 *)ring->cq_tail, memory_order_acquire);
+  if (head == tail) return false;
+
+  struct io_uring_cqe *entry = (struct io_uring_cqe *)ring->cqes + (head & ring->cq_mask);
+  *cqe = (UringCqe){.user_data = entry->user_data, .res = entry->res};
+
+  atomic_store_explicit((_Atomic u32 *)ring->cq_head, head + 1, memory_order_release);
+  return true;
+}
+
+// The caller has reserved the slot with uring_reserve.
+private struct io_uring_sqe *getSqe(Uring *ring, u8 flags) {
+  u32 index = (*ring->sq_tail + ring->queued) & ring->sq_mask;
+  ring->sq_array[index] = index;
+  ring->queued++;
+
+  struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+  memset(sqe, 0, sizeof(*sqe));
+  if (flags & URING_LINK) sqe->flags |= IOSQE_IO_LINK;
+  if (flags & URING_DRAIN) sqe->flags |= IOSQE_IO_DRAIN;
+
+  return sqe;
+}
+
+private void *mapRing(int fd, isize len, i64 offset) {
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return map == MAP_FAILED ? NULL : map;
+}
+
+#else
+
+// Without BC_IO_URING every ring fails to set up, the other functions are never reached.
+bool uring_create(Uring *ring, u32 entries) {
+  (void)entries;
+  *ring = (Uring){0};
+  return false;
+}
+
+void uring_destroy(Uring *ring) { (void)ring; }
+
+bool uring_reserve(Uring *ring, u32 count) {
+  (void)ring, (void)count;
+  return false;
+}
+
+void uring_read(Uring *ring, int fd, void *buffer, u32 len, isize offset, u64 user_data) {
+  (void)ring, (void)fd, (void)buffer, (void)len, (void)offset, (void)user_data;
+}
+
+void uring_write(Uring *ring, int fd, void *buffer, u32 len, isize offset, u64 user_data, u8 flags) {
+  (void)ring, (void)fd, (void)buffer, (void)len, (void)offset, (void)user_data, (void)flags;
+}
+
+void uring_fdatasync(Uring *ring, int fd, u64 user_data, u8 flags) {
+  (void)ring, (void)fd, (void)user_data, (void)flags;
+}
+
+bool uring_submit(Uring *ring, u32 wait_nr) {
+  (void)ring, (void)wait_nr;
+  return false;
+}
+
+bool uring_pop(Uring *ring, UringCqe *cqe) {
+  (void)ring, (void)cqe;
+  return false;
+}
+
+#endif
@@ -0,0 +1,69 @@
+/*
+Copyright 2024 समीर सिंह Sameer Singh
+
+This file is part of bitcask.
+
+bitcask is free software: you can redistribute it and/or modify it under the terms of the GNU
+General Public License as published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+bitcask is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even
+the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General
+Public License for more details.
+
+You should have received a copy of the GNU General Public License along with bitcask. If not, see
+<https://www.gnu.org/licenses/>. */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "utils.h"
+
+// A minimal io_uring set up with the raw system calls, liburing is not needed. The ring is only
+// built when BC_IO_URING is defined (see the Makefile); otherwise, or when the kernel refuses it,
+// uring_create fails and the caller keeps to blocking I/O.
+typedef struct {
+  int fd;
+  u32 sq_entries;
+  u32 sq_mask;
+  u32 cq_mask;
+  u32 *sq_head;
+  u32 *sq_tail;
+  u32 *sq_array;
+  u32 *cq_head;
+  u32 *cq_tail;
+  void *sqes;
+  void *cqes;
+  void *sq_map;
+  void *cq_map;
+  isize sq_map_len;
+  isize cq_map_len;
+  isize sqes_len;
+  u32 queued;
+} Uring;
+
+typedef struct {
+  u64 user_data;
+  i32 res;
+} UringCqe;
+
+// Flags of a queued request. A linked request starts once the one queued before it is done, and
+// is cancelled when that one fails or comes up short. A drained request starts once every request
+// queued before it is done.
+#define URING_LINK 1
+#define URING_DRAIN 2
+
+bool uring_create(Uring *ring, u32 entries);
+void uring_destroy(Uring *ring);
+// Submits what is queued if fewer than count requests can still be queued, so that a chain of
+// linked requests is never split between two submissions. Every request is queued into a slot
+// reserved this way.
+bool uring_reserve(Uring *ring, u32 count);
+void uring_read(Uring *ring, int fd, void *buffer, u32 len, isize offset, u64 user_data);
+void uring_write(Uring *ring, int fd, void *buffer, u32 len, isize offset, u64 user_data, u8 flags);
+void uring_fdatasync(Uring *ring, int fd, u64 user_data, u8 flags);
+// Submits the queued requests and waits until at least wait_nr completions are available.
+bool uring_submit(Uring *ring, u32 wait_nr);
+// Takes the oldest available completion, returns false if there is none.
+bool uring_pop(Uring *ring, UringCqe *cqe);
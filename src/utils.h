@@ -37,6 +37,7 @@ typedef uintptr_t uptr;
 #define ERR_SYSCONF "Sysconf failed.\n"
 #define ERR_MERGE "No files to merge.\n"
 #define ERR_CRC_FAILED "Failed to verify CRC\n"
+#define ERR_CORRUPT_RECORD "Corrupt record found by the scrubber.\n"
 #define ERR_KEY_INSERT_FAILED "Cannot insert key.\n"
 #define ERR_KEY_DELETE_FAILED "Cannot delete key.\n"
 #define ERR_KEY_MISSING "Attempt to access a key which is either deleted or does not exist.\n"
@@ -46,6 +47,9 @@ typedef uintptr_t uptr;
 #define ERR_OBJECT_INITIALIZATION_FAILED "Failed to initialize object\n"
 #define ERR_ARITHEMATIC_OVERFLOW "An arithematic operation caused an overflow (result > MAX)\n"
 #define ERR_INVALID_SIZE "Invalid capacity size provided (capacity should be a power of 2 and > 0)\n"
+#define ERR_SUBMIT_GROUP_COMMIT "Requests cannot be submitted to a handle with group commit.\n"
+#define ERR_MERGE_BACKGROUND "Merges of this handle run on its background thread.\n"
+#define ERR_SHARD_COUNT "Shard count out of range or not the one the store was created with.\n"
 
 #define return_value_if(cond, value, ...) \
   do {				  \
@@ -0,0 +1,88 @@
+/*
+This is free and unencumbered software released into the public domain under The Unlicense
+(http://unlicense.org/).
+
+Adapted from wyhash final version 4 by Wang Yi <godspeed_china@yeah.net>,
+https://github.com/wangyi-fudan/wyhash. Only the 64-bit hash with the default secret is kept. */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+__extension__ typedef unsigned __int128 wy_u128;
+
+static const uint64_t wyhash_secret[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                          0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+static inline void wymum(uint64_t *a, uint64_t *b) {
+  wy_u128 r = *a;
+  r *= *b;
+  *a = (uint64_t)r;
+  *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+  wymum(&a, &b);
+  return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+  return (((uint64_t)p[0]) << 16) | (((uint64_t)p[k >> 1]) << 8) | p[k - 1];
+}
+
+static inline uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+  const uint64_t *secret = wyhash_secret;
+  const uint8_t *p = (const uint8_t *)key;
+  seed ^= wymix(seed ^ secret[0], secret[1]);
+  uint64_t a, b;
+
+  if (__builtin_expect(len <= 16, 1)) {
+    if (__builtin_expect(len >= 4, 1)) {
+      a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+      b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+    } else if (__builtin_expect(len > 0, 1)) {
+      a = wyr3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (__builtin_expect(i >= 48, 0)) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+        see1 = wymix(wyr8(p + 16) ^ secret[2], wyr8(p + 24) ^ see1);
+        see2 = wymix(wyr8(p + 32) ^ secret[3], wyr8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (__builtin_expect(i >= 48, 1));
+      seed ^= see1 ^ see2;
+    }
+    while (__builtin_expect(i > 16, 0)) {
+      seed = wymix(wyr8(p) ^ secret[1], wyr8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = wyr8(p + i - 16);
+    b = wyr8(p + i - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  wymum(&a, &b);
+  return wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}